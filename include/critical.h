@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2016 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CRITICAL_H
+#define CRITICAL_H
+
+#include <libopencm3/cm3/cortex.h>
+
+/* Masks all the interrupts, faults included, unless they already are.
+ * Returns the state to be given back to critical_section_end, so
+ * that the sections can be nested, also from interrupt handlers.
+ */
+static inline
+int critical_section_begin(void)
+{
+    int faults_already_disabled;
+
+    faults_already_disabled = cm_is_masked_faults();
+    if (!faults_already_disabled)
+    {
+        cm_disable_faults();
+    }
+
+    return faults_already_disabled;
+}
+
+static inline
+void critical_section_end(int state)
+{
+    int faults_already_disabled = state;
+
+    if (!faults_already_disabled)
+    {
+        cm_enable_faults();
+    }
+}
+
+#endif /* CRITICAL_H */
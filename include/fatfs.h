@@ -29,6 +29,21 @@ int fatfs_open(const char *pathname, int flags);
 extern
 off_t fatfs_lseek(int fd, off_t offset, int whence );
 
+/* Called with consecutive parts of a file, returns how many bytes it
+ * accepted.
+ */
+typedef size_t (*fatfs_forward_cb_t)(const void *buf, size_t len, void *arg);
+
+/* Passes up to count bytes of a regular file, from its current
+ * position, to func, stopping when func accepts less than given.
+ * With _USE_FORWARD and _FS_TINY enabled in ffconf.h the data comes
+ * straight from the FatFs sector window, otherwise through a small
+ * internal buffer.
+ * Returns the number of bytes accepted, or -1 and sets errno.
+ */
+extern
+ssize_t fatfs_forward(int fd, size_t count, fatfs_forward_cb_t func, void *arg);
+
 extern
 int fatfs_unlink(const char *path);
 
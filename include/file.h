@@ -21,17 +21,32 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
+/* Called by a driver when what poll returns for fd may have changed;
+ * it can be called from interrupt handlers.
+ */
+typedef void (*file_notify_t)(int fd, void *arg);
+
+/* One per descriptor, kept small: only the file type and permissions
+ * of struct stat are stored, the rest is made up by fstat, with the
+ * help of the driver if it has more to say.
+ */
 struct fd {
     int fd;
-    struct stat stat;
-    int isatty;
-    int isopen;
+    mode_t mode; /* st_mode */
+    unsigned int isatty:1;
+    unsigned int isopen:1;
+    unsigned int notifies:1; /* the driver calls notify, so there is no need to poll */
     int (*write)(int, char*, int);
     int (*read)(int, char*, int);
     int (*close)(int);
     short (*poll)(int);
-    int isallocated;
+    int (*fstat)(int, struct stat *); /* optional, after the generic fields */
+    file_notify_t notify; /* set by the one watching the file, like epoll */
+    void *notify_arg;
+    ssize_t (*writev)(int, const struct iovec *, int);
+    ssize_t (*readv)(int, const struct iovec *, int);
     int descriptor_flags;
     int status_flags;
     void *opaque;
@@ -40,11 +55,16 @@ struct fd {
 extern
 struct fd *file_struct_get(int fd);
 
+/* Lowest free descriptor, from 3 on; -1 if all OPEN_MAX are taken. */
 extern
 int file_alloc(void);
 
 extern
 void file_free(int fd);
 
+/* For drivers: calls the notify hook of fd, if any. */
+extern
+void file_notify(int fd);
+
 #endif
 
@@ -21,6 +21,9 @@
 
 #include_next <limits.h>
 
+/* The size of the descriptor table, that can be set with -DOPEN_MAX:
+ * drivers keep their own, smaller, pools of open objects.
+ */
 #ifndef OPEN_MAX
 #  ifdef _POSIX_OPEN_MAX
 #    define OPEN_MAX _POSIX_OPEN_MAX
@@ -37,6 +40,18 @@
 #  endif
 #endif
 
+#ifndef SSIZE_MAX
+#  define SSIZE_MAX INT_MAX /* ssize_t is int on 32-bit targets */
+#endif
+
+#ifndef IOV_MAX
+#  ifdef _XOPEN_IOV_MAX
+#    define IOV_MAX _XOPEN_IOV_MAX
+#  else
+#    define IOV_MAX 16
+#  endif
+#endif
+
 #ifndef TIMER_MAX
 #  ifdef _POSIX_TIMER_MAX
 #    define TIMER_MAX _POSIX_TIMER_MAX
@@ -45,6 +60,14 @@
 #  endif
 #endif
 
+#ifndef DELAYTIMER_MAX
+#  ifdef _POSIX_DELAYTIMER_MAX
+#    define DELAYTIMER_MAX _POSIX_DELAYTIMER_MAX
+#  else
+#    define DELAYTIMER_MAX 32
+#  endif
+#endif
+
 #ifndef SIGQUEUE_MAX
 #  ifdef _POSIX_SIGQUEUE_MAX
 #    define SIGQUEUE_MAX _POSIX_SIGQUEUE_MAX
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2016 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NETINET_TCP_H
+#define NETINET_TCP_H
+
+#include <stdint.h>
+
+/* http://pubs.opengroup.org/onlinepubs/9699919799/basedefs/netinet_tcp.h.html */
+
+#define TCP_NODELAY 0x01 /* Avoid coalescing of small segments. */
+
+/* Not POSIX, like in Linux: */
+
+#define TCP_CORK 0x03 /* Hold partial segments until uncorked. */
+#define TCP_KEEPIDLE 0x04 /* Seconds of idle before SO_KEEPALIVE probes. */
+#define TCP_KEEPINTVL 0x05 /* Seconds between SO_KEEPALIVE probes. */
+#define TCP_KEEPCNT 0x06 /* SO_KEEPALIVE probes before dropping. */
+#define TCP_SYNCNT 0x07 /* SYN retransmissions of connect. */
+#define TCP_USER_TIMEOUT 0x12 /* Milliseconds before unacknowledged data drops the connection. */
+
+/* W5100 specific: */
+
+#define TCP_RTO_ADAPTIVE 0x40 /* Retransmission time follows the measured RTT. */
+#define TCP_INFO 0x0B /* Get a struct tcp_info, also on UDP sockets. */
+
+/* Counters are since the socket was created or accepted. */
+struct tcp_info
+{
+    uint8_t tcpi_state; /* W5100 Sn_SR */
+    uint16_t tcpi_snd_mss; /* W5100 Sn_MSSR, 0 if not TCP */
+    uint32_t tcpi_bytes_sent;
+    uint32_t tcpi_bytes_received;
+    uint32_t tcpi_segs_out; /* SEND commands */
+    uint32_t tcpi_recv_cmds; /* RECV commands */
+    uint32_t tcpi_timeouts; /* retransmission or ARP timeouts */
+    uint32_t tcpi_spi_frames; /* on the socket registers and memory */
+    uint32_t tcpi_rto; /* us, W5100 RTR */
+    uint32_t tcpi_rtt; /* us, smoothed, 0 if not measured yet */
+    uint32_t tcpi_rttvar; /* us */
+    uint8_t tcpi_retries; /* W5100 RCR */
+};
+
+#endif /* NETINET_TCP_H */
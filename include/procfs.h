@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2016 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PROCFS_H
+#define PROCFS_H
+
+#include <stddef.h>
+
+/* Writes the text of a /proc entry in buf, like snprintf: returns the
+ * length it would take, which may be more than size.
+ */
+typedef int (*procfs_show_t)(char *buf, size_t size);
+
+/* Opens a read-only /proc entry. Its text is generated again at each
+ * read, so reading it twice shows the counters at different times.
+ */
+extern
+int procfs_open(const char *pathname, int flags);
+
+#endif /* PROCFS_H */
@@ -24,5 +24,14 @@
 extern
 int sigqueue_info (const siginfo_t *info);
 
+/* Defers signal delivery until the matching release.
+ * Calls can be nested.
+ */
+extern
+void signal_delivery_hold(void);
+
+extern
+void signal_delivery_release(void);
+
 #endif /* SIGQUEUE_INFO_H */
 
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2016 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SPI_BUS_H
+#define SPI_BUS_H
+
+#include <stdint.h>
+#include <libopencm3/stm32/gpio.h>
+
+/* A device on the shared SPI1 bus.
+ * br, cpol and cpha take the SPI_CR1_* values of libopencm3.
+ */
+struct spi_bus_device {
+    uint32_t cs_port;
+    uint16_t cs_pin;
+    uint32_t br;
+    uint32_t cpol;
+    uint32_t cpha;
+};
+
+/* Takes the bus for dev, reconfiguring SPI1 only if the last
+ * device that used it was a different one.
+ * The lock is recursive for the same device, as long as it is taken
+ * again by the same context (thread or interrupt handler).
+ * While the bus is held, signal delivery is deferred, so that signal
+ * handlers can use the bus too.
+ * Returns 0 on success, -1 if the bus is held by someone else.
+ */
+extern
+int spi_bus_try_acquire(struct spi_bus_device *dev);
+
+/* Like spi_bus_try_acquire, but waits.
+ * Interrupt handlers, SIGEV_THREAD timer callbacks included (they run
+ * from the timer interrupt), cannot wait for the bus: they could have
+ * preempted its owner. They must take it with spi_bus_try_acquire and
+ * defer their work when it fails, as the W5100 interrupt does; once
+ * they hold it, nested calls are fine. A handler that would wait
+ * fails the cm3_assert here instead of hanging silently.
+ */
+extern
+void spi_bus_acquire(struct spi_bus_device *dev);
+
+/* When the bus is free again, calls spi_bus_idle(). */
+extern
+void spi_bus_release(struct spi_bus_device *dev);
+
+/* Work deferred by interrupt handlers that found the bus taken.
+ * The default does nothing.
+ */
+extern
+void spi_bus_idle(void);
+
+/* Changes the baud rate of dev; applied the next time it takes the bus. */
+extern
+void spi_bus_set_baudrate(struct spi_bus_device *dev, uint32_t br);
+
+static inline
+void spi_bus_select(const struct spi_bus_device *dev)
+{
+    GPIO_BSRR(dev->cs_port) = ((uint32_t)dev->cs_pin << 16); /* lower chip select */
+}
+
+static inline
+void spi_bus_deselect(const struct spi_bus_device *dev)
+{
+    GPIO_BSRR(dev->cs_port) = dev->cs_pin; /* raise chip select */
+}
+
+/* Initializes SPI1 and its pins, once. */
+extern
+void spi_bus_init(void);
+
+#endif /* SPI_BUS_H */
+
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2016 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SPI_DMA_H
+#define SPI_DMA_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Byte clocked out when a transfer has no TX buffer. */
+#define SPI_DMA_FILL 0xFF
+
+/* Shorter transfers are done by polling, the DMA setup costs more. */
+#ifndef SPI_DMA_MIN_LEN
+#  define SPI_DMA_MIN_LEN 16
+#endif
+
+typedef void (*spi_dma_callback_t)(void *arg);
+
+/* Starts a full-duplex transfer of len bytes on SPI1.
+ * If tx is NULL, SPI_DMA_FILL is sent; if rx is NULL, the received
+ * bytes are discarded.
+ * cb, if not NULL, is called from the DMA interrupt when the transfer
+ * is complete.
+ * Returns 0 if started, -1 if another transfer is in progress.
+ * SPI1 must be already configured and enabled; chip select is
+ * handled by the caller.
+ */
+extern
+int spi_dma_start(const void *tx, void *rx, size_t len, spi_dma_callback_t cb, void *arg);
+
+extern
+int spi_dma_busy(void);
+
+/* Synchronous wrapper: starts the transfer and sleeps until the
+ * completion interrupt. Must not be called from handlers.
+ */
+extern
+void spi_dma_xfer(const void *tx, void *rx, size_t len);
+
+extern
+void spi_dma_init(void);
+
+#endif /* SPI_DMA_H */
+
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2016 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SYS_EPOLL_H
+#define SYS_EPOLL_H
+
+#include <stdint.h>
+#include <poll.h>
+
+/* Like in Linux. The files are watched through the notify hook of
+ * their struct fd, so a file can be in one epoll instance at a time.
+ * Files whose driver does not notify are polled at each epoll_wait;
+ * closing a file removes it from the instance.
+ */
+
+#define EPOLLIN     POLLIN
+#define EPOLLPRI    POLLPRI
+#define EPOLLOUT    POLLOUT
+#define EPOLLRDNORM POLLRDNORM
+#define EPOLLRDBAND POLLRDBAND
+#define EPOLLWRNORM POLLWRNORM
+#define EPOLLWRBAND POLLWRBAND
+#define EPOLLERR    POLLERR
+#define EPOLLHUP    POLLHUP
+
+#define EPOLLONESHOT (1U << 30)
+#define EPOLLET      (1U << 31)
+
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+#define EPOLL_CLOEXEC 0x01
+
+typedef union epoll_data
+{
+    void *ptr;
+    int fd;
+    uint32_t u32;
+    uint64_t u64;
+} epoll_data_t;
+
+struct epoll_event
+{
+    uint32_t events;
+    epoll_data_t data;
+};
+
+extern
+int epoll_create(int size);
+
+extern
+int epoll_create1(int flags);
+
+extern
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+
+/* timeout is in milliseconds, -1 to wait forever. */
+extern
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+
+#endif /* SYS_EPOLL_H */
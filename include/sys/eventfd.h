@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2016 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SYS_EVENTFD_H
+#define SYS_EVENTFD_H
+
+#include <stdint.h>
+#include <fcntl.h>
+
+/* Like in Linux. An eventfd is a counter: write adds to it, and read
+ * takes all of it, or one with EFD_SEMAPHORE; both can be done from
+ * interrupt handlers, where they never block.
+ */
+
+typedef uint64_t eventfd_t;
+
+#define EFD_SEMAPHORE 0x01
+#define EFD_CLOEXEC   0x02
+#define EFD_NONBLOCK  O_NONBLOCK
+
+extern
+int eventfd(unsigned int initval, int flags);
+
+extern
+int eventfd_read(int fd, eventfd_t *value);
+
+extern
+int eventfd_write(int fd, eventfd_t value);
+
+#endif /* SYS_EVENTFD_H */
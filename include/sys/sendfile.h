@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2016 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SYS_SENDFILE_H
+#define SYS_SENDFILE_H
+
+#include <sys/types.h>
+
+/* Like in Linux: copies count bytes from in_fd, a regular file, to
+ * out_fd, without passing through a user buffer.
+ * If offset is not NULL, reading starts from *offset, which is updated,
+ * and the file position of in_fd is left unchanged.
+ * Returns the number of bytes written, or -1 and sets errno.
+ */
+extern
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+
+#endif /* SYS_SENDFILE_H */
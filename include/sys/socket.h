@@ -23,6 +23,7 @@
 
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 typedef int32_t socklen_t;
 
@@ -40,6 +41,29 @@ struct sockaddr_storage
     char sa_data[6]; /* TODO: enough for IPV6 */
 };
 
+struct linger
+{
+    int l_onoff; /* Indicates whether linger option is enabled. */
+    int l_linger; /* Linger time, in seconds. */
+};
+
+struct msghdr
+{
+    void *msg_name; /* Optional address. */
+    socklen_t msg_namelen; /* Size of address. */
+    struct iovec *msg_iov; /* Scatter/gather array. */
+    int msg_iovlen; /* Members in msg_iov. */
+    void *msg_control; /* Ancillary data; not supported. */
+    socklen_t msg_controllen; /* Ancillary data buffer len. */
+    int msg_flags; /* Flags on received message. */
+};
+
+struct mmsghdr
+{
+    struct msghdr msg_hdr; /* Message header (not POSIX). */
+    unsigned int msg_len; /* Bytes transmitted for this message. */
+};
+
 #define AF_INET   0x1 /* Internet domain sockets for use with IPv4 addresses. */
 #define AF_INET6  0x2 /* Internet domain sockets for use with IPv6 addresses. */
 #define AF_UNIX   0x3 /* UNIX domain sockets. */
@@ -57,6 +81,9 @@ struct sockaddr_storage
 #define MSG_PEEK      0x10 /* Leave received data in queue. */
 #define MSG_TRUNC     0x20 /* Normal data truncated. */
 #define MSG_WAITALL   0x40 /* Attempt to fill the read buffer. */
+#define MSG_MORE      0x80 /* Sender will send more (not POSIX). */
+#define MSG_DONTWAIT  0x100 /* Nonblocking operation (not POSIX). */
+#define MSG_WAITFORONE 0x200 /* recvmmsg: do not wait after the first (not POSIX). */
 
 #define SO_ACCEPTCONN   0x01 /* Socket is accepting connections. */
 #define SO_BROADCAST    0x02 /* Transmission of broadcast messages is supported. */
@@ -77,7 +104,7 @@ struct sockaddr_storage
 
 #define SOL_SOCKET 0xFF /* Options to be accessed at socket level, not protocol level. */
 
-#define SOMAXCONN 1 /* The maximum backlog queue length. */
+#define SOMAXCONN 3 /* The maximum backlog queue length. */
 
 #define SHUT_RD   0x1 /* Disables further receive operations. */
 #define SHUT_WR   0x2 /* Disables further send and receive operations. */
@@ -111,18 +138,22 @@ extern
 ssize_t recvfrom(int, void *__restrict, size_t, int,
         struct sockaddr *__restrict, socklen_t *__restrict);
 
-#if 0
 extern
 ssize_t recvmsg(int, struct msghdr *, int);
-#endif
+
+struct timespec;
+
+extern
+int     recvmmsg(int, struct mmsghdr *, unsigned int, int, struct timespec *);
 
 extern
 ssize_t send(int, const void *, size_t, int);
 
-#if 0
 extern
 ssize_t sendmsg(int, const struct msghdr *, int);
-#endif
+
+extern
+int     sendmmsg(int, struct mmsghdr *, unsigned int, int);
 
 extern
 ssize_t sendto(int, const void *, size_t, int, const struct sockaddr *,
@@ -141,10 +172,10 @@ int     socket(int, int, int);
 #if 0
 extern
 int     sockatmark(int);
+#endif
 
 extern
 int     socketpair(int, int, int, int[2]);
-#endif
 
 #endif /* SYS_SOCKET_H */
 
@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2016 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SYS_TIMERFD_H
+#define SYS_TIMERFD_H
+
+#include <time.h>
+#include <fcntl.h>
+
+/* Like in Linux. A timerfd is a POSIX timer that makes its descriptor
+ * readable when it expires: read gives the number of expirations since
+ * the last read, overruns included, as a uint64_t.
+ */
+
+#define TFD_TIMER_ABSTIME TIMER_ABSTIME
+
+#define TFD_NONBLOCK O_NONBLOCK
+#define TFD_CLOEXEC  0x01
+
+extern
+int timerfd_create(int clockid, int flags);
+
+extern
+int timerfd_settime(int fd, int flags,
+        const struct itimerspec *new_value, struct itimerspec *old_value);
+
+extern
+int timerfd_gettime(int fd, struct itimerspec *curr_value);
+
+#endif /* SYS_TIMERFD_H */
@@ -363,6 +363,17 @@
 #define W5100_INT_TIMEOUT   0x08
 #define W5100_INT_SEND_OK   0x10
 
+/* SPI traffic counters, for benchmarking.
+ * Every frame is 4 bytes on the bus (opcode, address, data).
+ */
+struct w5100_spi_stats {
+    uint32_t frames; /* chip select cycles */
+    uint32_t read_bytes; /* bytes read by w5100_read_mem */
+    uint32_t write_bytes; /* bytes written by w5100_write_mem */
+    uint32_t shadow_hits; /* register accesses served by the shadow */
+    uint32_t shadow_mismatches; /* with W5100_SHADOW_CHECK */
+};
+
 extern
 void w5100_read_mem(uint16_t addr, void *buf, size_t n);
 
@@ -412,6 +423,68 @@ uint16_t w5100_sock_reg_get(uint16_t sn_reg, int socket)
 #define w5100_write_sock_reg(sn_reg, socket, val) \
     w5100_write_reg(w5100_sock_reg_get((sn_reg), (socket)), (val))
 
+extern
+void w5100_spi_stats_get(struct w5100_spi_stats *stats);
+
+extern
+void w5100_spi_stats_reset(void);
+
+/* SPI frames on the registers and the RX/TX memory of a socket, since
+ * start-up; not cleared by w5100_spi_stats_reset.
+ */
+extern
+uint32_t w5100_spi_sock_frames(int isocket);
+
+/* Forgets the register shadow, after the chip has been reset by other
+ * means than the RST bit of MR (which is tracked).
+ */
+extern
+void w5100_shadow_invalidate(void);
+
+/* For interrupt handlers: takes the SPI bus for the W5100 only if it
+ * is free. Returns 0 on success, and the bus must then be given back
+ * with w5100_spi_unlock. The other W5100 functions can be called in
+ * between.
+ */
+extern
+int w5100_spi_trylock(void);
+
+/* Takes the SPI bus for the W5100, to keep a sequence of accesses
+ * together; can be nested.
+ */
+extern
+void w5100_spi_lock(void);
+
+extern
+void w5100_spi_unlock(void);
+
+/* Returns the Sn_IR events of a socket since the last call, and
+ * forgets them.
+ * With W5100_INT_ENABLED, events are latched by the INT pin interrupt
+ * and no SPI access is needed while nothing happens; otherwise Sn_IR
+ * is read (and cleared) now.
+ */
+extern
+uint8_t w5100_sock_events_take(int isocket);
+
+/* Same, for the common IR register. */
+extern
+uint8_t w5100_events_take(void);
+
+/* Called with W5100_INT_ENABLED when new Sn_IR events of a socket are
+ * latched, also from the interrupt handler. The empty default is
+ * replaced by the socket layer, to notify the watchers of the files.
+ */
+extern
+void w5100_sock_events_notify(int isocket);
+
+extern
+int w5100_int_enabled(void);
+
+/* Programs IMR and the INT pin interrupt, after a chip reset. */
+extern
+void w5100_int_init(void);
+
 extern
 void w5100_init(void);
 
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2016 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef W5100_SOCKET_H
+#define W5100_SOCKET_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+/*
+ * Zero-copy receive API.
+ *
+ * The received bytes stay in the W5100 RX memory, which is a ring:
+ * a view describes the unread data as at most two segments of chip
+ * addresses, and the data is fetched from SPI only when it is needed,
+ * in the order and the amount the consumer wants, without a full-size
+ * copy in RAM.
+ */
+
+struct w5100_rx_segment {
+    uint16_t addr; /* W5100 memory address */
+    uint16_t len;
+};
+
+struct w5100_recv_view {
+    struct w5100_rx_segment seg[2]; /* seg[1].len is 0 if not wrapped */
+    size_t len; /* bytes available: seg[0].len + seg[1].len */
+    struct sockaddr_in peer; /* datagram source, for SOCK_DGRAM */
+    /* private */
+    int isocket;
+    uint16_t pread; /* Sn_RX_RD at the beginning of the view */
+    uint16_t rx_avail; /* Sn_RX_RSR when the view was taken */
+    uint16_t header_len; /* bytes of W5100 UDP header before the data */
+    const uint8_t *ram; /* the data is in RAM instead, if not NULL */
+};
+
+/* Waits for received data on a socket, respecting O_NONBLOCK and
+ * SO_RCVTIMEO like recv, and describes it in view without reading it.
+ * For SOCK_DGRAM the view covers exactly one datagram.
+ * Returns the number of bytes in the view, or -1 and sets errno.
+ */
+extern
+ssize_t w5100_recv_acquire(int sockfd, struct w5100_recv_view *view);
+
+/* Copies len bytes starting from offset inside the view into buf.
+ * Returns the number of bytes copied, less than len at the end of the
+ * view.
+ */
+extern
+size_t w5100_recv_read(const struct w5100_recv_view *view, size_t offset, void *buf, size_t len);
+
+/* Gives back the first len bytes of the view to the W5100, the rest
+ * will be seen again by the next receive. A datagram is always
+ * consumed as a whole.
+ * Returns 0, or -1 and sets errno.
+ */
+extern
+int w5100_recv_release(int sockfd, const struct w5100_recv_view *view, size_t len);
+
+/* Called with consecutive chunks of received data; returns 0 to get
+ * more, anything else to stop.
+ */
+typedef int (*w5100_recv_cb_t)(const uint8_t *chunk, size_t n, void *arg);
+
+/* Streams at most len bytes of received data (or one datagram) to cb,
+ * through a small internal buffer. Waits like w5100_recv_acquire.
+ * Returns the number of bytes consumed, or -1 and sets errno.
+ */
+extern
+ssize_t w5100_recv_stream(int sockfd, size_t len, w5100_recv_cb_t cb, void *arg);
+
+/* Advances the background work of the sockets, like the teardown of
+ * closed connections. It is also done by poll and socket creation;
+ * call it periodically if those are not used for long.
+ */
+extern
+void w5100_socket_service(void);
+
+/* Counters of TCP and UDP transmissions, since the last reset. */
+struct w5100_socket_stats {
+    uint32_t send_commands; /* SEND commands, so segments or datagrams */
+    uint32_t send_bytes; /* bytes given to SEND commands */
+    uint32_t recv_commands; /* RECV commands */
+    uint32_t recv_bytes; /* bytes given to the application */
+    uint32_t timeouts; /* TIMEOUT interrupts of any socket */
+};
+
+extern
+void w5100_socket_stats_get(struct w5100_socket_stats *stats);
+
+extern
+void w5100_socket_stats_reset(void);
+
+/* Writes a text report of the chip and per-socket counters in buf,
+ * like snprintf: returns the length it would take.
+ * It is the content of /proc/net/w5100 when procfs is linked.
+ * Weak, so that procfs can be linked without the socket layer:
+ * the entry is then not shown.
+ */
+extern
+int w5100_socket_proc_show(char *buf, size_t size) __attribute__((__weak__));
+
+#endif /* W5100_SOCKET_H */
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2016 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef WAIT_H
+#define WAIT_H
+
+#include <time.h>
+
+/* Blocking calls sleep with WFI between their checks, instead of
+ * spinning on the clock. The sources that can report their events
+ * (interrupt handlers, timers, signals, notifying files) call
+ * wait_event_signal(); the callers take wait_event_seq() before
+ * checking their condition, so that an event that arrives meanwhile
+ * is not lost.
+ * All the deadlines are CLOCK_MONOTONIC absolute times.
+ */
+
+extern
+unsigned int wait_event_seq(void);
+
+/* Can be called from interrupt handlers. */
+extern
+void wait_event_signal(void);
+
+/* Sleeps until an event is signalled after seq was taken, or the
+ * deadline passes.
+ * Returns 1 on events, 0 when the deadline passed.
+ */
+extern
+int wait_event(unsigned int seq, const struct timespec *deadline);
+
+/* For the conditions that can only be polled: sleeps until the next
+ * interrupt, which is the next SysTick at most, or the deadline passes.
+ * Returns 1 when woken, 0 when the deadline passed.
+ */
+extern
+int wait_interrupt(const struct timespec *deadline);
+
+/* Sleeps until the deadline of clock_id passes.
+ * Returns 0, or -1 and sets errno if the clock cannot be read.
+ */
+extern
+int wait_until(clockid_t clock_id, const struct timespec *deadline);
+
+/* Work that must be done in time even without events: the waits do
+ * not sleep beyond t, and return as if woken by an event when it
+ * passes. The earliest of all the hints published applies; each one
+ * is forgotten once it has passed.
+ */
+extern
+void wait_deadline_hint(const struct timespec *t);
+
+/* Whether the caller can wait for others: not from handlers, nor with
+ * interrupts masked. Calls that would block fail with EAGAIN instead.
+ */
+extern
+int wait_allowed(void);
+
+/* Percentage of the time spent sleeping since the last reset. */
+extern
+unsigned int wait_idle_percent(void);
+
+extern
+void wait_stats_reset(void);
+
+#endif /* WAIT_H */
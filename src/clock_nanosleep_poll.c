@@ -18,8 +18,9 @@
  */
 #include <time.h>
 #include "timespec.h"
+#include "wait.h"
 
-/* polling implementation */
+/* sleeps with WFI between the clock ticks */
 int clock_nanosleep(
         clockid_t clock_id,
         int flags,
@@ -39,18 +40,14 @@ int clock_nanosleep(
         rqtp = &tend;
     }
 
-    while (ret == 0)
+    if (ret == 0)
     {
-        if (timespec_diff(rqtp, &tcurrent, NULL) <= 0)
-        {
-            if (rmtp != NULL)
-            {
-                rmtp->tv_sec = 0;
-                rmtp->tv_nsec = 0;
-            }
-            break;
-        }
-        ret = clock_gettime(clock_id, &tcurrent);
+        ret = wait_until(clock_id, rqtp);
+    }
+    if ((ret == 0) && (rmtp != NULL))
+    {
+        rmtp->tv_sec = 0;
+        rmtp->tv_nsec = 0;
     }
 
     return ret;
@@ -0,0 +1,574 @@
+/*
+ * Copyright (c) 2016 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+#include "file.h"
+#include "timespec.h"
+#include "wait.h"
+#include "critical.h"
+
+#ifndef EPOLL_MAX
+#  define EPOLL_MAX 2
+#endif
+
+#ifndef EPOLL_ITEMS_MAX
+#  define EPOLL_ITEMS_MAX OPEN_MAX
+#endif
+
+struct epoll_instance;
+
+/* A watched file. It is in the ready list of its instance when its
+ * driver notified it, when it was ready at the last epoll_wait in
+ * level-triggered mode, or always if its driver does not notify.
+ */
+struct epoll_item {
+    struct epoll_instance *ep; /* NULL if free */
+    int fd;
+    struct epoll_event event;
+    uint32_t last; /* events last reported, for files that are polled */
+    volatile int queued;
+    struct epoll_item *next;
+};
+
+struct epoll_instance {
+    int allocated;
+    struct epoll_item *ready_head;
+    struct epoll_item *ready_tail;
+};
+
+static
+int epoll_close(int fd);
+
+static
+struct epoll_instance epoll_instances[EPOLL_MAX];
+
+static
+struct epoll_item epoll_items[EPOLL_ITEMS_MAX];
+
+static
+struct epoll_instance *epoll_get(int epfd)
+{
+    struct epoll_instance *ep;
+    struct fd *f;
+
+    f = file_struct_get(epfd);
+    if ((epfd < 0) || (f == NULL) || !f->isopen || (f->close != epoll_close))
+    {
+        errno = EBADF;
+        ep = NULL;
+    }
+    else
+    {
+        ep = f->opaque;
+    }
+    return ep;
+}
+
+/* Whether the item is still the one watching its file: closing the
+ * file and opening another one with the same number forgets it.
+ */
+static
+int epoll_item_attached(const struct epoll_item *it)
+{
+    struct fd *f;
+
+    f = file_struct_get(it->fd);
+
+    return (f != NULL) && f->isopen && (f->notify_arg == it);
+}
+
+static
+void epoll_ready_push(struct epoll_instance *ep, struct epoll_item *it)
+{
+    int cs_state;
+
+    cs_state = critical_section_begin();
+    if (!it->queued)
+    {
+        it->queued = 1;
+        it->next = NULL;
+        if (ep->ready_tail != NULL)
+        {
+            ep->ready_tail->next = it;
+        }
+        else
+        {
+            ep->ready_head = it;
+        }
+        ep->ready_tail = it;
+    }
+    critical_section_end(cs_state);
+}
+
+/* Empties the ready list into batch, returning how many there were. */
+static
+int epoll_ready_take(struct epoll_instance *ep, struct epoll_item **batch)
+{
+    struct epoll_item *it;
+    int n = 0;
+    int cs_state;
+
+    cs_state = critical_section_begin();
+    for (it = ep->ready_head; it != NULL; it = it->next)
+    {
+        it->queued = 0;
+        batch[n] = it;
+        n++;
+    }
+    ep->ready_head = NULL;
+    ep->ready_tail = NULL;
+    critical_section_end(cs_state);
+
+    return n;
+}
+
+static
+void epoll_ready_unlink(struct epoll_instance *ep, struct epoll_item *it)
+{
+    struct epoll_item *prev = NULL;
+    struct epoll_item *cur;
+    int cs_state;
+
+    cs_state = critical_section_begin();
+    for (cur = ep->ready_head; (cur != NULL) && (cur != it); cur = cur->next)
+    {
+        prev = cur;
+    }
+    if (cur != NULL)
+    {
+        if (prev != NULL)
+        {
+            prev->next = cur->next;
+        }
+        else
+        {
+            ep->ready_head = cur->next;
+        }
+        if (ep->ready_tail == cur)
+        {
+            ep->ready_tail = prev;
+        }
+        cur->queued = 0;
+    }
+    critical_section_end(cs_state);
+}
+
+/* The notify hook of the watched files. */
+static
+void epoll_notify(int fd, void *arg)
+{
+    struct epoll_item *it = arg;
+
+    (void)fd;
+    if ((it != NULL) && (it->ep != NULL))
+    {
+        epoll_ready_push(it->ep, it);
+    }
+}
+
+static
+void epoll_item_remove(struct epoll_item *it)
+{
+    struct fd *f;
+    int cs_state;
+
+    f = file_struct_get(it->fd);
+    cs_state = critical_section_begin();
+    if ((f != NULL) && (f->notify_arg == it))
+    {
+        f->notify = NULL;
+        f->notify_arg = NULL;
+    }
+    critical_section_end(cs_state);
+    epoll_ready_unlink(it->ep, it);
+    it->ep = NULL;
+}
+
+/* Items of files closed in the meantime are taken back here. */
+static
+struct epoll_item *epoll_item_alloc(void)
+{
+    struct epoll_item *ret = NULL;
+    int i;
+
+    for (i = 0; (i < EPOLL_ITEMS_MAX) && (ret == NULL); i++)
+    {
+        struct epoll_item *it = &epoll_items[i];
+
+        if ((it->ep != NULL) && !epoll_item_attached(it))
+        {
+            epoll_item_remove(it);
+        }
+        if (it->ep == NULL)
+        {
+            ret = it;
+        }
+    }
+    return ret;
+}
+
+static
+short epoll_poll(int fd)
+{
+    short ret;
+    struct fd *f;
+    struct epoll_instance *ep;
+
+    f = file_struct_get(fd);
+    ep = f->opaque;
+    /* something may be ready */
+    if (ep->ready_head != NULL)
+    {
+        ret = POLLIN|POLLRDNORM;
+    }
+    else
+    {
+        ret = 0;
+    }
+    return ret;
+}
+
+static
+int epoll_close(int fd)
+{
+    struct fd *f;
+    struct epoll_instance *ep;
+    int i;
+
+    f = file_struct_get(fd);
+    ep = f->opaque;
+    for (i = 0; i < EPOLL_ITEMS_MAX; i++)
+    {
+        if (epoll_items[i].ep == ep)
+        {
+            epoll_item_remove(&epoll_items[i]);
+        }
+    }
+    ep->allocated = 0;
+    f->isopen = 0;
+    file_free(fd);
+
+    return 0;
+}
+
+int epoll_create1(int flags)
+{
+    int ret;
+    struct epoll_instance *ep = NULL;
+    int i;
+
+    for (i = 0; (i < EPOLL_MAX) && (ep == NULL); i++)
+    {
+        if (!epoll_instances[i].allocated)
+        {
+            ep = &epoll_instances[i];
+        }
+    }
+    if (flags & ~EPOLL_CLOEXEC)
+    {
+        errno = EINVAL;
+        ret = -1;
+    }
+    else if (ep == NULL)
+    {
+        errno = EMFILE;
+        ret = -1;
+    }
+    else
+    {
+        ret = file_alloc();
+        if (ret < 0)
+        {
+            errno = ENFILE;
+        }
+        else
+        {
+            struct fd *f;
+
+            ep->allocated = 1;
+            ep->ready_head = NULL;
+            ep->ready_tail = NULL;
+
+            f = file_struct_get(ret);
+            f->isatty = 0;
+            f->isopen = 1;
+            f->close = epoll_close;
+            f->poll = epoll_poll;
+            f->mode = S_IFCHR|S_IRUSR;
+            f->status_flags = O_RDONLY;
+            f->descriptor_flags = (flags & EPOLL_CLOEXEC) ? FD_CLOEXEC : 0;
+            f->opaque = ep;
+        }
+    }
+    return ret;
+}
+
+int epoll_create(int size)
+{
+    int ret;
+
+    if (size <= 0)
+    {
+        errno = EINVAL;
+        ret = -1;
+    }
+    else
+    {
+        ret = epoll_create1(0);
+    }
+    return ret;
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+    int ret;
+    struct epoll_instance *ep;
+    struct fd *f;
+
+    ep = epoll_get(epfd);
+    f = file_struct_get(fd);
+    if (ep == NULL)
+    {
+        ret = -1;
+    }
+    else if ((fd < 0) || (f == NULL) || !f->isopen)
+    {
+        errno = EBADF;
+        ret = -1;
+    }
+    else if (fd == epfd)
+    {
+        errno = EINVAL;
+        ret = -1;
+    }
+    else if (f->poll == NULL)
+    {
+        errno = EPERM;
+        ret = -1;
+    }
+    else if ((event == NULL) && ((op == EPOLL_CTL_ADD) || (op == EPOLL_CTL_MOD)))
+    {
+        errno = EFAULT;
+        ret = -1;
+    }
+    else if ((op == EPOLL_CTL_ADD) && (f->notify_arg != NULL))
+    {
+        /* here or in another instance */
+        errno = EEXIST;
+        ret = -1;
+    }
+    else if (op == EPOLL_CTL_ADD)
+    {
+        struct epoll_item *it;
+
+        it = epoll_item_alloc();
+        if (it == NULL)
+        {
+            errno = ENOMEM;
+            ret = -1;
+        }
+        else
+        {
+            int cs_state;
+
+            it->ep = ep;
+            it->fd = fd;
+            it->event = *event;
+            it->last = 0;
+            it->queued = 0;
+            cs_state = critical_section_begin();
+            f->notify = epoll_notify;
+            f->notify_arg = it;
+            critical_section_end(cs_state);
+            /* it may be ready already */
+            epoll_ready_push(ep, it);
+            ret = 0;
+        }
+    }
+    else
+    {
+        struct epoll_item *it = f->notify_arg;
+
+        if ((it == NULL) || (it->ep != ep))
+        {
+            errno = ENOENT;
+            ret = -1;
+        }
+        else if (op == EPOLL_CTL_MOD)
+        {
+            it->event = *event;
+            it->last = 0;
+            epoll_ready_push(ep, it);
+            ret = 0;
+        }
+        else if (op == EPOLL_CTL_DEL)
+        {
+            epoll_item_remove(it);
+            ret = 0;
+        }
+        else
+        {
+            errno = EINVAL;
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+/* Looks only at the items in the ready list. */
+static
+int epoll_collect(struct epoll_instance *ep, struct epoll_event *events, int maxevents)
+{
+    struct epoll_item *batch[EPOLL_ITEMS_MAX];
+    int nbatch;
+    int nready = 0;
+    int i;
+
+    nbatch = epoll_ready_take(ep, batch);
+    for (i = 0; i < nbatch; i++)
+    {
+        struct epoll_item *it = batch[i];
+        struct fd *f;
+        uint32_t revents;
+        int report;
+        int requeue;
+
+        if (it->ep != ep)
+        {
+            /* removed meanwhile */
+            continue;
+        }
+        else if (!epoll_item_attached(it))
+        {
+            /* the file was closed */
+            epoll_item_remove(it);
+            continue;
+        }
+        else if ((it->event.events & ~(EPOLLET|EPOLLONESHOT)) == 0)
+        {
+            /* EPOLLONESHOT already fired, until EPOLL_CTL_MOD */
+            continue;
+        }
+        f = file_struct_get(it->fd);
+        revents = (uint16_t)f->poll(it->fd);
+        revents &= (it->event.events | EPOLLHUP | EPOLLERR);
+        if (!f->notifies)
+        {
+            /* polled each time; edge-triggered reports the new events */
+            report = (it->event.events & EPOLLET) ? ((revents & ~it->last) != 0) : (revents != 0);
+            requeue = 1;
+        }
+        else
+        {
+            report = (revents != 0);
+            /* level-triggered stays while ready */
+            requeue = report && !(it->event.events & EPOLLET);
+        }
+        if (report && (nready < maxevents))
+        {
+            events[nready].events = revents;
+            events[nready].data = it->event.data;
+            nready++;
+            it->last = revents;
+            if (it->event.events & EPOLLONESHOT)
+            {
+                it->event.events &= (EPOLLET|EPOLLONESHOT);
+                requeue = 0;
+            }
+        }
+        else if (report)
+        {
+            /* no room, for the next time */
+            requeue = 1;
+        }
+        else
+        {
+            it->last = revents;
+        }
+        if (requeue)
+        {
+            epoll_ready_push(ep, it);
+        }
+    }
+    return nready;
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+    int ret;
+    struct epoll_instance *ep;
+
+    ep = epoll_get(epfd);
+    if (ep == NULL)
+    {
+        ret = -1;
+    }
+    else if (maxevents <= 0)
+    {
+        errno = EINVAL;
+        ret = -1;
+    }
+    else
+    {
+        struct timespec tend;
+        int timeout_expired;
+
+        if (timeout < 0)
+        {
+            tend = TIMESPEC_INFINITY;
+        }
+        else
+        {
+            struct timespec tcurrent;
+            struct timespec timeout_ts;
+
+            timeout_ts.tv_sec = timeout / MSECS_IN_SEC;
+            timeout_ts.tv_nsec = (timeout % MSECS_IN_SEC) * (NSECS_IN_SEC / MSECS_IN_SEC);
+            clock_gettime(CLOCK_MONOTONIC, &tcurrent);
+            timespec_add(&tcurrent, &timeout_ts, &tend);
+        }
+        do
+        {
+            unsigned int seq;
+
+            seq = wait_event_seq();
+            ret = epoll_collect(ep, events, maxevents);
+            if (ret != 0)
+            {
+                break;
+            }
+            if (ep->ready_head == NULL)
+            {
+                /* only notifying files left: they wake us */
+                timeout_expired = (wait_event(seq, &tend) == 0);
+            }
+            else
+            {
+                timeout_expired = (wait_interrupt(&tend) == 0);
+            }
+        } while (!timeout_expired);
+    }
+    return ret;
+}
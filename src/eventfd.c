@@ -0,0 +1,310 @@
+/*
+ * Copyright (c) 2016 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdint.h>
+#include <poll.h>
+#include "file.h"
+#include "timespec.h"
+#include "wait.h"
+#include "critical.h"
+
+#ifndef EVENTFD_MAX
+#  define EVENTFD_MAX 2
+#endif
+
+#define EVENTFD_COUNT_MAX (UINT64_MAX - 1)
+
+struct eventfd {
+    int allocated;
+    int semaphore;
+    uint64_t count; /* changed also by interrupt handlers */
+};
+
+static
+int eventfd_close(int fd);
+
+static
+struct eventfd eventfds[EVENTFD_MAX];
+
+static
+struct eventfd *eventfd_get(int fd)
+{
+    struct eventfd *e;
+    struct fd *f;
+
+    f = file_struct_get(fd);
+    if ((f == NULL) || !f->isopen || (f->close != eventfd_close))
+    {
+        errno = EBADF;
+        e = NULL;
+    }
+    else
+    {
+        e = f->opaque;
+    }
+    return e;
+}
+
+static
+int eventfd_file_read(int fd, char *ptr, int len)
+{
+    int ret;
+    struct eventfd *e;
+
+    e = eventfd_get(fd);
+    if (e == NULL)
+    {
+        ret = -1;
+    }
+    else if (len < (int)sizeof(eventfd_t))
+    {
+        errno = EINVAL;
+        ret = -1;
+    }
+    else
+    {
+        int nonblock;
+
+        nonblock = (file_struct_get(fd)->status_flags & O_NONBLOCK) || !wait_allowed();
+        do
+        {
+            unsigned int seq;
+            eventfd_t value;
+            int cs_state;
+
+            seq = wait_event_seq();
+            cs_state = critical_section_begin();
+            if (e->count == 0)
+            {
+                value = 0;
+            }
+            else if (e->semaphore)
+            {
+                value = 1;
+            }
+            else
+            {
+                value = e->count;
+            }
+            e->count -= value;
+            critical_section_end(cs_state);
+            if (value > 0)
+            {
+                memcpy(ptr, &value, sizeof(value));
+                /* there is room for writers again */
+                file_notify(fd);
+                ret = sizeof(value);
+                break;
+            }
+            else if (nonblock)
+            {
+                errno = EAGAIN;
+                ret = -1;
+                break;
+            }
+            wait_event(seq, &TIMESPEC_INFINITY);
+        } while (1);
+    }
+    return ret;
+}
+
+static
+int eventfd_file_write(int fd, char *ptr, int len)
+{
+    int ret;
+    struct eventfd *e;
+    eventfd_t value = 0;
+
+    e = eventfd_get(fd);
+    if (len >= (int)sizeof(value))
+    {
+        memcpy(&value, ptr, sizeof(value));
+    }
+    if (e == NULL)
+    {
+        ret = -1;
+    }
+    else if (len < (int)sizeof(eventfd_t))
+    {
+        errno = EINVAL;
+        ret = -1;
+    }
+    else if (value == UINT64_MAX)
+    {
+        errno = EINVAL;
+        ret = -1;
+    }
+    else
+    {
+        int nonblock;
+
+        nonblock = (file_struct_get(fd)->status_flags & O_NONBLOCK) || !wait_allowed();
+        do
+        {
+            unsigned int seq;
+            int added;
+            int cs_state;
+
+            seq = wait_event_seq();
+            cs_state = critical_section_begin();
+            added = (e->count <= (EVENTFD_COUNT_MAX - value));
+            if (added)
+            {
+                e->count += value;
+            }
+            critical_section_end(cs_state);
+            if (added)
+            {
+                file_notify(fd);
+                ret = sizeof(value);
+                break;
+            }
+            else if (nonblock)
+            {
+                errno = EAGAIN;
+                ret = -1;
+                break;
+            }
+            wait_event(seq, &TIMESPEC_INFINITY);
+        } while (1);
+    }
+    return ret;
+}
+
+static
+short eventfd_poll(int fd)
+{
+    short ret;
+    struct eventfd *e;
+
+    e = eventfd_get(fd);
+    if (e == NULL)
+    {
+        ret = POLLNVAL;
+    }
+    else
+    {
+        int cs_state;
+
+        ret = 0;
+        cs_state = critical_section_begin();
+        if (e->count > 0)
+        {
+            ret |= POLLIN|POLLRDNORM;
+        }
+        if (e->count < EVENTFD_COUNT_MAX)
+        {
+            ret |= POLLOUT|POLLWRNORM;
+        }
+        critical_section_end(cs_state);
+    }
+    return ret;
+}
+
+static
+int eventfd_close(int fd)
+{
+    int ret;
+    struct eventfd *e;
+
+    e = eventfd_get(fd);
+    if (e == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        file_struct_get(fd)->isopen = 0;
+        file_free(fd);
+        e->allocated = 0;
+        ret = 0;
+    }
+    return ret;
+}
+
+int eventfd(unsigned int initval, int flags)
+{
+    int ret;
+    struct eventfd *e = NULL;
+    int i;
+
+    for (i = 0; (i < EVENTFD_MAX) && (e == NULL); i++)
+    {
+        if (!eventfds[i].allocated)
+        {
+            e = &eventfds[i];
+        }
+    }
+    if (flags & ~(EFD_SEMAPHORE|EFD_CLOEXEC|EFD_NONBLOCK))
+    {
+        errno = EINVAL;
+        ret = -1;
+    }
+    else if (e == NULL)
+    {
+        errno = EMFILE;
+        ret = -1;
+    }
+    else
+    {
+        ret = file_alloc();
+        if (ret < 0)
+        {
+            errno = ENFILE;
+        }
+        else
+        {
+            struct fd *f;
+
+            e->allocated = 1;
+            e->semaphore = ((flags & EFD_SEMAPHORE) != 0);
+            e->count = initval;
+
+            f = file_struct_get(ret);
+            f->isatty = 0;
+            f->isopen = 1;
+            f->read = eventfd_file_read;
+            f->write = eventfd_file_write;
+            f->close = eventfd_close;
+            f->poll = eventfd_poll;
+            f->notifies = 1;
+            f->mode = S_IFCHR|S_IRUSR|S_IWUSR;
+            f->status_flags = O_RDWR|(flags & EFD_NONBLOCK);
+            f->descriptor_flags = (flags & EFD_CLOEXEC) ? FD_CLOEXEC : 0;
+            f->opaque = e;
+        }
+    }
+    return ret;
+}
+
+int eventfd_read(int fd, eventfd_t *value)
+{
+    return (read(fd, value, sizeof(*value)) == sizeof(*value)) ? 0 : -1;
+}
+
+int eventfd_write(int fd, eventfd_t value)
+{
+    return (write(fd, &value, sizeof(value)) == sizeof(value)) ? 0 : -1;
+}
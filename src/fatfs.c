@@ -31,6 +31,13 @@
 
 /* Macro definitions */
 
+/* Each FIL carries a sector buffer: there are fewer of them than
+ * descriptors.
+ */
+#ifndef FATFS_N_OPEN
+#  define FATFS_N_OPEN 4
+#endif
+
 /* Function prototypes */
 
 extern
@@ -103,7 +110,7 @@ static struct {
         FIL fil;
         DIR dir;
     };
-    } files[OPEN_MAX];
+    } files[FATFS_N_OPEN];
 
 /* static functions */
 
@@ -202,7 +209,7 @@ int fatfs_fildir_alloc(void)
 {
     int i_fil;
 
-    for (i_fil = 0; i_fil < OPEN_MAX; i_fil++)
+    for (i_fil = 0; i_fil < FATFS_N_OPEN; i_fil++)
     {
         if (!files[i_fil].allocated)
         {
@@ -210,7 +217,7 @@ int fatfs_fildir_alloc(void)
             break;
         }
     }
-    if (i_fil == OPEN_MAX)
+    if (i_fil == FATFS_N_OPEN)
     {
         i_fil = -1;
     }
@@ -260,7 +267,7 @@ int fatfs_fildir_free(void *fp)
 {
     int i_fil;
 
-    for (i_fil = 0; i_fil < OPEN_MAX; i_fil++)
+    for (i_fil = 0; i_fil < FATFS_N_OPEN; i_fil++)
     {
         if (
                 files[i_fil].allocated
@@ -277,7 +284,7 @@ int fatfs_fildir_free(void *fp)
             break;
         }
     }
-    if (i_fil == OPEN_MAX)
+    if (i_fil == FATFS_N_OPEN)
     {
         i_fil = -1;
     }
@@ -327,7 +334,7 @@ int fatfs_write (int fd, char *ptr, int len)
         errno = EBADF;
         ret = -1;
     }
-    else if (S_ISREG(pfd->stat.st_mode))
+    else if (S_ISREG(pfd->mode))
     {
         FIL *filp;
         FRESULT result;
@@ -361,7 +368,7 @@ int fatfs_write (int fd, char *ptr, int len)
             ret = -1;
         }
     }
-    else if (S_ISDIR(pfd->stat.st_mode))
+    else if (S_ISDIR(pfd->mode))
     {
         errno = EISDIR;
         ret = -1;
@@ -393,7 +400,7 @@ int fatfs_read (int fd, char *ptr, int len)
         errno = EBADF;
         ret = -1;
     }
-    else if (S_ISREG(pfd->stat.st_mode))
+    else if (S_ISREG(pfd->mode))
     {
         FIL *filp;
         FRESULT result;
@@ -412,7 +419,7 @@ int fatfs_read (int fd, char *ptr, int len)
             ret = -1;
         }
     }
-    else if (S_ISDIR(pfd->stat.st_mode))
+    else if (S_ISDIR(pfd->mode))
     {
         errno = EISDIR;
         ret = -1;
@@ -444,7 +451,7 @@ int fatfs_close (int fd)
         errno = EBADF;
         ret = -1;
     }
-    else if (S_ISREG(pfd->stat.st_mode))
+    else if (S_ISREG(pfd->mode))
     {
         FIL *filp;
         FRESULT result;
@@ -464,7 +471,7 @@ int fatfs_close (int fd)
             ret = -1;
         }
     }
-    else if (S_ISDIR(pfd->stat.st_mode))
+    else if (S_ISDIR(pfd->mode))
     {
         DIR *dp;
         FRESULT result;
@@ -494,13 +501,10 @@ int fatfs_close (int fd)
 }
 
 static
-void fill_stat(const FILINFO *fno, struct stat *out)
+mode_t fill_mode(const FILINFO *fno)
 {
     mode_t mode;
 
-    memset(out, 0, sizeof(struct stat));
-
-    out->st_size = fno->fsize;
     if ((fno->fattrib & AM_MASK) & AM_DIR)
     {
         mode = S_IFDIR;
@@ -520,17 +524,41 @@ void fill_stat(const FILINFO *fno, struct stat *out)
     {
         /* r-xr-xr-x */
     }
-    out->st_mode = mode;
+    return mode;
+}
+
+static
+void fill_stat(const FILINFO *fno, struct stat *out)
+{
+    memset(out, 0, sizeof(struct stat));
+
+    out->st_size = fno->fsize;
+    out->st_mode = fill_mode(fno);
 #if 0
     /* not present in newlib struct stat */
     struct timespec ts;
     fattime_to_timespec(fno->fdate, fno->ftime, &ts);
-    pfd->stat.st_atim = ts;
-    pfd->stat.st_mtim = ts;
-    pfd->stat.st_ctim = ts;
+    out->st_atim = ts;
+    out->st_mtim = ts;
+    out->st_ctim = ts;
 #endif
 }
 
+/* The size is the current one, not the one at open. */
+static
+int fatfs_fstat(int fd, struct stat *buf)
+{
+    struct fd *pfd;
+
+    pfd = file_struct_get(fd);
+    if (S_ISREG(pfd->mode) && (pfd->opaque != NULL))
+    {
+        buf->st_size = f_size((FIL *)pfd->opaque);
+    }
+
+    return 0;
+}
+
 static
 void fill_fd(struct fd *pfd, int flags, const FILINFO *fno)
 {
@@ -544,8 +572,8 @@ void fill_fd(struct fd *pfd, int flags, const FILINFO *fno)
         pfd->write = fatfs_write;
         pfd->read = fatfs_read;
     }
-
-    fill_stat(fno, &pfd->stat);
+    pfd->fstat = fatfs_fstat;
+    pfd->mode = fill_mode(fno);
 }
 
 static
@@ -673,7 +701,7 @@ int is_dir(DIR *dirp)
         errno = EBADF;
         ret = 0;
     }
-    else if (S_ISDIR(pfd->stat.st_mode))
+    else if (S_ISDIR(pfd->mode))
     {
         ret = 1;
     }
@@ -747,7 +775,7 @@ off_t fatfs_lseek(int fd, off_t offset, int whence )
         errno = EBADF;
         ret = -1;
     }
-    else if (S_ISREG(pfd->stat.st_mode))
+    else if (S_ISREG(pfd->mode))
     {
         FIL *filp;
         FRESULT result;
@@ -793,6 +821,135 @@ off_t fatfs_lseek(int fd, off_t offset, int whence )
     return ret;
 }
 
+#if _USE_FORWARD && _FS_TINY
+
+/* f_forward callbacks have no argument */
+static struct {
+    fatfs_forward_cb_t func;
+    void *arg;
+} forward_ctx;
+
+static
+UINT forward_trampoline(const BYTE *buf, UINT len)
+{
+    UINT ret;
+
+    if (len == 0)
+    {
+        /* sense call: always ready */
+        ret = 1;
+    }
+    else
+    {
+        ret = forward_ctx.func(buf, len, forward_ctx.arg);
+    }
+    return ret;
+}
+
+static
+FRESULT forward_fil(FIL *filp, size_t count, fatfs_forward_cb_t func, void *arg, size_t *nforwarded)
+{
+    FRESULT result;
+    UINT n;
+
+    forward_ctx.func = func;
+    forward_ctx.arg = arg;
+    result = f_forward(filp, forward_trampoline, count, &n);
+    *nforwarded = n;
+
+    return result;
+}
+
+#else
+
+#ifndef FATFS_FORWARD_CHUNK
+#  define FATFS_FORWARD_CHUNK 128
+#endif
+
+static
+FRESULT forward_fil(FIL *filp, size_t count, fatfs_forward_cb_t func, void *arg, size_t *nforwarded)
+{
+    FRESULT result = FR_OK;
+    uint8_t chunk[FATFS_FORWARD_CHUNK];
+
+    *nforwarded = 0;
+    while (*nforwarded < count)
+    {
+        UINT toread;
+        UINT nread;
+        size_t accepted;
+
+        toread = count - *nforwarded;
+        if (toread > sizeof(chunk))
+        {
+            toread = sizeof(chunk);
+        }
+        result = f_read(filp, chunk, toread, &nread);
+        if ((result != FR_OK) || (nread == 0))
+        {
+            break;
+        }
+        accepted = func(chunk, nread, arg);
+        *nforwarded += accepted;
+        if (accepted < nread)
+        {
+            /* the rest will be read again next time */
+            result = f_lseek(filp, f_tell(filp) - (nread - accepted));
+            break;
+        }
+    }
+    return result;
+}
+
+#endif
+
+ssize_t fatfs_forward(int fd, size_t count, fatfs_forward_cb_t func, void *arg)
+{
+    ssize_t ret;
+    struct fd *pfd;
+
+    pfd = file_struct_get(fd);
+
+    if (pfd == NULL)
+    {
+        errno = EBADF;
+        ret = -1;
+    }
+    else if (pfd->opaque == NULL)
+    {
+        errno = EBADF;
+        ret = -1;
+    }
+    else if (S_ISREG(pfd->mode))
+    {
+        FRESULT result;
+        size_t nforwarded;
+
+        result = forward_fil(pfd->opaque, count, func, arg, &nforwarded);
+        if ((result == FR_OK) || (nforwarded > 0))
+        {
+            ret = nforwarded;
+        }
+        else
+        {
+            errno = fresult2errno(result);
+            ret = -1;
+        }
+    }
+    else if (S_ISDIR(pfd->mode))
+    {
+        errno = EISDIR;
+        ret = -1;
+    }
+    else
+    {
+        errno = EINVAL;
+        ret = -1;
+    }
+
+    return ret;
+}
+
 int fatfs_unlink(const char *path)
 {
     int ret;
@@ -861,7 +1018,7 @@ int fatfs_fsync(int fd)
         errno = EBADF;
         ret = -1;
     }
-    else if (S_ISREG(pfd->stat.st_mode))
+    else if (S_ISREG(pfd->mode))
     {
         FIL *filp;
         FRESULT result;
@@ -1071,7 +1228,7 @@ DIR *fatfs_fdopendir(int fd)
         errno = EBADF;
         ret = NULL;
     }
-    else if (S_ISDIR(pfd->stat.st_mode))
+    else if (S_ISDIR(pfd->mode))
     {
         ret = pfd->opaque;
     }
@@ -24,15 +24,27 @@
 #include <string.h>
 #include <file.h>
 #include <limits.h>
+#include "wait.h"
+
+#define FILE_BITMAP_BITS (8 * sizeof(uint32_t))
+#define FILE_BITMAP_WORDS ((OPEN_MAX + FILE_BITMAP_BITS - 1) / FILE_BITMAP_BITS)
 
 static
 struct fd files[OPEN_MAX];
 
+/* A bit for each allocated descriptor: STDIN, STDOUT, STDERR are
+ * always taken.
+ */
+static
+uint32_t files_allocated[FILE_BITMAP_WORDS] = {
+    (1UL << STDIN_FILENO)|(1UL << STDOUT_FILENO)|(1UL << STDERR_FILENO)
+};
+
 struct fd *file_struct_get(int fd)
 {
     struct fd *f;
 
-    if (fd >= OPEN_MAX)
+    if ((fd < 0) || (fd >= OPEN_MAX))
     {
         f = NULL;
     }
@@ -45,19 +57,26 @@ struct fd *file_struct_get(int fd)
 
 int file_alloc(void)
 {
-    int fd;
+    unsigned int iword;
     int ret = -1;
 
-    /* starting from 3 because of STDIN, STDOUT, STDERR */
-    for (fd = 3; fd < OPEN_MAX; fd++)
+    for (iword = 0; iword < FILE_BITMAP_WORDS; iword++)
     {
-        if (!files[fd].isallocated)
+        uint32_t free_bits;
+
+        free_bits = ~files_allocated[iword];
+        if (free_bits != 0)
         {
-            memset(&files[fd], 0, sizeof(files[fd]));
-            
-            files[fd].isallocated = 1;
-            files[fd].fd = fd;
-            ret = fd;
+            int fd;
+
+            fd = (iword * FILE_BITMAP_BITS) + __builtin_ctz(free_bits);
+            if (fd < OPEN_MAX)
+            {
+                files_allocated[iword] |= (1UL << (fd % FILE_BITMAP_BITS));
+                memset(&files[fd], 0, sizeof(files[fd]));
+                files[fd].fd = fd;
+                ret = fd;
+            }
             break;
         }
     }
@@ -66,9 +85,26 @@ int file_alloc(void)
 
 void file_free(int fd)
 {
-    if ((fd < OPEN_MAX) && (fd >= 0) && (files[fd].isallocated))
+    if ((fd < OPEN_MAX) && (fd >= 0))
     {
-        files[fd].isallocated = 0;
+        files_allocated[fd / FILE_BITMAP_BITS] &= ~(1UL << (fd % FILE_BITMAP_BITS));
     }
 }
 
+/* Empty default, in case no blocking call is linked to wake up. */
+__attribute__((__weak__))
+void wait_event_signal(void)
+{
+}
+
+void file_notify(int fd)
+{
+    struct fd *f;
+
+    wait_event_signal();
+    f = file_struct_get(fd);
+    if ((f != NULL) && (f->notify != NULL))
+    {
+        f->notify(fd, f->notify_arg);
+    }
+}
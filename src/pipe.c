@@ -0,0 +1,594 @@
+/*
+ * Copyright (c) 2016 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <poll.h>
+#include "file.h"
+#include "timespec.h"
+#include "wait.h"
+#include "critical.h"
+
+/* The rings are shared by pipes, that take one, and socket pairs,
+ * that take two.
+ */
+#ifndef PIPE_N_RINGS
+#  define PIPE_N_RINGS 4
+#endif
+
+#ifndef PIPE_RING_SIZE
+#  define PIPE_RING_SIZE 256
+#endif
+
+#if (PIPE_RING_SIZE & (PIPE_RING_SIZE - 1)) || (PIPE_RING_SIZE > 0x8000)
+#  error "PIPE_RING_SIZE must be a power of 2, up to 0x8000"
+#endif
+
+#define PIPE_N_ENDS (2 * PIPE_N_RINGS)
+
+/* One writer and one reader: head is moved only by the writer and tail
+ * only by the reader, so that the writer can be an interrupt handler
+ * without locks. Both count freely, the difference is what is used.
+ */
+struct pipe_ring {
+    int allocated;
+    volatile uint16_t head;
+    volatile uint16_t tail;
+    char buf[PIPE_RING_SIZE];
+};
+
+struct pipe_end {
+    int allocated;
+    int fd;
+    struct pipe_ring *rx; /* NULL for the write end of a pipe */
+    struct pipe_ring *tx; /* NULL for the read end of a pipe */
+    struct pipe_end *volatile peer; /* NULL once the other end is closed */
+};
+
+static
+int pipe_close(int fd);
+
+static
+struct pipe_ring pipe_rings[PIPE_N_RINGS];
+
+static
+struct pipe_end pipe_ends[PIPE_N_ENDS];
+
+static
+uint16_t ring_used(const struct pipe_ring *r)
+{
+    return (uint16_t)(r->head - r->tail);
+}
+
+static
+uint16_t ring_free(const struct pipe_ring *r)
+{
+    return PIPE_RING_SIZE - ring_used(r);
+}
+
+/* Only by the writer, with len not more than ring_free. */
+static
+void ring_put(struct pipe_ring *r, const char *src, uint16_t len)
+{
+    uint16_t start;
+    uint16_t first;
+
+    start = r->head & (PIPE_RING_SIZE - 1);
+    first = PIPE_RING_SIZE - start;
+    if (first > len)
+    {
+        first = len;
+    }
+    memcpy(&r->buf[start], src, first);
+    memcpy(&r->buf[0], &src[first], len - first);
+    /* the data is there before the reader can see it */
+    __sync_synchronize();
+    r->head += len;
+}
+
+/* Only by the reader, with len not more than ring_used. */
+static
+void ring_get(struct pipe_ring *r, char *dst, uint16_t len)
+{
+    uint16_t start;
+    uint16_t first;
+
+    __sync_synchronize();
+    start = r->tail & (PIPE_RING_SIZE - 1);
+    first = PIPE_RING_SIZE - start;
+    if (first > len)
+    {
+        first = len;
+    }
+    memcpy(dst, &r->buf[start], first);
+    memcpy(&dst[first], &r->buf[0], len - first);
+    /* the data is copied before the writer can overwrite it */
+    __sync_synchronize();
+    r->tail += len;
+}
+
+static
+struct pipe_ring *ring_alloc(void)
+{
+    struct pipe_ring *r = NULL;
+    int i;
+
+    for (i = 0; i < PIPE_N_RINGS; i++)
+    {
+        if (!pipe_rings[i].allocated)
+        {
+            r = &pipe_rings[i];
+            r->allocated = 1;
+            r->head = 0;
+            r->tail = 0;
+            break;
+        }
+    }
+    return r;
+}
+
+static
+void ring_free_one(struct pipe_ring *r)
+{
+    if (r != NULL)
+    {
+        r->allocated = 0;
+    }
+}
+
+static
+struct pipe_end *pipe_end_alloc(void)
+{
+    struct pipe_end *e = NULL;
+    int i;
+
+    for (i = 0; i < PIPE_N_ENDS; i++)
+    {
+        if (!pipe_ends[i].allocated)
+        {
+            e = &pipe_ends[i];
+            e->allocated = 1;
+            break;
+        }
+    }
+    return e;
+}
+
+static
+struct pipe_end *pipe_end_get(int fd)
+{
+    struct pipe_end *e;
+    struct fd *f;
+
+    f = file_struct_get(fd);
+    if ((f == NULL) || !f->isopen || (f->close != pipe_close))
+    {
+        errno = EBADF;
+        e = NULL;
+    }
+    else
+    {
+        e = f->opaque;
+    }
+    return e;
+}
+
+/* What the other end can do has changed. */
+static
+void pipe_peer_notify(const struct pipe_end *e)
+{
+    struct pipe_end *peer;
+
+    peer = e->peer;
+    if (peer != NULL)
+    {
+        file_notify(peer->fd);
+    }
+}
+
+static
+int pipe_read(int fd, char *ptr, int len)
+{
+    int ret;
+    struct pipe_end *e;
+
+    e = pipe_end_get(fd);
+    if (e == NULL)
+    {
+        ret = -1;
+    }
+    else if (len <= 0)
+    {
+        ret = 0;
+    }
+    else
+    {
+        int nonblock;
+
+        nonblock = (file_struct_get(fd)->status_flags & O_NONBLOCK) || !wait_allowed();
+        do
+        {
+            unsigned int seq;
+            uint16_t used;
+
+            seq = wait_event_seq();
+            used = ring_used(e->rx);
+            if (used > 0)
+            {
+                if ((int)used < len)
+                {
+                    len = used;
+                }
+                ring_get(e->rx, ptr, len);
+                pipe_peer_notify(e);
+                ret = len;
+                break;
+            }
+            else if (e->peer == NULL)
+            {
+                /* end of file */
+                ret = 0;
+                break;
+            }
+            else if (nonblock)
+            {
+                errno = EAGAIN;
+                ret = -1;
+                break;
+            }
+            wait_event(seq, &TIMESPEC_INFINITY);
+        } while (1);
+    }
+    return ret;
+}
+
+/* Writes up to the ring size are all or nothing, as with PIPE_BUF. */
+static
+int pipe_write(int fd, char *ptr, int len)
+{
+    int ret;
+    struct pipe_end *e;
+
+    e = pipe_end_get(fd);
+    if (e == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        int nonblock;
+        int written = 0;
+
+        nonblock = (file_struct_get(fd)->status_flags & O_NONBLOCK) || !wait_allowed();
+        do
+        {
+            unsigned int seq;
+            uint16_t nfree;
+            int towrite;
+
+            seq = wait_event_seq();
+            if (e->peer == NULL)
+            {
+                errno = EPIPE;
+                ret = -1;
+                break;
+            }
+            nfree = ring_free(e->tx);
+            towrite = len - written;
+            if ((len <= PIPE_RING_SIZE) && (nfree < towrite))
+            {
+                nfree = 0;
+            }
+            if (towrite > nfree)
+            {
+                towrite = nfree;
+            }
+            if (towrite > 0)
+            {
+                ring_put(e->tx, &ptr[written], towrite);
+                written += towrite;
+                pipe_peer_notify(e);
+            }
+            if (written == len)
+            {
+                ret = written;
+                break;
+            }
+            else if (nonblock)
+            {
+                if (written == 0)
+                {
+                    errno = EAGAIN;
+                    ret = -1;
+                }
+                else
+                {
+                    ret = written;
+                }
+                break;
+            }
+            wait_event(seq, &TIMESPEC_INFINITY);
+        } while (1);
+        if ((ret == -1) && (written > 0))
+        {
+            ret = written;
+        }
+    }
+    return ret;
+}
+
+static
+short pipe_poll(int fd)
+{
+    short ret;
+    struct pipe_end *e;
+
+    e = pipe_end_get(fd);
+    if (e == NULL)
+    {
+        ret = POLLNVAL;
+    }
+    else
+    {
+        ret = 0;
+        if (e->rx != NULL)
+        {
+            if (ring_used(e->rx) > 0)
+            {
+                ret |= POLLIN|POLLRDNORM;
+            }
+            if (e->peer == NULL)
+            {
+                ret |= POLLHUP;
+            }
+        }
+        if (e->tx != NULL)
+        {
+            if (e->peer == NULL)
+            {
+                ret |= POLLERR;
+            }
+            else if (ring_free(e->tx) > 0)
+            {
+                ret |= POLLOUT|POLLWRNORM;
+            }
+        }
+    }
+    return ret;
+}
+
+static
+int pipe_close(int fd)
+{
+    int ret;
+    struct pipe_end *e;
+
+    e = pipe_end_get(fd);
+    if (e == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        struct pipe_end *peer;
+        int cs_state;
+
+        /* a handler writing meanwhile sees both ends, or EPIPE */
+        cs_state = critical_section_begin();
+        peer = e->peer;
+        if (peer != NULL)
+        {
+            peer->peer = NULL;
+        }
+        e->peer = NULL;
+        file_struct_get(fd)->isopen = 0;
+        critical_section_end(cs_state);
+
+        if (peer != NULL)
+        {
+            file_notify(peer->fd);
+        }
+        else
+        {
+            /* the last end takes the rings away */
+            ring_free_one(e->rx);
+            ring_free_one(e->tx);
+        }
+        e->rx = NULL;
+        e->tx = NULL;
+        e->allocated = 0;
+        file_free(fd);
+        ret = 0;
+    }
+    return ret;
+}
+
+static
+void pipe_fill_fd(int fd, struct pipe_end *e, mode_t mode)
+{
+    struct fd *f;
+
+    f = file_struct_get(fd);
+    f->isatty = 0;
+    f->isopen = 1;
+    f->mode = mode;
+    f->close = pipe_close;
+    f->poll = pipe_poll;
+    f->notifies = 1;
+    f->opaque = e;
+    if (e->rx != NULL)
+    {
+        f->read = pipe_read;
+        f->mode |= S_IRUSR;
+    }
+    if (e->tx != NULL)
+    {
+        f->write = pipe_write;
+        f->mode |= S_IWUSR;
+    }
+    if ((e->rx != NULL) && (e->tx != NULL))
+    {
+        f->status_flags = O_RDWR;
+    }
+    else if (e->rx != NULL)
+    {
+        f->status_flags = O_RDONLY;
+    }
+    else
+    {
+        f->status_flags = O_WRONLY;
+    }
+}
+
+/* Two connected ends: to0 carries data to end 0, to1 to end 1. */
+static
+int pipe_pair_create(int fildes[2], mode_t mode, struct pipe_ring *to0, struct pipe_ring *to1)
+{
+    int ret;
+    struct pipe_end *e0;
+    struct pipe_end *e1;
+    int fd0;
+    int fd1 = -1;
+
+    e0 = pipe_end_alloc();
+    e1 = pipe_end_alloc();
+    fd0 = file_alloc();
+    if (fd0 != -1)
+    {
+        fd1 = file_alloc();
+    }
+    if ((e0 == NULL) || (e1 == NULL))
+    {
+        errno = ENFILE;
+        ret = -1;
+    }
+    else if (fd1 == -1)
+    {
+        errno = EMFILE;
+        ret = -1;
+    }
+    else
+    {
+        e0->fd = fd0;
+        e0->rx = to0;
+        e0->tx = to1;
+        e0->peer = e1;
+        e1->fd = fd1;
+        e1->rx = to1;
+        e1->tx = to0;
+        e1->peer = e0;
+        pipe_fill_fd(fd0, e0, mode);
+        pipe_fill_fd(fd1, e1, mode);
+        fildes[0] = fd0;
+        fildes[1] = fd1;
+        ret = 0;
+    }
+    if (ret != 0)
+    {
+        if (e0 != NULL)
+        {
+            e0->allocated = 0;
+        }
+        if (e1 != NULL)
+        {
+            e1->allocated = 0;
+        }
+        if (fd0 != -1)
+        {
+            file_free(fd0);
+        }
+        if (fd1 != -1)
+        {
+            file_free(fd1);
+        }
+    }
+    return ret;
+}
+
+int pipe(int fildes[2])
+{
+    int ret;
+    struct pipe_ring *r;
+
+    r = ring_alloc();
+    if (r == NULL)
+    {
+        errno = ENFILE;
+        ret = -1;
+    }
+    else
+    {
+        /* fildes[0] reads what fildes[1] writes */
+        ret = pipe_pair_create(fildes, S_IFIFO, r, NULL);
+        if (ret != 0)
+        {
+            ring_free_one(r);
+        }
+    }
+    return ret;
+}
+
+int socketpair(int domain, int type, int protocol, int socket_vector[2])
+{
+    int ret;
+
+    if (domain != AF_UNIX)
+    {
+        errno = EAFNOSUPPORT;
+        ret = -1;
+    }
+    else if (type != SOCK_STREAM)
+    {
+        errno = EPROTOTYPE;
+        ret = -1;
+    }
+    else if (protocol != 0)
+    {
+        errno = EPROTONOSUPPORT;
+        ret = -1;
+    }
+    else
+    {
+        struct pipe_ring *r0;
+        struct pipe_ring *r1;
+
+        r0 = ring_alloc();
+        r1 = ring_alloc();
+        if ((r0 == NULL) || (r1 == NULL))
+        {
+            errno = ENFILE;
+            ret = -1;
+        }
+        else
+        {
+            ret = pipe_pair_create(socket_vector, S_IFSOCK, r0, r1);
+        }
+        if (ret != 0)
+        {
+            ring_free_one(r0);
+            ring_free_one(r1);
+        }
+    }
+    return ret;
+}
@@ -21,6 +21,7 @@
 #include "file.h"
 #include "time.h"
 #include "timespec.h"
+#include "wait.h"
 
 static
 short poll_one(struct pollfd *p)
@@ -101,6 +102,28 @@ int poll_tentative(struct pollfd fds[], nfds_t nfds)
     return ret;
 }
 
+/* Whether all the files notify their events, so that poll can sleep
+ * until one of them does.
+ */
+static
+int poll_notified(const struct pollfd fds[], nfds_t nfds)
+{
+    nfds_t i;
+    int notified = 1;
+
+    for (i = 0; (i < nfds) && notified; i++)
+    {
+        if (fds[i].fd >= 0)
+        {
+            struct fd *f;
+
+            f = file_struct_get(fds[i].fd);
+            notified = (f != NULL) && f->notifies;
+        }
+    }
+    return notified;
+}
+
 int poll(struct pollfd fds[], nfds_t nfds, int timeout)
 {
     int ret;
@@ -113,6 +136,7 @@ int poll(struct pollfd fds[], nfds_t nfds, int timeout)
     {
         struct timespec tend;
         int timeout_expired;
+        int notified;
 
         if (timeout == -1)
         {
@@ -131,23 +155,26 @@ int poll(struct pollfd fds[], nfds_t nfds, int timeout)
 
             timespec_add(&tcurrent, &timeout_ts, &tend);
         }
+        notified = poll_notified(fds, nfds);
         do
         {
-            struct timespec tcurrent;
+            unsigned int seq;
 
-            ret = clock_gettime(CLOCK_MONOTONIC, &tcurrent);
+            seq = wait_event_seq();
+            ret = poll_tentative(fds, nfds);
             if (ret != 0)
             {
                 break;
             }
 
-            ret = poll_tentative(fds, nfds);
-            if (ret != 0)
+            if (notified)
             {
-                break;
+                timeout_expired = (wait_event(seq, &tend) == 0);
+            }
+            else
+            {
+                timeout_expired = (wait_interrupt(&tend) == 0);
             }
-
-            timeout_expired = (timespec_diff(&tcurrent, &tend, NULL) >= 0);
         } while(!timeout_expired);
 
     }
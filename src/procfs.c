@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2016 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include "file.h"
+#include "procfs.h"
+#include "w5100_socket.h"
+
+#ifndef PROCFS_SIZE
+#  define PROCFS_SIZE 512
+#endif
+
+#ifndef PROCFS_N_OPEN
+#  define PROCFS_N_OPEN 2
+#endif
+
+struct procfs_entry {
+    const char *pathname;
+    procfs_show_t show;
+};
+
+struct procfs_file {
+    const struct procfs_entry *entry;
+    size_t offset;
+};
+
+static
+int procfs_read(int fd, char *ptr, int len);
+
+static
+int procfs_close(int fd);
+
+static const
+struct procfs_entry procfs_entries[] = {
+    {"/proc/net/w5100", w5100_socket_proc_show},
+};
+
+static
+struct procfs_file procfs_files[PROCFS_N_OPEN];
+
+static
+const struct procfs_entry *procfs_entry_find(const char *pathname)
+{
+    const struct procfs_entry *ret;
+    size_t i;
+
+    ret = NULL;
+    for (i = 0; i < sizeof(procfs_entries)/sizeof(procfs_entries[0]); i++)
+    {
+        if (
+                (strcmp(pathname, procfs_entries[i].pathname) == 0)
+                &&
+                (procfs_entries[i].show != NULL)
+           )
+        {
+            ret = &procfs_entries[i];
+            break;
+        }
+    }
+    return ret;
+}
+
+static
+struct procfs_file *procfs_file_alloc(void)
+{
+    struct procfs_file *ret;
+    int i;
+
+    ret = NULL;
+    for (i = 0; i < PROCFS_N_OPEN; i++)
+    {
+        if (procfs_files[i].entry == NULL)
+        {
+            ret = &procfs_files[i];
+            break;
+        }
+    }
+    return ret;
+}
+
+static
+int procfs_read(int fd, char *ptr, int len)
+{
+    int ret;
+    struct fd *pfd;
+    struct procfs_file *pf;
+    char text[PROCFS_SIZE];
+    int text_len;
+
+    pfd = file_struct_get(fd);
+    pf = pfd->opaque;
+    text_len = pf->entry->show(text, sizeof(text));
+    if (text_len > (int)sizeof(text) - 1)
+    {
+        /* truncated */
+        text_len = sizeof(text) - 1;
+    }
+    if (pf->offset >= (size_t)text_len)
+    {
+        ret = 0;
+    }
+    else
+    {
+        ret = text_len - pf->offset;
+        if (ret > len)
+        {
+            ret = len;
+        }
+        memcpy(ptr, &text[pf->offset], ret);
+        pf->offset += ret;
+    }
+    return ret;
+}
+
+static
+int procfs_close(int fd)
+{
+    struct fd *pfd;
+    struct procfs_file *pf;
+
+    pfd = file_struct_get(fd);
+    pf = pfd->opaque;
+    pf->entry = NULL;
+    file_free(fd);
+
+    return 0;
+}
+
+int procfs_open(const char *pathname, int flags)
+{
+    int ret;
+    const struct procfs_entry *entry;
+    struct procfs_file *pf;
+
+    entry = procfs_entry_find(pathname);
+    if (entry == NULL)
+    {
+        errno = ENOENT;
+        ret = -1;
+    }
+    else if ((flags & O_ACCMODE) != O_RDONLY)
+    {
+        errno = EACCES;
+        ret = -1;
+    }
+    else
+    {
+        pf = procfs_file_alloc();
+        ret = file_alloc();
+        if ((pf == NULL) || (ret < 0))
+        {
+            file_free(ret);
+            errno = ENFILE;
+            ret = -1;
+        }
+        else
+        {
+            struct fd *pfd;
+
+            pf->entry = entry;
+            pf->offset = 0;
+
+            pfd = file_struct_get(ret);
+            pfd->isatty = 0;
+            pfd->isopen = 1;
+            pfd->read = procfs_read;
+            pfd->close = procfs_close;
+            /* not a regular file, so lseek does not reach fatfs */
+            pfd->mode = S_IFCHR|S_IRUSR|S_IRGRP|S_IROTH;
+            pfd->status_flags = flags;
+            pfd->opaque = pf;
+        }
+    }
+
+    return ret;
+}
@@ -17,6 +17,8 @@
  *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "sd_spi.h"
+#include "spi_dma.h"
+#include "spi_bus.h"
 #include <stdint.h>
 #include <stdlib.h>
 #include <libopencm3/stm32/rcc.h>
@@ -30,12 +32,31 @@
 #define DATA_DUMMY 0xFF
 #define BLOCK_SIZE 512
 
+/* Clock:
+ * HSI 8MHz is the default
+ * RCC_CFGR_SW = 0b00 -> HSI chosen as SYSCLK
+ * RCC_CFGR_HPRE = 0b0000 -> no AHB prescaler
+ * SPI1 is on APB2
+ * RCC_CFGR_PRE2 = 0b0000 -> no APB2 prescaler
+ * -> FPCLK = 8MHz
+ * -> BR FPCLK/32 -> SCLK @ 250kHz < 400kHz
+ * sd_full_speed then switches to FPCLK/2 (4MHz).
+ */
+static struct spi_bus_device sd_spi_dev = {
+    .cs_port = GPIOB, /* CN9_5 D4 PB5 SD_CS */
+    .cs_pin = GPIO5,
+    .br = SPI_CR1_BAUDRATE_FPCLK_DIV_32,
+    .cpol = SPI_CR1_CPOL_CLK_TO_0_WHEN_IDLE,
+    .cpha = SPI_CR1_CPHA_CLK_TRANSITION_1,
+};
+
 static
 void sd_select(void)
 {
     int tries;
 
-    gpio_clear(GPIOB, GPIO5); /* lower chip select */
+    spi_bus_acquire(&sd_spi_dev);
+    spi_bus_select(&sd_spi_dev); /* lower chip select */
 
     tries = 125;
     do {
@@ -50,8 +71,9 @@ void sd_select(void)
 static
 void sd_deselect(void)
 {
-    gpio_set(GPIOB, GPIO5); /* raise chip select */
+    spi_bus_deselect(&sd_spi_dev); /* raise chip select */
     (void)spi_xfer(SPI1, DATA_IDLE); /* SD card releases MISO */
+    spi_bus_release(&sd_spi_dev);
 }
 
 static
@@ -175,16 +197,12 @@ int read_block(void *dst)
 
     if (data_ctrl == DATA_CTRL_START)
     {
-        int i_byte;
         uint8_t crc16_hi;
         uint8_t crc16_lo;
 
         data_ctrl = 0;
 
-        for (i_byte = 0; i_byte < BLOCK_SIZE; i_byte++)
-        {
-            dst_bytes[i_byte] = spi_xfer(SPI1, DATA_DUMMY);
-        }
+        spi_dma_xfer(NULL, dst_bytes, BLOCK_SIZE); /* DATA_DUMMY is sent */
         crc16_hi = spi_xfer(SPI1, DATA_DUMMY);
         crc16_lo = spi_xfer(SPI1, DATA_DUMMY);
         /* crc16: don't care. TODO: care. */
@@ -219,17 +237,10 @@ int sd_read_single_block(uint32_t address, void *dst)
 static
 int send_block(const void *src)
 {
-    const uint8_t *src_bytes;
-    int i_byte;
     uint8_t data_resp;
 
-    src_bytes = src;
-
     (void)spi_xfer(SPI1, DATA_CTRL_START);
-    for (i_byte = 0; i_byte < BLOCK_SIZE; i_byte++)
-    {
-        (void)spi_xfer(SPI1, src_bytes[i_byte]);
-    }
+    spi_dma_xfer(src, NULL, BLOCK_SIZE);
     /* crc16: don't care. TODO: care. */
     (void)spi_xfer(SPI1, DATA_DUMMY); 
     (void)spi_xfer(SPI1, DATA_DUMMY);
@@ -274,21 +285,9 @@ int sd_write_single_block(uint32_t address, const void *src)
     return res;
 }
 
-static
-void sd_spi_init(uint32_t br)
-{
-    spi_init_master(
-            SPI1,
-            br,
-            SPI_CR1_CPOL_CLK_TO_0_WHEN_IDLE,
-            SPI_CR1_CPHA_CLK_TRANSITION_1,
-            SPI_CR1_DFF_8BIT,
-            SPI_CR1_MSBFIRST);
-}
-
 void sd_full_speed(void)
 {
-    sd_spi_init(SPI_CR1_BAUDRATE_FPCLK_DIV_2); /* 4MHz */
+    spi_bus_set_baudrate(&sd_spi_dev, SPI_CR1_BAUDRATE_FPCLK_DIV_2); /* 4MHz */
 }
 
 void sd_init(void)
@@ -296,52 +295,13 @@ void sd_init(void)
     int i_dummy_clk;
     int spi_clk_khz;
 
-    rcc_periph_clock_enable(RCC_SPI1);
-    rcc_periph_clock_enable(RCC_GPIOA);
-    rcc_periph_clock_enable(RCC_GPIOB);
-
-    /* CN9_5 D4 PB5 SD_CS */
-    /* CN5_3 D10 PB6 SPI1_CS */
-    gpio_set(GPIOB, GPIO5);
-    gpio_set(GPIOB, GPIO6);
-#ifdef STM32F1
-    gpio_set_mode(GPIOB, GPIO_MODE_OUTPUT_10_MHZ, GPIO_CNF_OUTPUT_PUSHPULL, GPIO5);
-    gpio_set_mode(GPIOB, GPIO_MODE_OUTPUT_10_MHZ, GPIO_CNF_OUTPUT_PUSHPULL, GPIO6);
-    /* CN5_6 D13 PA5 SPI1_SCK */
-    gpio_set_mode(GPIOA, GPIO_MODE_OUTPUT_50_MHZ, GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, GPIO_SPI1_SCK);
-    /* CN5_4 D11 PA7 SPI1_MOSI */
-    gpio_set_mode(GPIOA, GPIO_MODE_OUTPUT_50_MHZ, GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, GPIO_SPI1_MOSI);
-    /* CN5_5 D12 PA6 SPI1_MISO */
-#  if 0
-    gpio_set_mode(GPIOA, GPIO_MODE_INPUT, GPIO_CNF_INPUT_PULL_UPDOWN, GPIO_SPI1_MISO);
-    gpio_set(GPIOA, GPIO_SPI1_MISO);
-#  else
-    gpio_set_mode(GPIOA, GPIO_MODE_INPUT, GPIO_CNF_INPUT_FLOAT, GPIO_SPI1_MISO);
-#  endif
-#elif defined(STM32F4)
-    gpio_mode_setup(GPIOB, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, GPIO5|GPIO6);
-    /* CN5_6 D13 PA5 SPI1_SCK */
-    /* CN5_4 D11 PA7 SPI1_MOSI */
-    /* CN5_5 D12 PA6 SPI1_MISO */
-    gpio_set_af(GPIOA, GPIO_AF5, GPIO5|GPIO6|GPIO7);
-    gpio_mode_setup(GPIOA, GPIO_MODE_AF, GPIO_PUPD_NONE, GPIO5|GPIO6|GPIO7);
-#endif
+    spi_bus_init();
+    spi_dma_init();
+
+    spi_bus_set_baudrate(&sd_spi_dev, SPI_CR1_BAUDRATE_FPCLK_DIV_32);
     spi_clk_khz = 250;
-    /* Clock:
-     * HSI 8MHz is the default
-     * RCC_CFGR_SW = 0b00 -> HSI chosen as SYSCLK
-     * RCC_CFGR_HPRE = 0b0000 -> no AHB prescaler
-     * SPI1 is on APB2
-     * RCC_CFGR_PRE2 = 0b0000 -> no APB2 prescaler
-     * -> FPCLK = 8MHz
-     * -> BR FPCLK/32 -> SCLK @ 250kHz < 400kHz
-     */
-    sd_spi_init(SPI_CR1_BAUDRATE_FPCLK_DIV_32);
-
-    spi_enable_software_slave_management(SPI1);
-    spi_set_nss_high(SPI1); /* Avoid Master mode fault MODF */
-    spi_enable(SPI1);
 
+    spi_bus_acquire(&sd_spi_dev);
     /* >74 clk cycles, >1ms -> >250clk */
     i_dummy_clk = 0;
     do
@@ -349,5 +309,5 @@ void sd_init(void)
         (void)spi_xfer(SPI1, 0xFF);
         i_dummy_clk += 8;
     } while (i_dummy_clk < 74 || i_dummy_clk < spi_clk_khz);
+    spi_bus_release(&sd_spi_dev);
 }
-
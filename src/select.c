@@ -21,6 +21,8 @@
 #include <string.h>
 #include <poll.h>
 #include "timespec.h"
+#include "file.h"
+#include "wait.h"
 
 static
 int get_fd_set_mask_idx(int fd)
@@ -183,6 +185,32 @@ int pselect_tentative(
     return ret;
 }
 
+/* Whether all the files in the sets notify their events, so that
+ * pselect can sleep until one of them does.
+ */
+static
+int pselect_notified(
+        int nfds,
+        fd_set *readfds,
+        fd_set *writefds,
+        fd_set *errorfds)
+{
+    int fd;
+    int notified = 1;
+
+    for (fd = 0; (fd < nfds) && notified; fd++)
+    {
+        if (FD_ISSET(fd, readfds) || FD_ISSET(fd, writefds) || FD_ISSET(fd, errorfds))
+        {
+            struct fd *f;
+
+            f = file_struct_get(fd);
+            notified = (f != NULL) && f->notifies;
+        }
+    }
+    return notified;
+}
+
 int pselect(int nfds, fd_set *readfds,
        fd_set *writefds, fd_set *errorfds,
        const struct timespec *timeout,
@@ -194,6 +222,7 @@ int pselect(int nfds, fd_set *readfds,
     fd_set readfds_in;
     fd_set writefds_in;
     fd_set errorfds_in;
+    int notified;
 
     (void)sigmask; /* TODO when we have signals */
 
@@ -212,23 +241,26 @@ int pselect(int nfds, fd_set *readfds,
     readfds_in = *readfds;
     writefds_in = *writefds;
     errorfds_in = *errorfds;
+    notified = pselect_notified(nfds, readfds, writefds, errorfds);
     do
     {
-        struct timespec tcurrent;
+        unsigned int seq;
 
-        ret = clock_gettime(CLOCK_MONOTONIC, &tcurrent);
+        seq = wait_event_seq();
+        ret = pselect_tentative(nfds, readfds, writefds, errorfds);
         if (ret != 0)
         {
             break;
         }
 
-        ret = pselect_tentative(nfds, readfds, writefds, errorfds);
-        if (ret != 0)
+        if (notified)
         {
-            break;
+            timeout_expired = (wait_event(seq, &tend) == 0);
+        }
+        else
+        {
+            timeout_expired = (wait_interrupt(&tend) == 0);
         }
-
-        timeout_expired = (timespec_diff(&tcurrent, &tend, NULL) >= 0);
         if (!timeout_expired)
         {
             /* reinit fd sets */
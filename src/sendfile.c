@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2016 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include "fatfs.h"
+
+struct sendfile_sink {
+    int out_fd;
+    int is_socket;
+    size_t remaining;
+    int error;
+};
+
+/* Sector data goes straight to the output; on sockets MSG_MORE lets
+ * the W5100 layer pack sectors into full segments.
+ */
+static
+size_t sendfile_write(const void *buf, size_t len, void *arg)
+{
+    struct sendfile_sink *sink = arg;
+    ssize_t written;
+
+    if (sink->is_socket)
+    {
+        int flags;
+
+        flags = (sink->remaining > len) ? MSG_MORE : 0;
+        written = send(sink->out_fd, buf, len, flags);
+    }
+    else
+    {
+        written = write(sink->out_fd, buf, len);
+    }
+    if (written < 0)
+    {
+        sink->error = errno;
+        written = 0;
+    }
+    sink->remaining -= written;
+
+    return written;
+}
+
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+    ssize_t ret;
+    struct stat st;
+    off_t pos = 0;
+
+    if (fstat(out_fd, &st) != 0)
+    {
+        ret = -1;
+    }
+    else if ((offset != NULL) && ((pos = lseek(in_fd, 0, SEEK_CUR)) < 0))
+    {
+        ret = -1;
+    }
+    else if ((offset != NULL) && (lseek(in_fd, *offset, SEEK_SET) < 0))
+    {
+        ret = -1;
+    }
+    else
+    {
+        struct sendfile_sink sink;
+
+        sink.out_fd = out_fd;
+        sink.is_socket = S_ISSOCK(st.st_mode);
+        sink.remaining = count;
+        sink.error = 0;
+
+        ret = fatfs_forward(in_fd, count, sendfile_write, &sink);
+        if ((ret == 0) && (sink.error != 0))
+        {
+            errno = sink.error;
+            ret = -1;
+        }
+        if (offset != NULL)
+        {
+            if (ret > 0)
+            {
+                *offset += ret;
+            }
+            (void)lseek(in_fd, pos, SEEK_SET);
+        }
+    }
+    return ret;
+}
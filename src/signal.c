@@ -23,10 +23,11 @@
 #include <errno.h>
 #include <limits.h>
 #include <libopencm3/cm3/nvic.h>
-#include <libopencm3/cm3/cortex.h>
 #include <libopencm3/cm3/scb.h>
 #include "sigqueue_info.h"
 #include "timespec.h"
+#include "wait.h"
+#include "critical.h"
 
 struct signal_queue_item
 {
@@ -55,30 +56,11 @@ sigset_t procmask;
 static
 struct signal_action signal_actions[SIGNAL_MAX + 1];
 
-static
-int critical_section_begin(void)
-{
-    int faults_already_disabled;
-
-    faults_already_disabled = cm_is_masked_faults();
-    if (!faults_already_disabled)
-    {
-        cm_disable_faults();
-    }
-
-    return faults_already_disabled;
-}
-
-static
-void critical_section_end(int state)
-{
-    int faults_already_disabled = state;
-
-    if (!faults_already_disabled)
-    {
-        cm_enable_faults();
-    }
-}
+static volatile struct {
+    int hold;
+    int deferred;
+    unsigned int delivered;
+} signal_delivery;
 
 int sigqueue_info(const siginfo_t *info)
 {
@@ -97,6 +79,7 @@ int sigqueue_info(const siginfo_t *info)
             signal_queue.items[iqueue].order = next_order;
             signal_queue.last_order = next_order;
             pendsv_interrupt_raise();
+            wait_event_signal();
 
             ret = 0;
             break;
@@ -491,10 +474,21 @@ int sigpending (sigset_t *set)
 int sigsuspend(const sigset_t *sigmask)
 {
     sigset_t saved_mask;
+    unsigned int delivered;
 
+    delivered = signal_delivery.delivered;
     sigprocmask(SIG_SETMASK, sigmask, &saved_mask);
-    
-    /* TODO: wait */
+    do
+    {
+        unsigned int seq;
+
+        seq = wait_event_seq();
+        if (signal_delivery.delivered != delivered)
+        {
+            break;
+        }
+        wait_event(seq, &TIMESPEC_INFINITY);
+    } while (1);
 
     sigprocmask(SIG_SETMASK, &saved_mask, NULL);
 
@@ -508,27 +502,34 @@ int sigtimedwait(
         const struct timespec *restrict timeout)
 {
     int ret;
-    struct timespec start;
-
-    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct timespec tend;
 
-    while(signal_dequeue(set, info) != 0)
+    if (timespec_diff(timeout, &TIMESPEC_INFINITY, NULL) == 0)
     {
-        struct timespec now;
-        struct timespec elapsed;
-
-        /* TODO: wait event or timeout */
+        tend = TIMESPEC_INFINITY;
+    }
+    else
+    {
+        clock_gettime(CLOCK_MONOTONIC, &tend);
+        timespec_incr(&tend, timeout);
+    }
+    do
+    {
+        unsigned int seq;
 
-        clock_gettime(CLOCK_MONOTONIC, &now);
-        timespec_diff(&now, &start, &elapsed);
-        if (timespec_diff(timeout, &elapsed, NULL) <= 0)
+        seq = wait_event_seq();
+        if (signal_dequeue(set, info) == 0)
+        {
+            ret = info->si_signo;
+            break;
+        }
+        if (wait_event(seq, &tend) == 0)
         {
             errno = EAGAIN;
             ret = -1;
             break;
         }
-
-    }
+    } while (1);
 
     return ret;
 }
@@ -547,9 +548,10 @@ int sigwait(const sigset_t *restrict set, int *restrict sig)
     siginfo_t info;
 
     ret = sigwaitinfo(set, &info);
-    if (ret == 0)
+    if (ret > 0)
     {
         *sig = info.si_signo;
+        ret = 0;
     }
 
     return ret;
@@ -561,13 +563,39 @@ void pendsv_interrupt_raise(void)
     SCB_ICSR |= SCB_ICSR_PENDSVSET;
 }
 
+void signal_delivery_hold(void)
+{
+    signal_delivery.hold++;
+}
+
+void signal_delivery_release(void)
+{
+    signal_delivery.hold--;
+    if ((signal_delivery.hold == 0) && signal_delivery.deferred)
+    {
+        signal_delivery.deferred = 0;
+        pendsv_interrupt_raise();
+    }
+}
+
 void pend_sv_handler(void)
 {
     siginfo_t info;
 
-    while (signal_dequeue_procmask(&info) == 0)
+    if (signal_delivery.hold > 0)
     {
-        signal_act(&info);
+        /* The interrupted code holds a resource that handlers
+         * might need: deliver when it is released. */
+        signal_delivery.deferred = 1;
+    }
+    else
+    {
+        while (signal_dequeue_procmask(&info) == 0)
+        {
+            signal_act(&info);
+            signal_delivery.delivered++;
+            wait_event_signal();
+        }
     }
 }
 
@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2016 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "spi_bus.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/spi.h>
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/cm3/scb.h>
+#include <libopencm3/cm3/assert.h>
+#include "sigqueue_info.h"
+#include "critical.h"
+
+#define SPI_CR1_CFG_MASK (SPI_CR1_BAUDRATE_FPCLK_DIV_256 | SPI_CR1_CPOL | SPI_CR1_CPHA)
+
+/* Number of the exception being handled, 0 in thread mode. */
+#define ICSR_VECTACTIVE_MASK 0x1FF
+
+static struct {
+    struct spi_bus_device *owner;
+    uint32_t owner_context;
+    int depth;
+    const struct spi_bus_device *active;
+    int initialized;
+} spi_bus;
+
+/* Empty defaults, in case signals are not
+ * linked in the program.
+ */
+__attribute__((__weak__))
+void signal_delivery_hold(void)
+{
+}
+
+__attribute__((__weak__))
+void signal_delivery_release(void)
+{
+}
+
+__attribute__((__weak__))
+void spi_bus_idle(void)
+{
+}
+
+static
+uint32_t current_context(void)
+{
+    return SCB_ICSR & ICSR_VECTACTIVE_MASK;
+}
+
+static
+void spi_bus_configure(const struct spi_bus_device *dev)
+{
+    uint32_t cr1;
+
+    while ((SPI_SR(SPI1) & SPI_SR_BSY) != 0)
+    {
+        /* wait for the end of the last frame */
+    }
+    cr1 = SPI_CR1(SPI1) & ~(SPI_CR1_CFG_MASK | SPI_CR1_SPE);
+    cr1 |= dev->br | dev->cpol | dev->cpha;
+    SPI_CR1(SPI1) = cr1; /* disabled while changing configuration */
+    SPI_CR1(SPI1) = cr1 | SPI_CR1_SPE;
+    spi_bus.active = dev;
+}
+
+int spi_bus_try_acquire(struct spi_bus_device *dev)
+{
+    int ret;
+    int cs_state;
+    uint32_t context;
+
+    context = current_context();
+    cs_state = critical_section_begin();
+    if (spi_bus.owner == NULL)
+    {
+        spi_bus.owner = dev;
+        spi_bus.owner_context = context;
+        spi_bus.depth = 1;
+        /* together with the ownership: a signal handler delivered
+         * in between would find the bus taken and never get it */
+        signal_delivery_hold();
+        ret = 0;
+    }
+    else if ((spi_bus.owner == dev) && (spi_bus.owner_context == context))
+    {
+        spi_bus.depth++;
+        ret = 0;
+    }
+    else
+    {
+        ret = -1;
+    }
+    critical_section_end(cs_state);
+
+    if ((ret == 0) && (spi_bus.depth == 1) && (spi_bus.active != dev))
+    {
+        spi_bus_configure(dev);
+    }
+
+    return ret;
+}
+
+void spi_bus_acquire(struct spi_bus_device *dev)
+{
+    while (spi_bus_try_acquire(dev) != 0)
+    {
+        /* Thread code waits for the handler holding the bus to release
+         * it. A handler would wait forever instead: the owner it
+         * preempted cannot run again until it returns.
+         */
+        cm3_assert(current_context() == 0);
+    }
+}
+
+void spi_bus_release(struct spi_bus_device *dev)
+{
+    int cs_state;
+    int released;
+
+    cs_state = critical_section_begin();
+    released = 0;
+    if (spi_bus.owner == dev)
+    {
+        spi_bus.depth--;
+        if (spi_bus.depth == 0)
+        {
+            spi_bus.owner = NULL;
+            released = 1;
+        }
+    }
+    critical_section_end(cs_state);
+
+    if (released)
+    {
+        signal_delivery_release();
+        spi_bus_idle();
+    }
+}
+
+void spi_bus_set_baudrate(struct spi_bus_device *dev, uint32_t br)
+{
+    int cs_state;
+
+    cs_state = critical_section_begin();
+    dev->br = br;
+    if (spi_bus.active == dev)
+    {
+        if (spi_bus.owner == dev)
+        {
+            spi_bus_configure(dev);
+        }
+        else
+        {
+            spi_bus.active = NULL; /* reconfigure at next acquire */
+        }
+    }
+    critical_section_end(cs_state);
+}
+
+void spi_bus_init(void)
+{
+    if (spi_bus.initialized)
+    {
+        return;
+    }
+    spi_bus.initialized = 1;
+
+    rcc_periph_clock_enable(RCC_SPI1);
+    rcc_periph_clock_enable(RCC_GPIOA);
+    rcc_periph_clock_enable(RCC_GPIOB);
+
+    /* All chip selects on the bus must be high
+     * before clocking anything, or more than one
+     * device drives MISO.
+     * CN9_5 D4 PB5 SD_CS
+     * CN5_3 D10 PB6 SPI1_CS (W5100)
+     */
+    gpio_set(GPIOB, GPIO5|GPIO6);
+#ifdef STM32F1
+    gpio_set_mode(GPIOB, GPIO_MODE_OUTPUT_10_MHZ, GPIO_CNF_OUTPUT_PUSHPULL, GPIO5|GPIO6);
+    /* CN5_6 D13 PA5 SPI1_SCK */
+    gpio_set_mode(GPIOA, GPIO_MODE_OUTPUT_50_MHZ, GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, GPIO_SPI1_SCK);
+    /* CN5_4 D11 PA7 SPI1_MOSI */
+    gpio_set_mode(GPIOA, GPIO_MODE_OUTPUT_50_MHZ, GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, GPIO_SPI1_MOSI);
+    /* CN5_5 D12 PA6 SPI1_MISO */
+    gpio_set_mode(GPIOA, GPIO_MODE_INPUT, GPIO_CNF_INPUT_FLOAT, GPIO_SPI1_MISO);
+#elif defined(STM32F4)
+    gpio_mode_setup(GPIOB, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, GPIO5|GPIO6);
+    /* CN5_6 D13 PA5 SPI1_SCK */
+    /* CN5_4 D11 PA7 SPI1_MOSI */
+    /* CN5_5 D12 PA6 SPI1_MISO */
+    gpio_set_af(GPIOA, GPIO_AF5, GPIO5|GPIO6|GPIO7);
+    gpio_mode_setup(GPIOA, GPIO_MODE_AF, GPIO_PUPD_NONE, GPIO5|GPIO6|GPIO7);
+#endif
+
+    /* Baud rate and mode are set per device when
+     * it takes the bus.
+     */
+    spi_init_master(
+            SPI1,
+            SPI_CR1_BAUDRATE_FPCLK_DIV_256,
+            SPI_CR1_CPOL_CLK_TO_0_WHEN_IDLE,
+            SPI_CR1_CPHA_CLK_TRANSITION_1,
+            SPI_CR1_DFF_8BIT,
+            SPI_CR1_MSBFIRST);
+
+    spi_enable_software_slave_management(SPI1);
+    spi_set_nss_high(SPI1); /* Avoid Master mode fault MODF */
+    spi_enable(SPI1);
+    spi_bus.active = NULL;
+}
+
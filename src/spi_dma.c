@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2016 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "spi_dma.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/spi.h>
+#include <libopencm3/stm32/dma.h>
+#include <libopencm3/cm3/nvic.h>
+#include "wait.h"
+#include "timespec.h"
+
+#ifdef STM32F1
+/* SPI1_RX is DMA1 channel 2, SPI1_TX is DMA1 channel 3 */
+#  define SPI_DMA DMA1
+#  define SPI_DMA_RX DMA_CHANNEL2
+#  define SPI_DMA_TX DMA_CHANNEL3
+#  define SPI_DMA_RCC RCC_DMA1
+#  define SPI_DMA_RX_IRQ NVIC_DMA1_CHANNEL2_IRQ
+#  define spi_dma_rx_isr dma1_channel2_isr
+#elif defined(STM32F4)
+/* SPI1_RX is DMA2 stream 0 channel 3, SPI1_TX is DMA2 stream 3 channel 3 */
+#  define SPI_DMA DMA2
+#  define SPI_DMA_RX DMA_STREAM0
+#  define SPI_DMA_TX DMA_STREAM3
+#  define SPI_DMA_RCC RCC_DMA2
+#  define SPI_DMA_RX_IRQ NVIC_DMA2_STREAM0_IRQ
+#  define spi_dma_rx_isr dma2_stream0_isr
+#endif
+
+void spi_dma_rx_isr(void);
+
+static volatile int dma_busy;
+
+static spi_dma_callback_t dma_cb;
+
+static void *dma_cb_arg;
+
+static const uint8_t dma_fill = SPI_DMA_FILL;
+
+static uint8_t dma_sink;
+
+static
+void dma_setup(uint8_t chan, const volatile void *mem, size_t len, int to_spi, int incr)
+{
+#ifdef STM32F1
+    dma_channel_reset(SPI_DMA, chan);
+    dma_set_peripheral_address(SPI_DMA, chan, (uint32_t)&SPI_DR(SPI1));
+    dma_set_memory_address(SPI_DMA, chan, (uint32_t)mem);
+    dma_set_number_of_data(SPI_DMA, chan, len);
+    if (to_spi)
+    {
+        dma_set_read_from_memory(SPI_DMA, chan);
+        dma_set_priority(SPI_DMA, chan, DMA_CCR_PL_HIGH);
+    }
+    else
+    {
+        dma_set_read_from_peripheral(SPI_DMA, chan);
+        /* RX must win over TX, or we get overruns */
+        dma_set_priority(SPI_DMA, chan, DMA_CCR_PL_VERY_HIGH);
+    }
+    dma_set_peripheral_size(SPI_DMA, chan, DMA_CCR_PSIZE_8BIT);
+    dma_set_memory_size(SPI_DMA, chan, DMA_CCR_MSIZE_8BIT);
+#elif defined(STM32F4)
+    dma_stream_reset(SPI_DMA, chan);
+    dma_channel_select(SPI_DMA, chan, DMA_SxCR_CHSEL_3);
+    dma_set_peripheral_address(SPI_DMA, chan, (uint32_t)&SPI_DR(SPI1));
+    dma_set_memory_address(SPI_DMA, chan, (uint32_t)mem);
+    dma_set_number_of_data(SPI_DMA, chan, len);
+    if (to_spi)
+    {
+        dma_set_transfer_mode(SPI_DMA, chan, DMA_SxCR_DIR_MEM_TO_PERIPHERAL);
+        dma_set_priority(SPI_DMA, chan, DMA_SxCR_PL_HIGH);
+    }
+    else
+    {
+        dma_set_transfer_mode(SPI_DMA, chan, DMA_SxCR_DIR_PERIPHERAL_TO_MEM);
+        /* RX must win over TX, or we get overruns */
+        dma_set_priority(SPI_DMA, chan, DMA_SxCR_PL_VERY_HIGH);
+    }
+    dma_set_peripheral_size(SPI_DMA, chan, DMA_SxCR_PSIZE_8BIT);
+    dma_set_memory_size(SPI_DMA, chan, DMA_SxCR_MSIZE_8BIT);
+#endif
+    if (incr)
+    {
+        dma_enable_memory_increment_mode(SPI_DMA, chan);
+    }
+}
+
+static
+void dma_start(uint8_t chan)
+{
+#ifdef STM32F1
+    dma_enable_channel(SPI_DMA, chan);
+#elif defined(STM32F4)
+    dma_enable_stream(SPI_DMA, chan);
+#endif
+}
+
+static
+void dma_stop(uint8_t chan)
+{
+#ifdef STM32F1
+    dma_disable_channel(SPI_DMA, chan);
+#elif defined(STM32F4)
+    dma_disable_stream(SPI_DMA, chan);
+#endif
+}
+
+int spi_dma_start(const void *tx, void *rx, size_t len, spi_dma_callback_t cb, void *arg)
+{
+    int ret;
+
+    if (dma_busy)
+    {
+        ret = -1;
+    }
+    else if (len == 0)
+    {
+        if (cb != NULL)
+        {
+            cb(arg);
+        }
+        ret = 0;
+    }
+    else
+    {
+        dma_busy = 1;
+        dma_cb = cb;
+        dma_cb_arg = arg;
+
+        if (rx != NULL)
+        {
+            dma_setup(SPI_DMA_RX, rx, len, 0, 1);
+        }
+        else
+        {
+            dma_setup(SPI_DMA_RX, &dma_sink, len, 0, 0);
+        }
+        dma_enable_transfer_complete_interrupt(SPI_DMA, SPI_DMA_RX);
+
+        if (tx != NULL)
+        {
+            dma_setup(SPI_DMA_TX, tx, len, 1, 1);
+        }
+        else
+        {
+            dma_setup(SPI_DMA_TX, &dma_fill, len, 1, 0);
+        }
+
+        /* RX first, so that no received byte is lost. */
+        dma_start(SPI_DMA_RX);
+        dma_start(SPI_DMA_TX);
+        spi_enable_rx_dma(SPI1);
+        spi_enable_tx_dma(SPI1);
+
+        ret = 0;
+    }
+
+    return ret;
+}
+
+int spi_dma_busy(void)
+{
+    return dma_busy;
+}
+
+static
+void spi_dma_xfer_done(void *arg)
+{
+    /* the interrupt handler signals the event after this */
+    *(volatile int *)arg = 1;
+}
+
+void spi_dma_xfer(const void *tx, void *rx, size_t len)
+{
+    if (len < SPI_DMA_MIN_LEN)
+    {
+        const uint8_t *tx_bytes = tx;
+        uint8_t *rx_bytes = rx;
+        size_t i_byte;
+
+        for (i_byte = 0; i_byte < len; i_byte++)
+        {
+            uint8_t b;
+
+            b = spi_xfer(SPI1, (tx_bytes == NULL)?SPI_DMA_FILL:tx_bytes[i_byte]);
+            if (rx_bytes != NULL)
+            {
+                rx_bytes[i_byte] = b;
+            }
+        }
+    }
+    else
+    {
+        volatile int done;
+        unsigned int seq;
+
+        done = 0;
+        do
+        {
+            seq = wait_event_seq();
+            if (spi_dma_start(tx, rx, len, spi_dma_xfer_done, (void *)&done) == 0)
+            {
+                break;
+            }
+            /* the previous transfer signals its end */
+            wait_event(seq, &TIMESPEC_INFINITY);
+        } while (1);
+        do
+        {
+            /* the CPU sleeps until the completion interrupt */
+            seq = wait_event_seq();
+            if (done)
+            {
+                break;
+            }
+            wait_event(seq, &TIMESPEC_INFINITY);
+        } while (1);
+    }
+}
+
+/* The RX channel is the last one to complete:
+ * when all bytes are received, the bus is idle.
+ */
+void spi_dma_rx_isr(void)
+{
+    if (dma_get_interrupt_flag(SPI_DMA, SPI_DMA_RX, DMA_TCIF))
+    {
+        spi_dma_callback_t cb;
+        void *arg;
+
+        dma_clear_interrupt_flags(SPI_DMA, SPI_DMA_RX, DMA_TCIF);
+        spi_disable_tx_dma(SPI1);
+        spi_disable_rx_dma(SPI1);
+        dma_stop(SPI_DMA_TX);
+        dma_stop(SPI_DMA_RX);
+
+        cb = dma_cb;
+        arg = dma_cb_arg;
+        dma_cb = NULL;
+        dma_busy = 0;
+        if (cb != NULL)
+        {
+            cb(arg);
+        }
+        wait_event_signal();
+    }
+}
+
+void spi_dma_init(void)
+{
+    rcc_periph_clock_enable(SPI_DMA_RCC);
+    nvic_enable_irq(SPI_DMA_RX_IRQ);
+}
+
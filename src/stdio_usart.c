@@ -20,6 +20,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/spi.h>
 #include <libopencm3/stm32/usart.h>
@@ -74,6 +75,33 @@ int stdio_usart_read(int fd, char *ptr, int len)
     return nread;
 }
 
+/* The USART is not driven by interrupts, so it does not notify. */
+static
+short stdio_usart_poll_in(int fd)
+{
+    short ret = 0;
+
+    (void)fd;
+    if (USART_SR(USART2) & USART_SR_RXNE)
+    {
+        ret |= POLLIN|POLLRDNORM;
+    }
+    return ret;
+}
+
+static
+short stdio_usart_poll_out(int fd)
+{
+    short ret = 0;
+
+    (void)fd;
+    if (USART_SR(USART2) & USART_SR_TXE)
+    {
+        ret |= POLLOUT|POLLWRNORM;
+    }
+    return ret;
+}
+
 static
 void stdio_usart_init(void)
 {
@@ -106,9 +134,10 @@ void fileno_out_init(int fd)
     f = file_struct_get(fd);
 
     f->fd = fd;
-    f->stat.st_mode = S_IFCHR|S_IWUSR|S_IWGRP|S_IWOTH;
+    f->mode = S_IFCHR|S_IWUSR|S_IWGRP|S_IWOTH;
     f->status_flags = O_WRONLY;
     f->write = stdio_usart_write;
+    f->poll = stdio_usart_poll_out;
     f->isatty = 1;
     f->isopen = 1;
 }
@@ -120,9 +149,10 @@ void fileno_in_init(int fd)
     f = file_struct_get(fd);
 
     f->fd = fd;
-    f->stat.st_mode = S_IFCHR|S_IRUSR|S_IRGRP|S_IROTH;
+    f->mode = S_IFCHR|S_IRUSR|S_IRGRP|S_IROTH;
     f->status_flags = O_RDONLY;
     f->read = stdio_usart_read;
+    f->poll = stdio_usart_poll_in;
     f->isatty = 1;
     f->isopen = 1;
 }
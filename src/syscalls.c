@@ -23,8 +23,11 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
+#include <limits.h>
+#include <sys/uio.h>
 #include "file.h"
 #include "fatfs.h"
+#include "procfs.h"
 
 int _open(const char *pathname, int flags);
 int _fstat(int fd, struct stat *buf);
@@ -43,10 +46,16 @@ int _open(const char *pathname, int flags)
 {
     int ret;
 
-    /* TODO: choose driver */
     /* TODO: stdin, stdout, stderr */
 
-    ret = fatfs_open(pathname, flags);
+    if (strncmp(pathname, "/proc/", 6) == 0)
+    {
+        ret = procfs_open(pathname, flags);
+    }
+    else
+    {
+        ret = fatfs_open(pathname, flags);
+    }
 
     return ret;
 }
@@ -107,6 +116,128 @@ int _read (int fd, char *ptr, int len)
     return ret;
 }
 
+/* Returns the total length of the vector, or -1 if it is not valid. */
+static
+ssize_t iov_total(const struct iovec *iov, int iovcnt)
+{
+    ssize_t total = 0;
+    int i;
+
+    if ((iovcnt <= 0) || (iovcnt > IOV_MAX))
+    {
+        total = -1;
+    }
+    for (i = 0; (i < iovcnt) && (total >= 0); i++)
+    {
+        if (iov[i].iov_len > (size_t)(SSIZE_MAX - total))
+        {
+            total = -1;
+        }
+        else
+        {
+            total += iov[i].iov_len;
+        }
+    }
+    return total;
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    ssize_t ret;
+    struct fd *f;
+
+    f = file_struct_get(fd);
+    if ((f == NULL) || !f->isopen)
+    {
+        errno = EBADF;
+        ret = -1;
+    }
+    else if (iov_total(iov, iovcnt) < 0)
+    {
+        errno = EINVAL;
+        ret = -1;
+    }
+    else if (f->writev != NULL)
+    {
+        ret = f->writev(fd, iov, iovcnt);
+    }
+    else
+    {
+        int i;
+
+        /* one write for each buffer, stopping at the first short one */
+        ret = 0;
+        for (i = 0; i < iovcnt; i++)
+        {
+            int written;
+
+            written = _write(fd, iov[i].iov_base, iov[i].iov_len);
+            if (written < 0)
+            {
+                if (ret == 0)
+                {
+                    ret = -1;
+                }
+                break;
+            }
+            ret += written;
+            if ((size_t)written < iov[i].iov_len)
+            {
+                break;
+            }
+        }
+    }
+    return ret;
+}
+
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    ssize_t ret;
+    struct fd *f;
+
+    f = file_struct_get(fd);
+    if ((f == NULL) || !f->isopen)
+    {
+        errno = EBADF;
+        ret = -1;
+    }
+    else if (iov_total(iov, iovcnt) < 0)
+    {
+        errno = EINVAL;
+        ret = -1;
+    }
+    else if (f->readv != NULL)
+    {
+        ret = f->readv(fd, iov, iovcnt);
+    }
+    else
+    {
+        int i;
+
+        ret = 0;
+        for (i = 0; i < iovcnt; i++)
+        {
+            int nread;
+
+            nread = _read(fd, iov[i].iov_base, iov[i].iov_len);
+            if (nread < 0)
+            {
+                if (ret == 0)
+                {
+                    ret = -1;
+                }
+                break;
+            }
+            ret += nread;
+            if ((size_t)nread < iov[i].iov_len)
+            {
+                break;
+            }
+        }
+    }
+    return ret;
+}
+
 void * _sbrk (ptrdiff_t incr)
 {
     extern uint8_t end;
@@ -179,8 +310,17 @@ int _fstat(int fd, struct stat *buf)
     }
     else
     {
-        *buf = f->stat;
-        ret = 0;
+        memset(buf, 0, sizeof(*buf));
+        buf->st_mode = f->mode;
+        buf->st_nlink = 1;
+        if (f->fstat != NULL)
+        {
+            ret = f->fstat(fd, buf);
+        }
+        else
+        {
+            ret = 0;
+        }
     }
     return ret;
 }
@@ -213,6 +353,17 @@ int _isatty(int fd)
     return ret;
 }
 
+/* /proc is served by procfs.o only when it is linked. */
+__attribute__((__weak__))
+int procfs_open(const char *pathname, int flags)
+{
+    errno = ENOENT;
+    (void)pathname;
+    (void)flags;
+
+    return -1;
+}
+
 /* newlib uses lseek in stdio, so to link easily without forcing to link fatfs.o
  * there is a weak implementation of fatfs_lseek that always fails.
  */
@@ -246,12 +397,12 @@ _off_t _lseek(int fd, _off_t offset, int whence )
         errno = EBADF;
         ret = -1;
     }
-    else if (S_ISSOCK(f->stat.st_mode))
+    else if (S_ISSOCK(f->mode) || S_ISFIFO(f->mode))
     {
-        errno = EPIPE;
+        errno = ESPIPE;
         ret = -1;
     }
-    else if (S_ISREG(f->stat.st_mode))
+    else if (S_ISREG(f->mode))
     {
         ret = fatfs_lseek(fd, offset, whence);
     }
@@ -0,0 +1,300 @@
+/*
+ * Copyright (c) 2016 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdint.h>
+#include <poll.h>
+#include "file.h"
+#include "timespec.h"
+#include "wait.h"
+#include "critical.h"
+
+#ifndef TIMERFD_MAX
+#  define TIMERFD_MAX 2
+#endif
+
+struct timerfd {
+    int allocated;
+    int fd;
+    timer_t timerid;
+    uint64_t expirations; /* counted by the timer interrupt */
+};
+
+static
+int timerfd_close(int fd);
+
+static
+struct timerfd timerfds[TIMERFD_MAX];
+
+static
+struct timerfd *timerfd_get(int fd)
+{
+    struct timerfd *t;
+    struct fd *f;
+
+    f = file_struct_get(fd);
+    if ((f == NULL) || !f->isopen || (f->close != timerfd_close))
+    {
+        errno = EBADF;
+        t = NULL;
+    }
+    else
+    {
+        t = f->opaque;
+    }
+    return t;
+}
+
+/* SIGEV_THREAD function, called by the timer interrupt. */
+static
+void timerfd_expired(union sigval value)
+{
+    struct timerfd *t = value.sival_ptr;
+    int overrun;
+
+    overrun = timer_getoverrun(t->timerid);
+    if (overrun < 0)
+    {
+        overrun = 0;
+    }
+    t->expirations += 1 + overrun;
+    file_notify(t->fd);
+}
+
+static
+uint64_t timerfd_take(struct timerfd *t)
+{
+    uint64_t expirations;
+    int cs_state;
+
+    cs_state = critical_section_begin();
+    expirations = t->expirations;
+    t->expirations = 0;
+    critical_section_end(cs_state);
+
+    return expirations;
+}
+
+static
+int timerfd_read(int fd, char *ptr, int len)
+{
+    int ret;
+    struct timerfd *t;
+
+    t = timerfd_get(fd);
+    if (t == NULL)
+    {
+        ret = -1;
+    }
+    else if (len < (int)sizeof(uint64_t))
+    {
+        errno = EINVAL;
+        ret = -1;
+    }
+    else
+    {
+        int nonblock;
+
+        nonblock = (file_struct_get(fd)->status_flags & O_NONBLOCK) || !wait_allowed();
+        do
+        {
+            unsigned int seq;
+            uint64_t expirations;
+
+            seq = wait_event_seq();
+            expirations = timerfd_take(t);
+            if (expirations > 0)
+            {
+                memcpy(ptr, &expirations, sizeof(expirations));
+                ret = sizeof(expirations);
+                break;
+            }
+            else if (nonblock)
+            {
+                errno = EAGAIN;
+                ret = -1;
+                break;
+            }
+            wait_event(seq, &TIMESPEC_INFINITY);
+        } while (1);
+    }
+    return ret;
+}
+
+static
+short timerfd_poll(int fd)
+{
+    short ret;
+    struct timerfd *t;
+
+    t = timerfd_get(fd);
+    if (t == NULL)
+    {
+        ret = POLLNVAL;
+    }
+    else
+    {
+        int cs_state;
+
+        cs_state = critical_section_begin();
+        ret = (t->expirations > 0) ? (POLLIN|POLLRDNORM) : 0;
+        critical_section_end(cs_state);
+    }
+    return ret;
+}
+
+static
+int timerfd_close(int fd)
+{
+    int ret;
+    struct timerfd *t;
+
+    t = timerfd_get(fd);
+    if (t == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        ret = timer_delete(t->timerid);
+        file_struct_get(fd)->isopen = 0;
+        file_free(fd);
+        t->allocated = 0;
+    }
+    return ret;
+}
+
+int timerfd_create(int clockid, int flags)
+{
+    int ret;
+    struct timerfd *t = NULL;
+    int i;
+
+    for (i = 0; (i < TIMERFD_MAX) && (t == NULL); i++)
+    {
+        if (!timerfds[i].allocated)
+        {
+            t = &timerfds[i];
+        }
+    }
+    if (flags & ~(TFD_NONBLOCK|TFD_CLOEXEC))
+    {
+        errno = EINVAL;
+        ret = -1;
+    }
+    else if (t == NULL)
+    {
+        errno = EMFILE;
+        ret = -1;
+    }
+    else
+    {
+        struct sigevent ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.sigev_notify = SIGEV_THREAD;
+        ev.sigev_notify_function = timerfd_expired;
+        ev.sigev_value.sival_ptr = t;
+        t->expirations = 0;
+        if (timer_create(clockid, &ev, &t->timerid) != 0)
+        {
+            ret = -1;
+        }
+        else
+        {
+            ret = file_alloc();
+            if (ret < 0)
+            {
+                errno = ENFILE;
+                timer_delete(t->timerid);
+            }
+            else
+            {
+                struct fd *f;
+
+                t->allocated = 1;
+                t->fd = ret;
+
+                f = file_struct_get(ret);
+                f->isatty = 0;
+                f->isopen = 1;
+                f->read = timerfd_read;
+                f->close = timerfd_close;
+                f->poll = timerfd_poll;
+                f->notifies = 1;
+                f->mode = S_IFCHR|S_IRUSR;
+                f->status_flags = O_RDONLY|(flags & TFD_NONBLOCK);
+                f->descriptor_flags = (flags & TFD_CLOEXEC) ? FD_CLOEXEC : 0;
+                f->opaque = t;
+            }
+        }
+    }
+    return ret;
+}
+
+/* Setting the timer again forgets the expirations not read yet. */
+int timerfd_settime(int fd, int flags,
+        const struct itimerspec *new_value, struct itimerspec *old_value)
+{
+    int ret;
+    struct timerfd *t;
+
+    t = timerfd_get(fd);
+    if (t == NULL)
+    {
+        ret = -1;
+    }
+    else if (flags & ~TFD_TIMER_ABSTIME)
+    {
+        errno = EINVAL;
+        ret = -1;
+    }
+    else
+    {
+        int cs_state;
+
+        cs_state = critical_section_begin();
+        t->expirations = 0;
+        ret = timer_settime(t->timerid, flags, new_value, old_value);
+        critical_section_end(cs_state);
+    }
+    return ret;
+}
+
+int timerfd_gettime(int fd, struct itimerspec *curr_value)
+{
+    int ret;
+    struct timerfd *t;
+
+    t = timerfd_get(fd);
+    if (t == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        ret = timer_gettime(t->timerid, curr_value);
+    }
+    return ret;
+}
@@ -21,10 +21,22 @@
 #include <errno.h>
 #include <string.h>
 #include <limits.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/timer.h>
 #include <libopencm3/cm3/nvic.h>
-#include <libopencm3/cm3/cortex.h>
 #include "timespec.h"
 #include "sigqueue_info.h"
+#include "wait.h"
+#include "critical.h"
+
+/* TIM2 counts at 10kHz; it is 16 bits on STM32F1, so expirations
+ * further than about 6.5s are reached in more steps.
+ */
+#define HW_TIMER_FREQ_HZ 10000
+#define HW_TIMER_NSEC (NSECS_IN_SEC/HW_TIMER_FREQ_HZ)
+#define HW_TIMER_MAX_TICKS 0xFFFF
+
+void tim2_isr(void);
 
 struct sys_timer
 {
@@ -40,29 +52,7 @@ static
 struct sys_timer sys_timers[TIMER_MAX];
 
 static
-int critical_section_begin(void)
-{
-    int faults_already_disabled;
-
-    faults_already_disabled = cm_is_masked_faults();
-    if (!faults_already_disabled)
-    {
-        cm_disable_faults();
-    }
-
-    return faults_already_disabled;
-}
-
-static
-void critical_section_end(int state)
-{
-    int faults_already_disabled = state;
-
-    if (!faults_already_disabled)
-    {
-        cm_enable_faults();
-    }
-}
+int hw_timer_initialized;
 
 static
 int sys_timerid2td(timer_t timerid)
@@ -209,19 +199,70 @@ int sys_timer_next_expiring(void)
     return td_expiring;
 }
 
+static
+uint32_t hw_timer_clock(void)
+{
+    uint32_t clk;
+
+    clk = rcc_apb1_frequency;
+    if (rcc_apb1_frequency != rcc_ahb_frequency)
+    {
+        /* timers on APB1 run at twice its clock when it is divided */
+        clk *= 2;
+    }
+    return clk;
+}
+
 static
 void hw_timer_init(void)
 {
+    rcc_periph_clock_enable(RCC_TIM2);
+    timer_set_mode(TIM2, TIM_CR1_CKD_CK_INT, TIM_CR1_CMS_EDGE, TIM_CR1_DIR_UP);
+    timer_set_prescaler(TIM2, (hw_timer_clock() / HW_TIMER_FREQ_HZ) - 1);
+    timer_one_shot_mode(TIM2);
+    /* loads the prescaler; this update is not an expiration */
+    timer_generate_event(TIM2, TIM_EGR_UG);
+    timer_clear_flag(TIM2, TIM_SR_UIF);
+    timer_enable_irq(TIM2, TIM_DIER_UIE);
+    nvic_enable_irq(NVIC_TIM2_IRQ);
+    hw_timer_initialized = 1;
 }
 
 static
 void hw_timer_start(const struct timespec *interval)
 {
+    uint32_t ticks;
+
+    if (interval->tv_sec >= (HW_TIMER_MAX_TICKS / HW_TIMER_FREQ_HZ))
+    {
+        ticks = HW_TIMER_MAX_TICKS;
+    }
+    else
+    {
+        /* rounded up, so that the timer never expires early */
+        ticks = interval->tv_sec * HW_TIMER_FREQ_HZ;
+        ticks += (interval->tv_nsec + HW_TIMER_NSEC - 1) / HW_TIMER_NSEC;
+        if (ticks > HW_TIMER_MAX_TICKS)
+        {
+            ticks = HW_TIMER_MAX_TICKS;
+        }
+        else if (ticks < 2)
+        {
+            ticks = 2;
+        }
+    }
+    timer_disable_counter(TIM2);
+    timer_set_counter(TIM2, 0);
+    /* the update comes when the counter goes past the period */
+    timer_set_period(TIM2, ticks - 1);
+    timer_enable_counter(TIM2);
 }
 
 static
 void hw_timer_stop(void)
 {
+    timer_disable_counter(TIM2);
+    timer_clear_flag(TIM2, TIM_SR_UIF);
 }
 
 static
@@ -230,6 +271,40 @@ void timer_expired(int td)
     siginfo_t info;
     int ret;
 
+    if (timespec_diff(&sys_timers[td].value.it_interval, &TIMESPEC_ZERO, NULL) > 0)
+    {
+        struct timespec now;
+        int overrun = 0;
+
+        /* Re-arm timer, from when it should have expired so that it
+         * does not drift; the periods already gone are overruns.
+         */
+        clock_gettime(sys_timers[td].clockid, &now);
+        do
+        {
+            timespec_incr(&sys_timers[td].value.it_value, &sys_timers[td].value.it_interval);
+            if (timespec_diff(&sys_timers[td].value.it_value, &now, NULL) > 0)
+            {
+                break;
+            }
+            overrun++;
+        } while (overrun < DELAYTIMER_MAX);
+        if (overrun == DELAYTIMER_MAX)
+        {
+            timespec_add(
+                    &now,
+                    &sys_timers[td].value.it_interval,
+                    &sys_timers[td].value.it_value);
+        }
+        sys_timers[td].overrun = overrun;
+    }
+    else
+    {
+        /* Disarm timer */
+        sys_timers[td].value.it_value = TIMESPEC_ZERO;
+        sys_timers[td].overrun = 0;
+    }
+
     switch(sys_timers[td].sevp.sigev_notify)
     {
         case SIGEV_NONE:
@@ -248,25 +323,10 @@ void timer_expired(int td)
             break;
 
         case SIGEV_THREAD:
+            /* the function may set the timer again */
             sys_timers[td].sevp.sigev_notify_function(sys_timers[td].sevp.sigev_value);
             break;
     }
-    if (timespec_diff(&sys_timers[td].value.it_interval, &TIMESPEC_ZERO, NULL) > 0)
-    {
-        struct timespec now;
-        
-        /* Re-arm timer */
-        clock_gettime(sys_timers[td].clockid, &now);
-        timespec_add(
-                &now,
-                &sys_timers[td].value.it_interval,
-                &sys_timers[td].value.it_value);
-    }
-    else
-    {
-        /* Disarm timer */
-        sys_timers[td].value.it_value = TIMESPEC_ZERO;
-    }
 }
 
 static
@@ -301,6 +361,16 @@ void sys_timers_manage(void)
     } while(expired);
 }
 
+void tim2_isr(void)
+{
+    if (timer_get_flag(TIM2, TIM_SR_UIF))
+    {
+        timer_clear_flag(TIM2, TIM_SR_UIF);
+        sys_timers_manage();
+        wait_event_signal();
+    }
+}
+
 static
 void sys_timer_free(int td)
 {
@@ -320,6 +390,10 @@ int timer_create(
 
     if ( (clockid == CLOCK_MONOTONIC) || (clockid == CLOCK_REALTIME) )
     {
+        if (!hw_timer_initialized)
+        {
+            hw_timer_init();
+        }
         td = sys_timer_alloc();
         if (td != -1)
         {
@@ -363,8 +437,13 @@ int timer_delete(timer_t timerid)
     td = sys_timerid2td(timerid);
     if (sys_timer_isallocated(td))
     {
-        /* TODO: stop timer? */
+        int cs_state;
+
+        cs_state = critical_section_begin();
         sys_timer_free(td);
+        /* the hardware timer goes on for the others, if any */
+        sys_timers_manage();
+        critical_section_end(cs_state);
         ret = 0;
     }
     else
@@ -388,6 +467,10 @@ int timer_settime(
     td = sys_timerid2td(timerid);
     if (sys_timer_isallocated(td))
     {
+        int cs_state;
+
+        /* tim2_isr manages the timers too */
+        cs_state = critical_section_begin();
         if (old_value != NULL)
         {
             if (sys_timer_isarmed(td))
@@ -419,6 +502,7 @@ int timer_settime(
         }
 
         sys_timers_manage();
+        critical_section_end(cs_state);
         ret = 0;
     }
     else
@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2016 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include "w5100.h"
+#include "spi_bus.h"
+#include "wait.h"
+#include "critical.h"
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/exti.h>
+#include <libopencm3/cm3/nvic.h>
+
+/* The W5100 INT pin is active low, and stays low as long as
+ * an interrupt enabled in IMR is set in IR.
+ * On the Arduino Ethernet shield it reaches D2 only if the INT
+ * jumper is closed, so it must be enabled explicitly with
+ * W5100_INT_ENABLED; otherwise events are polled from Sn_IR.
+ */
+#ifdef W5100_INT_ENABLED
+#  ifndef W5100_INT_PORT
+/* CN9_3 D2 PA10 */
+#    define W5100_INT_PORT GPIOA
+#    define W5100_INT_PIN GPIO10
+#    define W5100_INT_EXTI EXTI10
+#    define W5100_INT_IRQ NVIC_EXTI15_10_IRQ
+#    define w5100_int_isr exti15_10_isr
+#  endif
+#endif
+
+#define W5100_IR_SOCKETS (W5100_S0_INT|W5100_S1_INT|W5100_S2_INT|W5100_S3_INT)
+
+void w5100_int_isr(void);
+
+static volatile struct {
+    uint8_t ir;
+    uint8_t sock_ir[W5100_N_SOCKETS];
+    int pending;
+} w5100_events;
+
+/* Moves Sn_IR into RAM, clearing it in the chip.
+ * The bus is held from the read to the clear: a handler fetching in
+ * between would record the same bits, and a bit latched after that
+ * would be cleared here without being recorded.
+ */
+static
+uint8_t sock_ir_fetch(int isocket)
+{
+    uint8_t sir;
+    int cs_state;
+
+    w5100_spi_lock();
+    sir = w5100_read_sock_reg(W5100_Sn_IR, isocket);
+    if (sir != 0)
+    {
+        /* write 1 to clear, only the bits just read */
+        w5100_write_sock_reg(W5100_Sn_IR, isocket, sir);
+        cs_state = critical_section_begin();
+        w5100_events.sock_ir[isocket] |= sir;
+        critical_section_end(cs_state);
+    }
+    w5100_spi_unlock();
+
+    return sir;
+}
+
+/* Empty default, in case the socket layer is not linked. */
+__attribute__((__weak__))
+void w5100_sock_events_notify(int isocket)
+{
+    (void)isocket;
+}
+
+#ifdef W5100_INT_ENABLED
+
+static
+int int_is_asserted(void)
+{
+    return (gpio_get(W5100_INT_PORT, W5100_INT_PIN) == 0);
+}
+
+/* Moves IR and Sn_IR into RAM, clearing them in the chip.
+ * The SPI bus must be held.
+ */
+static
+void events_fetch(void)
+{
+    uint8_t ir;
+    int isocket;
+    int cs_state;
+
+    w5100_events.pending = 0;
+    do {
+        ir = w5100_read_reg(W5100_IR);
+        for (isocket = 0; isocket < W5100_N_SOCKETS; isocket++)
+        {
+            if (ir & (W5100_S0_INT << isocket))
+            {
+                if (sock_ir_fetch(isocket) != 0)
+                {
+                    w5100_sock_events_notify(isocket);
+                }
+            }
+        }
+        if (ir & ~W5100_IR_SOCKETS)
+        {
+            w5100_write_reg(W5100_IR, ir & ~W5100_IR_SOCKETS);
+        }
+        cs_state = critical_section_begin();
+        w5100_events.ir |= ir;
+        critical_section_end(cs_state);
+    } while (int_is_asserted());
+}
+
+static
+void events_update(void)
+{
+    if (w5100_events.pending || int_is_asserted())
+    {
+        /* the interrupt arrived while the bus was busy */
+        w5100_spi_lock();
+        events_fetch();
+        w5100_spi_unlock();
+    }
+}
+
+/* The events deferred by the handler are fetched as soon as the bus
+ * is released, so that the notified files (epoll) see them even if
+ * nobody asks the socket layer.
+ */
+void spi_bus_idle(void)
+{
+    if (w5100_events.pending && (w5100_spi_trylock() == 0))
+    {
+        events_fetch();
+        w5100_spi_unlock();
+        wait_event_signal();
+    }
+}
+
+void w5100_int_isr(void)
+{
+    exti_reset_request(W5100_INT_EXTI);
+    if (w5100_spi_trylock() == 0)
+    {
+        events_fetch();
+        w5100_spi_unlock();
+    }
+    else
+    {
+        w5100_events.pending = 1;
+    }
+    wait_event_signal();
+}
+
+#else
+
+static
+void events_update(void)
+{
+}
+
+#endif
+
+uint8_t w5100_sock_events_take(int isocket)
+{
+    uint8_t sir;
+    int cs_state;
+
+#ifdef W5100_INT_ENABLED
+    events_update();
+#else
+    (void)sock_ir_fetch(isocket);
+#endif
+    cs_state = critical_section_begin();
+    sir = w5100_events.sock_ir[isocket];
+    w5100_events.sock_ir[isocket] = 0;
+    critical_section_end(cs_state);
+
+    return sir;
+}
+
+uint8_t w5100_events_take(void)
+{
+    uint8_t ir;
+    int cs_state;
+
+    events_update();
+    cs_state = critical_section_begin();
+    ir = w5100_events.ir;
+    w5100_events.ir = 0;
+    critical_section_end(cs_state);
+
+    return ir;
+}
+
+int w5100_int_enabled(void)
+{
+#ifdef W5100_INT_ENABLED
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+void w5100_int_init(void)
+{
+    int isocket;
+
+    for (isocket = 0; isocket < W5100_N_SOCKETS; isocket++)
+    {
+        w5100_events.sock_ir[isocket] = 0;
+    }
+    w5100_events.ir = 0;
+    w5100_events.pending = 0;
+#ifdef W5100_INT_ENABLED
+#  ifdef STM32F1
+    rcc_periph_clock_enable(RCC_AFIO);
+    gpio_set_mode(W5100_INT_PORT, GPIO_MODE_INPUT, GPIO_CNF_INPUT_PULL_UPDOWN, W5100_INT_PIN);
+    gpio_set(W5100_INT_PORT, W5100_INT_PIN); /* pull-up */
+#  elif defined(STM32F4)
+    rcc_periph_clock_enable(RCC_SYSCFG);
+    gpio_mode_setup(W5100_INT_PORT, GPIO_MODE_INPUT, GPIO_PUPD_PULLUP, W5100_INT_PIN);
+#  endif
+    exti_select_source(W5100_INT_EXTI, W5100_INT_PORT);
+    exti_set_trigger(W5100_INT_EXTI, EXTI_TRIGGER_FALLING);
+    exti_enable_request(W5100_INT_EXTI);
+    nvic_enable_irq(W5100_INT_IRQ);
+
+    w5100_write_reg(W5100_IMR, W5100_IR_SOCKETS);
+#else
+    w5100_write_reg(W5100_IMR, 0);
+#endif
+}
+
@@ -21,12 +21,21 @@
 #include <errno.h>
 #include <file.h>
 #include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
 #include <time.h>
+#include <signal.h>
 #include <sys/time.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <netinet/tcp.h>
+#include <limits.h>
+#include <sys/uio.h>
 #include "w5100.h"
+#include "w5100_socket.h"
 #include "timespec.h"
+#include "wait.h"
 
 /******* defines and macros ********/
 
@@ -38,6 +47,107 @@
 #  error "Only one of W5100_NO_STATIC_IP or W5100_STATIC_IP must be defined."
 #endif
 
+/* Initial split of the 8KiB RX and TX memories
+ * among the sockets, in RMSR/TMSR format:
+ * 2 bits per socket, 0 -> 1KiB, 1 -> 2KiB, 2 -> 4KiB, 3 -> 8KiB.
+ * Memory is given to sockets in order, and the sockets
+ * that don't fit can't be used.
+ * Can be changed at runtime per socket with SO_RCVBUF/SO_SNDBUF.
+ */
+#ifndef W5100_RMSR_INIT
+#  define W5100_RMSR_INIT 0x55 /* 2KiB per socket */
+#endif
+#ifndef W5100_TMSR_INIT
+#  define W5100_TMSR_INIT 0x55 /* 2KiB per socket */
+#endif
+
+#define W5100_SOCK_MEM_MIN 0x0400 /* 1KiB */
+#define W5100_SOCK_MEM_MAX 0x2000 /* 8KiB */
+
+/* Held TCP data is sent when it reaches this length... */
+#ifndef W5100_TX_FLUSH_LEN
+#  define W5100_TX_FLUSH_LEN 1460 /* default MSS */
+#endif
+/* ...or when it has been held for this time. */
+#ifndef W5100_TX_HOLD_MS
+#  define W5100_TX_HOLD_MS 200
+#endif
+
+/* IANA dynamic ports */
+#define W5100_PORT_EPHEMERAL_FIRST 49152
+#define W5100_PORT_EPHEMERAL_LAST 65535
+
+/* Local ports of closed connections are not reused for a while. */
+#ifndef W5100_PORT_QUARANTINE_N
+#  define W5100_PORT_QUARANTINE_N 8
+#endif
+#ifndef W5100_PORT_QUARANTINE_S
+#  define W5100_PORT_QUARANTINE_S 60 /* 2 MSL */
+#endif
+
+/* At most this many hardware sockets listen on a port. */
+#ifndef W5100_LISTEN_POOL_MAX
+#  define W5100_LISTEN_POOL_MAX SOMAXCONN
+#endif
+
+/* Retransmission defaults: the ones of the chip, 200ms and 8 retries. */
+#ifndef W5100_RTR_INIT
+#  define W5100_RTR_INIT 2000 /* 100us units */
+#endif
+#ifndef W5100_RCR_INIT
+#  define W5100_RCR_INIT 8
+#endif
+/* Bounds of the retransmission time with TCP_RTO_ADAPTIVE. */
+#ifndef W5100_RTO_MIN_US
+#  define W5100_RTO_MIN_US 5000
+#endif
+#define W5100_RTO_MAX_US (UINT16_MAX * 100UL)
+
+/* SO_KEEPALIVE defaults, like in Linux. */
+#ifndef W5100_KEEPIDLE_S
+#  define W5100_KEEPIDLE_S 7200
+#endif
+#ifndef W5100_KEEPINTVL_S
+#  define W5100_KEEPINTVL_S 75
+#endif
+#ifndef W5100_KEEPCNT
+#  define W5100_KEEPCNT 9
+#endif
+
+#ifdef W5100_UDP_MUX
+/* Virtual UDP sockets, sharing one hardware socket. */
+#  ifndef W5100_UDP_MUX_N
+#    define W5100_UDP_MUX_N 8
+#  endif
+/* RAM for datagrams waiting for a socket other than the one reading. */
+#  ifndef W5100_UDP_MUX_PARK_SIZE
+#    define W5100_UDP_MUX_PARK_SIZE 1024
+#  endif
+#  define IPRAW_HEADER_SIZE 6 /* W5100 IPRAW RX header: source IP, length */
+#  define UDP_HEADER_SIZE 8
+#  define IP_PROTO_UDP 17
+#endif
+
+/* A graceful close taking longer than this is aborted. */
+#ifndef W5100_CLOSE_TIMEOUT_MS
+#  define W5100_CLOSE_TIMEOUT_MS 10000
+#endif
+
+/* tx_flags */
+#define W5100_TX_NODELAY  0x01 /* TCP_NODELAY */
+#define W5100_TX_CORK     0x02 /* TCP_CORK */
+#define W5100_TX_MORE     0x04 /* last send had MSG_MORE */
+#define W5100_TX_INFLIGHT 0x08 /* SEND issued, SEND_OK not seen yet */
+
+/* Held data is pushed out only by the next call on the socket, there
+ * is no timer: Nagle coalescing (TCP_NODELAY off) must be asked for.
+ */
+#ifdef W5100_TCP_NAGLE
+#  define W5100_TX_FLAGS_INIT 0
+#else
+#  define W5100_TX_FLAGS_INIT W5100_TX_NODELAY
+#endif
+
 #ifdef W5100_STATIC_IP
 #  ifndef W5100_IP_ADDR
 #    define W5100_IP_ADDR "192.168.1.99"
@@ -58,11 +168,69 @@ enum w5100_socket_state {
     W5100_SOCK_STATE_LISTENING,
     W5100_SOCK_STATE_ACCEPTED,
     W5100_SOCK_STATE_DISCONNECTED,
+    W5100_SOCK_STATE_CONNECTING,
+    W5100_SOCK_STATE_CLOSING,
 };
 
 struct timeout_manager {
     int has_timeout;
     struct timespec end;
+    unsigned int seq; /* events seen before the last check */
+};
+
+/* How the RX or TX memory is divided among the sockets.
+ * A size of 0 means that the socket got no memory and can't be used.
+ */
+struct w5100_mem_split {
+    uint16_t default_size[W5100_N_SOCKETS];
+    uint16_t size[W5100_N_SOCKETS];
+    uint16_t base[W5100_N_SOCKETS]; /* offset from the start of memory */
+};
+
+/* Traffic of one socket, for TCP_INFO. */
+struct w5100_socket_counters {
+    uint32_t bytes_sent;
+    uint32_t bytes_received;
+    uint32_t send_commands;
+    uint32_t recv_commands;
+    uint32_t timeouts;
+    uint32_t spi_frames_start; /* w5100_spi_sock_frames at reset */
+};
+
+/* SO_KEEPALIVE of a TCP socket. The W5100 retransmits a probe sent
+ * with SEND_KEEP as it does with data, by RTR and RCR, and closes the
+ * socket with a TIMEOUT if it is not acknowledged: probes keep being
+ * sent every intvl seconds until traffic or TIMEOUT, and cnt is only
+ * kept for getsockopt.
+ * The times are seconds of CLOCK_MONOTONIC.
+ */
+struct w5100_keepalive {
+    uint8_t enabled;
+    uint8_t probes; /* sent since the last traffic */
+    uint16_t cnt;
+    uint16_t idle; /* seconds without traffic before the first probe */
+    uint16_t intvl; /* seconds between probes */
+    uint32_t traffic; /* bytes sent and received, at the last check */
+    uint32_t last; /* keepalive_now of the last traffic or probe */
+};
+
+/* Retransmission timing of a socket. RTR and RCR are common to all
+ * the sockets, so they are loaded before each command of the socket
+ * that can retransmit (the shadow skips the writes that change
+ * nothing); segments already sent follow the values in force.
+ * The RTT is measured from CONNECT to ESTABLISHED and from SEND to
+ * SEND_OK, as seen by polling, so it is an upper bound: a sample that
+ * includes a retransmission only makes the estimate more prudent.
+ */
+struct w5100_retry {
+    uint16_t rtr; /* 100us units */
+    uint8_t rcr;
+    uint8_t syncnt; /* RCR for CONNECT, 0 for rcr */
+    uint8_t adaptive; /* rtr from the RTT, as in RFC 6298 */
+    uint32_t user_timeout; /* ms until TIMEOUT, 0 for W5100_RCR_INIT retries */
+    uint32_t srtt; /* us, 0 until measured */
+    uint32_t rttvar; /* us */
+    struct timespec sent; /* when the command being timed was given */
 };
 
 /******* function prototypes ********/
@@ -82,14 +250,82 @@ int w5100_sock_read(int fd, char *buf, int len);
 static
 int w5100_sock_close(int fd);
 
+static
+ssize_t w5100_sock_writev(int fd, const struct iovec *iov, int iovcnt);
+
+static
+ssize_t w5100_sock_readv(int fd, const struct iovec *iov, int iovcnt);
+
 static
 short w5100_sock_poll(int fd);
 
+static
+int w5100_sock_fstat(int fd, struct stat *buf);
+
+static
+uint16_t write_buf_len(int isocket);
+
 static
 void timeout_init(const struct timespec *timeout, struct timeout_manager *tom);
 
 static
-int timeout_ended(const struct timeout_manager *tom);
+int timeout_wait(struct timeout_manager *tom);
+
+struct w5100_socket;
+
+static
+void sock_tx_service(struct w5100_socket *s);
+
+static
+void sock_tx_flush(struct w5100_socket *s);
+
+static
+void sock_update(struct w5100_socket *s);
+
+static
+void sock_close_check(struct w5100_socket *s);
+
+static
+void sock_keepalive_restart(struct w5100_socket *s);
+
+static
+void sock_rtt_sample(struct w5100_socket *s);
+
+static
+void sock_retry_apply(const struct w5100_socket *s, uint8_t rcr);
+
+static
+void sockets_keepalive_service(void);
+
+static
+void sockets_service(void);
+
+static
+int pool_wants_relisten(const struct w5100_socket *s);
+
+static
+void pool_release(struct w5100_socket *listener);
+
+struct w5100_recv_view;
+
+#ifdef W5100_UDP_MUX
+static
+int udp_mux_socket_create(void);
+
+static
+int udp_mux_close(struct w5100_socket *s);
+
+static
+uint16_t udp_mux_view(struct w5100_socket *s, struct w5100_recv_view *view);
+
+static
+void udp_mux_release(struct w5100_socket *s, const struct w5100_recv_view *view);
+
+static
+int udp_mux_iov(const struct w5100_socket *s, const struct sockaddr_in *peer,
+        const struct iovec *iov, int iovcnt, size_t len,
+        struct iovec *mux_iov, uint8_t *header);
+#endif
 
 /******* global variables ********/
 
@@ -103,12 +339,57 @@ static struct w5100_socket {
     struct sockaddr_in sockname;
     struct sockaddr_in dest_address;
     int can_broadcast;
+    int error; /* pending SO_ERROR */
     struct timespec recv_timeout;
     struct timespec send_timeout;
+    struct linger linger;
+    uint8_t relisten; /* listen again at the end of CLOSING */
+    struct w5100_socket *listener; /* owner of the listening descriptor */
+    uint8_t backlog; /* for a listener, how many sockets should listen */
+    struct timespec close_time; /* CLOSING is forced to end after this */
     struct fd *fd_data;
     struct fd *connection_data;
+    uint8_t events; /* Sn_IR events still to be handled */
+    uint16_t tx_free; /* lower bound of Sn_TX_FSR */
+    uint16_t tx_wr; /* Sn_TX_WR plus the held data */
+    uint16_t tx_held; /* bytes in TX memory still waiting for SEND */
+    uint8_t tx_flags;
+    struct timespec tx_flush_time; /* held data is sent after this anyway */
+    struct w5100_socket_counters counters;
+    struct w5100_keepalive keepalive;
+    struct w5100_retry retry;
 } w5100_sockets[W5100_N_SOCKETS];
 
+#ifdef W5100_UDP_MUX
+static struct w5100_socket w5100_udp_vsockets[W5100_UDP_MUX_N];
+
+/* hardware socket carrying all the virtual ones, -1 if closed */
+static int udp_mux_isocket = -1;
+
+static uint8_t udp_mux_park[W5100_UDP_MUX_PARK_SIZE];
+
+static size_t udp_mux_park_used;
+#endif
+
+static struct w5100_mem_split w5100_rx_split;
+
+static struct w5100_mem_split w5100_tx_split;
+
+static struct w5100_socket_stats socket_stats;
+
+/* keepalive_now at the last check of the sockets */
+static uint32_t keepalive_checked;
+
+/* Set when SO_KEEPALIVE is set the first time. */
+static int keepalive_used;
+
+static struct {
+    uint16_t port; /* network byte order */
+    time_t until;
+} port_quarantine[W5100_PORT_QUARANTINE_N];
+
+static unsigned port_quarantine_next;
+
 static uint8_t w5100_mac_addr[6] = {0x80, 0x81, 0x82, 0x83, 0x84, 0x85};
 
 /******* function definitions ********/
@@ -129,6 +410,31 @@ struct w5100_socket *get_socket_from_isocket(int isocket)
     return s;
 }
 
+/* Whether s is a virtual UDP socket, without a W5100 socket of its own. */
+static
+int sock_is_vudp(const struct w5100_socket *s)
+{
+#ifdef W5100_UDP_MUX
+    return (s >= &w5100_udp_vsockets[0]) && (s < &w5100_udp_vsockets[W5100_UDP_MUX_N]);
+#else
+    (void)s;
+    return 0;
+#endif
+}
+
+/* The W5100 socket carrying the traffic of s. */
+static
+struct w5100_socket *sock_hw(struct w5100_socket *s)
+{
+#ifdef W5100_UDP_MUX
+    if (sock_is_vudp(s))
+    {
+        s = &w5100_sockets[udp_mux_isocket];
+    }
+#endif
+    return s;
+}
+
 static
 struct w5100_socket *get_socket_from_fd(int fd)
 {
@@ -140,10 +446,15 @@ struct w5100_socket *get_socket_from_fd(int fd)
     {
         errno = EBADF;
     }
-    else if (!S_ISSOCK(fds->stat.st_mode))
+    else if (!S_ISSOCK(fds->mode))
     {
         errno = ENOTSOCK;
     }
+    else if (fds->close != w5100_sock_close)
+    {
+        /* like the ends of a socketpair */
+        errno = EOPNOTSUPP;
+    }
     else if (fds->opaque == NULL)
     {
         errno = EBADF;
@@ -151,12 +462,13 @@ struct w5100_socket *get_socket_from_fd(int fd)
     else
     {
         s = fds->opaque;
+        sock_update(s);
     }
     return s;
 }
 
 static
-struct fd *fill_fd_struct(int sockfd, int isocket)
+struct fd *fill_fd_struct(int sockfd, struct w5100_socket *s)
 {
     struct fd *fds;
     
@@ -168,939 +480,3394 @@ struct fd *fill_fd_struct(int sockfd, int isocket)
     fds->read = w5100_sock_read;
     fds->close = w5100_sock_close;
     fds->poll = w5100_sock_poll;
-    fds->stat.st_mode = S_IFSOCK|S_IRWXU|S_IRWXG|S_IRWXO;
+    fds->fstat = w5100_sock_fstat;
+    fds->writev = w5100_sock_writev;
+    fds->readv = w5100_sock_readv;
+    fds->mode = S_IFSOCK|S_IRWXU|S_IRWXG|S_IRWXO;
+    /* without the INT pin the events are seen only by polling */
+    fds->notifies = w5100_int_enabled();
     fds->status_flags = O_RDWR;
-    fds->stat.st_blksize = 1024;
-    fds->opaque = &w5100_sockets[isocket];
+    fds->opaque = s;
 
     return fds;
 }
 
 static
-uint16_t get_avail_port(void)
+uint8_t sock_events_update(struct w5100_socket *s)
 {
-    uint16_t avail_port;
-    int port_used;
+    uint8_t events;
 
-    avail_port = htons(0x7FF0);
-    do 
+    events = w5100_sock_events_take(s->isocket);
+    if ((events & W5100_INT_SEND_OK) && (s->tx_flags & W5100_TX_INFLIGHT) && (s->type == SOCK_STREAM))
     {
-        int isocket;
+        sock_rtt_sample(s);
+    }
+    if (events & (W5100_INT_SEND_OK|W5100_INT_TIMEOUT))
+    {
+        s->tx_flags &= ~W5100_TX_INFLIGHT;
+    }
+    if (events & W5100_INT_TIMEOUT)
+    {
+        s->counters.timeouts++;
+        socket_stats.timeouts++;
+    }
+    s->events |= events;
+    sock_tx_service(s);
 
-        port_used = 0;
+    return s->events;
+}
 
-        for (isocket = 0; isocket < W5100_N_SOCKETS; isocket++)
-        {
-            if (get_socket_from_isocket(isocket)->state != W5100_SOCK_STATE_NONE)
-            {
-                uint16_t port;
+/* Forget old events, before the socket is opened again. */
+static
+void sock_events_reset(struct w5100_socket *s)
+{
+    (void)w5100_sock_events_take(s->isocket);
+    s->tx_free = 0;
+    s->tx_held = 0;
+    s->tx_flags &= (W5100_TX_NODELAY|W5100_TX_CORK);
+    /* so that the first check of TX memory reads Sn_TX_FSR */
+    s->events = W5100_INT_SEND_OK;
+}
 
-                w5100_read_sock_regx(W5100_Sn_PORT, isocket, &port);
-                if (port == avail_port)
-                {
-                    port_used = 1;
-                    avail_port--;
-                    break;
-                }
-            }
-        }
-    } while(port_used);
-    
-    return avail_port;
+/* Ephemeral ports are chosen at random in the IANA range, avoiding
+ * the ports of the open sockets (known from sockname, without SPI
+ * access) and the ones of recently closed connections, which the peer
+ * may still keep in TIME_WAIT: the W5100 does not.
+ */
+static
+int port_in_use(uint16_t port)
+{
+    int isocket;
+    int used = 0;
+
+    for (isocket = 0; (isocket < W5100_N_SOCKETS) && !used; isocket++)
+    {
+        const struct w5100_socket *s = &w5100_sockets[isocket];
+
+        used =
+            (s->fd != W5100_SOCKET_FREE)
+            &&
+            (s->sockname.sin_family == AF_INET)
+            &&
+            (s->sockname.sin_port == port);
+    }
+#ifdef W5100_UDP_MUX
+    for (isocket = 0; (isocket < W5100_UDP_MUX_N) && !used; isocket++)
+    {
+        const struct w5100_socket *s = &w5100_udp_vsockets[isocket];
+
+        used =
+            (s->fd != W5100_SOCKET_FREE)
+            &&
+            (s->sockname.sin_family == AF_INET)
+            &&
+            (s->sockname.sin_port == port);
+    }
+#endif
+    return used;
 }
 
 static
-int socket_alloc(void)
+int port_quarantined(uint16_t port, time_t now)
 {
     int i;
-    int ret;
+    int quarantined = 0;
 
-    for (i = 0; i < W5100_N_SOCKETS; i++)
+    for (i = 0; (i < W5100_PORT_QUARANTINE_N) && !quarantined; i++)
+    {
+        quarantined =
+            (port_quarantine[i].port == port)
+            &&
+            (port_quarantine[i].until > now);
+    }
+    return quarantined;
+}
+
+/* The local port of a connection closed by us. */
+static
+void port_release(uint16_t port)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    port_quarantine[port_quarantine_next].port = port;
+    port_quarantine[port_quarantine_next].until = now.tv_sec + W5100_PORT_QUARANTINE_S;
+    port_quarantine_next = (port_quarantine_next + 1) % W5100_PORT_QUARANTINE_N;
+}
+
+static
+uint16_t get_avail_port(void)
+{
+    const unsigned range = W5100_PORT_EPHEMERAL_LAST - W5100_PORT_EPHEMERAL_FIRST + 1;
+    struct timespec now;
+    unsigned start;
+    unsigned i;
+    uint16_t avail_port = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    start = ((unsigned)rand() ^ (unsigned)now.tv_nsec) % range;
+    /* at most a few ports are taken: the loop is short */
+    for (i = 0; i < range; i++)
     {
-        if (w5100_sockets[i].fd == W5100_SOCKET_FREE)
+        avail_port = htons(W5100_PORT_EPHEMERAL_FIRST + ((start + i) % range));
+        if (!port_in_use(avail_port) && !port_quarantined(avail_port, now.tv_sec))
         {
-            w5100_sockets[i].fd = i;
             break;
         }
     }
-    if (i < W5100_N_SOCKETS)
-    {
-        ret = i;
-    }
-    else
+    
+    return avail_port;
+}
+
+static
+void mem_split_decode(struct w5100_mem_split *split, uint8_t msr)
+{
+    int isocket;
+    uint16_t total;
+
+    total = 0;
+    for (isocket = 0; isocket < W5100_N_SOCKETS; isocket++)
     {
-        errno = ENFILE;
-        ret = -1;
+        uint16_t size;
+
+        size = W5100_SOCK_MEM_MIN << ((msr >> (isocket * 2)) & 0x3);
+        if ((total + size > W5100_SOCK_MEM_MAX) || (total == W5100_SOCK_MEM_MAX))
+        {
+            size = 0; /* out of memory, and so are the next ones */
+            total = W5100_SOCK_MEM_MAX;
+        }
+        split->default_size[isocket] = size;
+        split->size[isocket] = size;
+        split->base[isocket] = total;
+        total += size;
     }
-    return ret;
 }
 
 static
-void socket_free(int isocket)
+uint8_t mem_split_encode(const struct w5100_mem_split *split)
 {
-    w5100_sockets[isocket].fd = W5100_SOCKET_FREE;
-    w5100_sockets[isocket].fd_data = NULL;
-    w5100_sockets[isocket].connection_data = NULL;
-    w5100_sockets[isocket].state = W5100_SOCK_STATE_NONE;
+    int isocket;
+    uint8_t msr;
+
+    msr = 0;
+    for (isocket = 0; isocket < W5100_N_SOCKETS; isocket++)
+    {
+        uint8_t code;
+
+        code = 0;
+        while ((W5100_SOCK_MEM_MIN << code) < split->size[isocket])
+        {
+            code++;
+        }
+        msr |= (code << (isocket * 2));
+    }
+
+    return msr;
 }
 
 static
-int w5100_sock_write(int fd, char *buf, int len)
+int mem_socket_is_free(int isocket)
 {
-    return send(fd, buf, len, 0);
+    return (w5100_sockets[isocket].fd == W5100_SOCKET_FREE);
 }
 
+/* The memory of an opened socket can't be moved. */
 static
-int w5100_sock_read(int fd, char *buf, int len)
+int mem_socket_is_active(int isocket)
 {
-    return recv(fd, buf, len, 0);
+    return
+        !mem_socket_is_free(isocket)
+        &&
+        (w5100_sockets[isocket].state != W5100_SOCK_STATE_CREATED);
 }
 
+/* Gives size bytes to isocket (if not -1).
+ * Other allocated sockets keep their size, while free sockets
+ * get back their default size, shrinking the last ones if there is
+ * not enough memory.
+ * Fails if the memory of an active socket should move.
+ */
 static
-int w5100_sock_close(int fd)
+int mem_split_resize(struct w5100_mem_split *split, int isocket, uint16_t size)
 {
+    struct w5100_mem_split new_split;
+    uint16_t total;
+    int i;
     int ret;
-    struct w5100_socket *s;
 
-    s = get_socket_from_fd(fd);
-    if (s == NULL)
+    new_split = *split;
+    total = 0;
+    for (i = 0; i < W5100_N_SOCKETS; i++)
     {
-        ret = -1;
+        if (i == isocket)
+        {
+            new_split.size[i] = size;
+        }
+        else if (mem_socket_is_free(i))
+        {
+            new_split.size[i] = split->default_size[i];
+        }
+        total += new_split.size[i];
     }
-    else
+    while (total > W5100_SOCK_MEM_MAX)
     {
-        int isocket;
-        uint8_t sr;
-        
-        isocket = s->isocket;
+        int ishrink;
 
-        if ((s->fd_data != NULL) && (s->fd_data->fd == fd))
+        /* halve the last free socket that can be halved */
+        ishrink = -1;
+        for (i = W5100_N_SOCKETS - 1; i >= 0; i--)
         {
-            s->fd_data->isopen = 0;
-            file_free(s->fd_data->fd);
-            s->fd_data = NULL;
-            if (s->state != W5100_SOCK_STATE_ACCEPTED)
+            if ((i != isocket) && mem_socket_is_free(i) && (new_split.size[i] > W5100_SOCK_MEM_MIN))
             {
-                if (s->state == W5100_SOCK_STATE_CONNECTED)
-                {
-                    w5100_command(isocket, W5100_CMD_DISCON);
-                }
-                else
-                {
-                    w5100_command(isocket, W5100_CMD_CLOSE);
-                }
-                do {
-                    sr = w5100_read_sock_reg(W5100_Sn_SR, isocket);
-                } while (sr != W5100_SOCK_CLOSED);
-                socket_free(isocket);
+                ishrink = i;
+                break;
             }
-            ret = 0;
         }
-        else if (s->connection_data == NULL)
+        if (ishrink != -1)
         {
-            errno = EBADF;
-            ret = -1;
+            new_split.size[ishrink] /= 2;
+            total -= new_split.size[ishrink];
+            continue;
         }
-        else if (s->connection_data->fd == fd)
+        /* leave out the last socket with memory, if free */
+        for (i = W5100_N_SOCKETS - 1; i >= 0; i--)
         {
-            s->connection_data->isopen = 0;
-            file_free(s->connection_data->fd);
-            s->connection_data = NULL;
-            w5100_command(isocket, W5100_CMD_DISCON);
-            do {
-                sr = w5100_read_sock_reg(W5100_Sn_SR, isocket);
-            } while (sr != W5100_SOCK_CLOSED);
-            if (s->fd_data == NULL)
-            {
-                /* underlying listening socket has been already closed. */
-                socket_free(isocket);
-            }
-            else
+            if (new_split.size[i] != 0)
             {
-                /* re-enter listening state */
-                w5100_command(isocket, W5100_CMD_OPEN);
-                w5100_command(isocket, W5100_CMD_LISTEN);
-                do {
-                    sr = w5100_read_sock_reg(W5100_Sn_SR, s->isocket);
-                } while ((sr != W5100_SOCK_LISTEN) && (sr != W5100_SOCK_ESTABLISHED));
-                s->state = W5100_SOCK_STATE_LISTENING;
+                break;
             }
-            ret = 0;
+        }
+        if ((i >= 0) && (i != isocket) && mem_socket_is_free(i))
+        {
+            total -= new_split.size[i];
+            new_split.size[i] = 0;
         }
         else
         {
-            errno = EBADF;
-            ret = -1;
+            break;
         }
     }
-    return ret;
-}
-
-static
-int socket_create(int type)
-{
-    int isocket;
-    int fd = -1;
 
-    isocket = socket_alloc();
-    if (isocket != -1)
+    ret = (total > W5100_SOCK_MEM_MAX)?-1:0;
+    total = 0;
+    for (i = 0; (i < W5100_N_SOCKETS) && (ret == 0); i++)
     {
-        fd = file_alloc();
-        if (fd == -1)
-        {
-            socket_free(isocket);
-            isocket = -1;
-            errno = ENFILE;
-        }
-        else
+        new_split.base[i] = total;
+        total += new_split.size[i];
+        if (
+                (i != isocket)
+                &&
+                mem_socket_is_active(i)
+                &&
+                (
+                    (new_split.base[i] != split->base[i])
+                    ||
+                    (new_split.size[i] != split->size[i])
+                )
+           )
         {
-            struct fd *fds;
-            struct w5100_socket *s;
-            uint8_t sock_mode;
-            
-            fds = fill_fd_struct(fd, isocket);
-            s = get_socket_from_isocket(isocket);
-
-            s->fd = fd;
-            s->isocket = isocket;
-            s->domain = AF_INET;
-            s->type = type;
-            s->protocol = 0;
-            s->state = W5100_SOCK_STATE_CREATED;
-            s->dest_address.sin_family = AF_UNSPEC;
-            s->sockname.sin_family = AF_UNSPEC;
-            s->fd_data = fds;
-            s->connection_data = NULL;
-            s->recv_timeout = TIMESPEC_ZERO;
-            s->send_timeout = TIMESPEC_ZERO;
-            s->can_broadcast = 0;
-            
-            switch(type)
-            {
-                case SOCK_STREAM:
-                    sock_mode = W5100_SOCK_MODE_TCP;
-                    break;
-                case SOCK_DGRAM:
-                    sock_mode = W5100_SOCK_MODE_UDP;
-                    break;
-                case SOCK_RAW:
-                    sock_mode = W5100_SOCK_MODE_IPRAW;
-                    break;
-                default:
-                    /* should never arrive here. */
-                    sock_mode = W5100_SOCK_MODE_TCP;
-                    break;
-            }
-            w5100_write_sock_reg(W5100_Sn_MR, isocket, sock_mode);
+            ret = -1;
         }
     }
-    else
+    if (ret == 0)
     {
-        errno = ENOMEM;
+        *split = new_split;
     }
-    return fd;
+
+    return ret;
 }
 
-int socket(int domain, int type, int protocol)
+static
+void mem_split_apply(void)
 {
+    w5100_write_reg(W5100_RMSR, mem_split_encode(&w5100_rx_split));
+    w5100_write_reg(W5100_TMSR, mem_split_encode(&w5100_tx_split));
+}
+
+static
+int socket_alloc(void)
+{
+    int i;
     int ret;
 
-    if (domain != AF_INET)
+    sockets_service();
+
+    /* give back memory taken by closed sockets */
+    if (
+            (mem_split_resize(&w5100_rx_split, -1, 0) == 0)
+            &&
+            (mem_split_resize(&w5100_tx_split, -1, 0) == 0)
+       )
     {
-        errno = EAFNOSUPPORT;
-        ret = -1;
+        mem_split_apply();
     }
-    else if ((type != SOCK_STREAM) && (type != SOCK_DGRAM) && (type != SOCK_RAW))
+
+    for (i = 0; i < W5100_N_SOCKETS; i++)
     {
-        errno = EPROTOTYPE;
-        ret = -1;
+        if (
+                (w5100_sockets[i].fd == W5100_SOCKET_FREE)
+                &&
+                (w5100_rx_split.size[i] != 0)
+                &&
+                (w5100_tx_split.size[i] != 0)
+           )
+        {
+            w5100_sockets[i].fd = i;
+            break;
+        }
     }
-    else if (protocol != 0)
+    if (i < W5100_N_SOCKETS)
     {
-        errno = EPROTONOSUPPORT;
-        ret = -1;
+        ret = i;
     }
     else
     {
-        int fd;
-        
-        fd = socket_create(type);
-        ret = fd;
+        errno = ENFILE;
+        ret = -1;
     }
     return ret;
 }
 
 static
-void w5100_command(int isocket, uint8_t cmd)
+void socket_free(int isocket)
 {
-    w5100_write_sock_reg(W5100_Sn_CR, isocket, cmd);
-    while (w5100_read_sock_reg(W5100_Sn_CR, isocket))
-    {
-        continue;
-    }
+    w5100_sockets[isocket].fd = W5100_SOCKET_FREE;
+    w5100_sockets[isocket].fd_data = NULL;
+    w5100_sockets[isocket].connection_data = NULL;
+    w5100_sockets[isocket].state = W5100_SOCK_STATE_NONE;
+    w5100_sockets[isocket].listener = NULL;
+    w5100_sockets[isocket].backlog = 0;
 }
 
 static
-void bind_udp(struct w5100_socket *s, uint16_t port)
+int w5100_sock_write(int fd, char *buf, int len)
 {
-    uint8_t sr;
+    return send(fd, buf, len, 0);
+}
 
-    w5100_write_sock_regx(W5100_Sn_PORT, s->isocket, &port);
-    w5100_command(s->isocket, W5100_CMD_OPEN);
-    do {
-        sr = w5100_read_sock_reg(W5100_Sn_SR, s->isocket);
-    } while (sr != W5100_SOCK_UDP);
-    s->sockname.sin_family = AF_INET;
-    s->sockname.sin_addr.s_addr = INADDR_ANY; /* TODO: local IP */
-    s->sockname.sin_port = port;
-    s->state = W5100_SOCK_STATE_BOUND;
+static
+int w5100_sock_read(int fd, char *buf, int len)
+{
+    return recv(fd, buf, len, 0);
 }
 
 static
-void check_bind_udp(struct w5100_socket *s)
+ssize_t w5100_sock_writev(int fd, const struct iovec *iov, int iovcnt)
 {
-    if (s->state == W5100_SOCK_STATE_CREATED)
-    {
-        uint16_t port;
+    struct msghdr msg;
 
-        port = get_avail_port();
-        bind_udp(s, port);
-    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+
+    return sendmsg(fd, &msg, 0);
 }
 
 static
-int connect_tcp(struct w5100_socket *s, const struct sockaddr *addr, socklen_t addrlen)
+ssize_t w5100_sock_readv(int fd, const struct iovec *iov, int iovcnt)
 {
-    int ret;
-    
-    if ( addr->sa_family != AF_INET )
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+
+    return recvmsg(fd, &msg, 0);
+}
+
+/* Starts the teardown of the connection, the socket will be CLOSING
+ * until the W5100 says CLOSED.
+ */
+static
+void sock_close_start(struct w5100_socket *s, int relisten)
+{
+    static const struct timespec close_max = {
+        .tv_sec = W5100_CLOSE_TIMEOUT_MS / MSECS_IN_SEC,
+        .tv_nsec = (W5100_CLOSE_TIMEOUT_MS % MSECS_IN_SEC) * (NSECS_IN_SEC / MSECS_IN_SEC),
+    };
+    uint8_t sr;
+
+    if ((s->type == SOCK_STREAM) && (s->state == W5100_SOCK_STATE_CONNECTED))
     {
-        errno = EAFNOSUPPORT;
-        ret = -1;
+        port_release(s->sockname.sin_port);
     }
-    else if (
-            (s->state == W5100_SOCK_STATE_CONNECTED)
-            ||
-            (s->state == W5100_SOCK_STATE_ACCEPTED)
-            )
+    sr = w5100_read_sock_reg(W5100_Sn_SR, s->isocket);
+    if (s->linger.l_onoff && (s->linger.l_linger == 0))
     {
-        errno = EISCONN;
-        ret = -1;
+        /* abortive close */
+        w5100_command(s->isocket, W5100_CMD_CLOSE);
     }
-    else if (s->state == W5100_SOCK_STATE_LISTENING)
+    else if ((sr == W5100_SOCK_ESTABLISHED) || (sr == W5100_SOCK_CLOSE_WAIT))
     {
-        errno = EOPNOTSUPP;
-        ret = -1;
+        sock_tx_flush(s);
+        sock_retry_apply(s, s->retry.rcr);
+        w5100_command(s->isocket, W5100_CMD_DISCON);
     }
-    else if (s->state != W5100_SOCK_STATE_CREATED)
+    else if (sr != W5100_SOCK_CLOSED)
     {
-        errno = EOPNOTSUPP;
-        ret = -1;
+        w5100_command(s->isocket, W5100_CMD_CLOSE);
     }
-    else
+    s->relisten = relisten;
+    s->state = W5100_SOCK_STATE_CLOSING;
+    clock_gettime(CLOCK_MONOTONIC, &s->close_time);
+    timespec_incr(&s->close_time, &close_max);
+    wait_deadline_hint(&s->close_time);
+}
+
+/* What happens to the socket once closed. */
+static
+void sock_close_finish(struct w5100_socket *s)
+{
+    if (s->relisten && (s->connection_data == NULL) && pool_wants_relisten(s))
     {
-        struct sockaddr_in *server;
         uint8_t sr;
-        int isocket;
-
-        (void)addrlen;
 
-        isocket = s->isocket;
-        server = (struct sockaddr_in *)addr;
-        /* TODO: check if already in use EADDRINUSE */
-        w5100_write_sock_regx(W5100_Sn_PORT, isocket, &server->sin_port);
-        w5100_command(isocket, W5100_CMD_OPEN);
+        sock_events_reset(s);
+        w5100_command(s->isocket, W5100_CMD_OPEN);
+        w5100_command(s->isocket, W5100_CMD_LISTEN);
         do {
-            sr = w5100_read_sock_reg(W5100_Sn_SR, isocket);
-        } while (sr != W5100_SOCK_INIT);
+            sr = w5100_read_sock_reg(W5100_Sn_SR, s->isocket);
+        } while ((sr != W5100_SOCK_LISTEN) && (sr != W5100_SOCK_ESTABLISHED));
+        s->state = W5100_SOCK_STATE_LISTENING;
+    }
+    else if ((s->fd_data == NULL) && (s->connection_data == NULL))
+    {
+        socket_free(s->isocket);
+    }
+    else
+    {
+        s->state = W5100_SOCK_STATE_DISCONNECTED;
+    }
+    s->relisten = 0;
+}
 
-        w5100_write_sock_regx(W5100_Sn_DIPR, isocket, &server->sin_addr.s_addr);
-        w5100_write_sock_regx(W5100_Sn_DPORT, isocket, &server->sin_port);
-        w5100_command(isocket, W5100_CMD_CONNECT);
-        do {
-            sr = w5100_read_sock_reg(W5100_Sn_SR, isocket);
-        } while ((sr != W5100_SOCK_CLOSED) && (sr != W5100_SOCK_ESTABLISHED));
-        if (sr == W5100_SOCK_ESTABLISHED)
-        {
-            s->state = W5100_SOCK_STATE_CONNECTED;
-            s->dest_address = *server;
-            ret = 0;
-        }
-        else if (sr == W5100_SOCK_CLOSED)
+static
+void sock_close_check(struct w5100_socket *s)
+{
+    if (s->state == W5100_SOCK_STATE_CLOSING)
+    {
+        uint8_t sr;
+
+        sr = w5100_read_sock_reg(W5100_Sn_SR, s->isocket);
+        if (sr != W5100_SOCK_CLOSED)
         {
-            errno = ECONNREFUSED;
-            ret = -1;
+            struct timespec now;
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (timespec_diff(&s->close_time, &now, NULL) < 0)
+            {
+                w5100_command(s->isocket, W5100_CMD_CLOSE);
+                do {
+                    sr = w5100_read_sock_reg(W5100_Sn_SR, s->isocket);
+                } while (sr != W5100_SOCK_CLOSED);
+            }
         }
-        else
+        if (sr == W5100_SOCK_CLOSED)
         {
-            errno = ECONNREFUSED; /* TODO: better error? */
-            ret = -1;
+            sock_close_finish(s);
         }
     }
-    return ret;
 }
 
+/* Advances the teardown of all closing sockets, also those without a
+ * file descriptor anymore.
+ */
 static
-int connect_udp(struct w5100_socket *s, const struct sockaddr *addr, socklen_t addrlen)
+void sockets_service(void)
 {
-    int ret;
-    
-    (void)addrlen;
+    int i;
 
-    if (addr->sa_family == AF_UNSPEC)
-    {
-        s->dest_address.sin_family = AF_UNSPEC; /* reset pre-specified address */
-        check_bind_udp(s);
-        ret = 0;
-    }
-    else if (addr->sa_family == AF_INET)
-    {
-        const struct sockaddr_in *dest_address;
-        
-        dest_address = (struct sockaddr_in *)addr;
-        s->dest_address = *dest_address;
-        check_bind_udp(s);
-        ret = 0;
-    }
-    else
+    for (i = 0; i < W5100_N_SOCKETS; i++)
     {
-        errno = EAFNOSUPPORT;
-        ret = -1;
+        if (
+                (w5100_sockets[i].fd != W5100_SOCKET_FREE)
+                &&
+                (w5100_sockets[i].state == W5100_SOCK_STATE_CLOSING)
+           )
+        {
+            sock_close_check(&w5100_sockets[i]);
+        }
     }
+    sockets_keepalive_service();
+}
 
-    return ret;
+/* Seconds of CLOCK_MONOTONIC, for the keep-alive. */
+static
+uint32_t keepalive_now(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec;
 }
 
-int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
+static
+void sock_keepalive_restart(struct w5100_socket *s)
 {
-    int ret;
-    struct w5100_socket *s;
+    s->keepalive.probes = 0;
+    s->keepalive.traffic = s->counters.bytes_sent + s->counters.bytes_received;
+    s->keepalive.last = keepalive_now();
+}
 
-    s = get_socket_from_fd(sockfd);
-    if (s == NULL)
+static
+void sock_keepalive_check(struct w5100_socket *s, uint32_t now)
+{
+    struct w5100_keepalive *k = &s->keepalive;
+    uint32_t traffic;
+
+    traffic = s->counters.bytes_sent + s->counters.bytes_received;
+    if (traffic != k->traffic)
     {
-        ret = -1;
+        k->traffic = traffic;
+        k->probes = 0;
+        k->last = now;
     }
-    else if (s->type == SOCK_STREAM)
+    else if (
+            (k->probes > 0)
+            &&
+            (sock_events_update(s) & (W5100_INT_DISCON|W5100_INT_TIMEOUT))
+            &&
+            (w5100_read_sock_reg(W5100_Sn_SR, s->isocket) != W5100_SOCK_ESTABLISHED)
+            )
     {
-        ret = connect_tcp(s, addr, addrlen);
+        /* The peer is gone: the hardware socket is closed now, and an
+         * accepted one listens again once its descriptor is closed.
+         */
+        s->error = ETIMEDOUT;
+        sock_close_start(s, (s->state == W5100_SOCK_STATE_ACCEPTED));
+        sock_close_check(s);
     }
-    else if (s->type == SOCK_DGRAM)
+    else if ((now - k->last) >= ((k->probes == 0) ? k->idle : k->intvl))
     {
-        ret = connect_udp(s, addr, addrlen);
+        sock_retry_apply(s, s->retry.rcr);
+        w5100_command(s->isocket, W5100_CMD_SEND_KEEP);
+        if (k->probes < UINT8_MAX)
+        {
+            k->probes++;
+        }
+        k->last = now;
     }
-    else /* TODO: RAW */
-    {
-        errno = EAFNOSUPPORT;
-        ret = -1;
-    }
-    return ret;
 }
 
-int bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
+/* Whether a socket has a connection to probe. */
+static
+int sock_keepalive_active(const struct w5100_socket *s)
 {
-    int ret;
-    struct w5100_socket *s;
+    return
+        (s->fd != W5100_SOCKET_FREE)
+        &&
+        (s->type == SOCK_STREAM)
+        &&
+        s->keepalive.enabled
+        &&
+        (
+            (s->state == W5100_SOCK_STATE_CONNECTED)
+            ||
+            (s->state == W5100_SOCK_STATE_ACCEPTED)
+        );
+}
 
-    s = get_socket_from_fd(sockfd);
-    if (s == NULL)
-    {
-        ret = -1;
-    }
-    else if ( addr->sa_family != AF_INET )
-    {
-        errno = EAFNOSUPPORT;
-        ret = -1;
-    }
-    else if (s->state != W5100_SOCK_STATE_CREATED)
-    {
-        errno = EINVAL;
-        ret = 1;
-    }
-    else if (s->type == SOCK_STREAM)
+/* Probes the idle connections with SO_KEEPALIVE, once a second at
+ * most; nothing to do until SO_KEEPALIVE is set the first time.
+ * The waits are woken in time for the next probe of each socket.
+ */
+static
+void sockets_keepalive_service(void)
+{
+    if (keepalive_used)
     {
-        struct sockaddr_in *server;
-        uint8_t sr;
-        uint8_t sr_end;
+        uint32_t now;
 
-        (void)addrlen;
-        
-        server = (struct sockaddr_in *)addr;
-        /* TODO: check if already in use EADDRINUSE */
-        w5100_write_sock_regx(W5100_Sn_PORT, s->isocket, &server->sin_port);
-        w5100_command(s->isocket, W5100_CMD_OPEN);
-        sr_end = W5100_SOCK_INIT;
-        do {
-            sr = w5100_read_sock_reg(W5100_Sn_SR, s->isocket);
-        } while (sr != sr_end);
-        s->sockname = *server;
-        s->state = W5100_SOCK_STATE_BOUND;
-        ret = 0;
+        now = keepalive_now();
+        if (now != keepalive_checked)
+        {
+            int i;
+
+            keepalive_checked = now;
+            for (i = 0; i < W5100_N_SOCKETS; i++)
+            {
+                struct w5100_socket *s = &w5100_sockets[i];
+
+                if (sock_keepalive_active(s))
+                {
+                    sock_keepalive_check(s, now);
+                }
+                if (sock_keepalive_active(s))
+                {
+                    struct timespec next;
+
+                    next.tv_sec = s->keepalive.last;
+                    next.tv_sec += (s->keepalive.probes == 0) ? s->keepalive.idle : s->keepalive.intvl;
+                    next.tv_nsec = 0;
+                    wait_deadline_hint(&next);
+                }
+            }
+        }
     }
-    else if (s->type == SOCK_DGRAM)
+}
+
+/* With SO_LINGER, waits for the end of the teardown. */
+static
+void sock_close_linger(struct w5100_socket *s)
+{
+    if (s->linger.l_onoff && (s->linger.l_linger > 0))
     {
-        struct sockaddr_in *server;
-        (void)addrlen;
+        struct timespec linger_time;
+        struct timeout_manager tom;
 
-        server = (struct sockaddr_in *)addr;
-        bind_udp(s, server->sin_port);
-        ret = 0;
+        linger_time.tv_sec = s->linger.l_linger;
+        linger_time.tv_nsec = 0;
+        timeout_init(&linger_time, &tom);
+        while ((s->state == W5100_SOCK_STATE_CLOSING) && !timeout_wait(&tom))
+        {
+            sock_close_check(s);
+        }
     }
     else
     {
-        /* TODO: RAW */
-        errno = EBADF;
-        ret = -1;
+        sock_close_check(s);
     }
-    return ret;
 }
 
-int listen(int sockfd, int backlog)
+static
+int w5100_sock_close(int fd)
 {
     int ret;
     struct w5100_socket *s;
 
-    s = get_socket_from_fd(sockfd);
+    s = get_socket_from_fd(fd);
     if (s == NULL)
     {
         ret = -1;
     }
-    else if (s->state != W5100_SOCK_STATE_BOUND)
+#ifdef W5100_UDP_MUX
+    else if (sock_is_vudp(s))
     {
-        errno = EDESTADDRREQ;
-        ret = 1;
+        ret = udp_mux_close(s);
     }
-    else if (s->type != SOCK_STREAM) /* UPD and RAW */
+#endif
+    else if ((s->fd_data != NULL) && (s->fd_data->fd == fd))
     {
-        errno = EOPNOTSUPP;
+        s->fd_data->isopen = 0;
+        file_free(s->fd_data->fd);
+        s->fd_data = NULL;
+        if (s->listener == s)
+        {
+            pool_release(s);
+        }
+        if (
+                (s->state != W5100_SOCK_STATE_ACCEPTED)
+                &&
+                (s->state != W5100_SOCK_STATE_CLOSING)
+           )
+        {
+            sock_close_start(s, 0);
+        }
+        sock_close_linger(s);
+        ret = 0;
+    }
+    else if (s->connection_data == NULL)
+    {
+        errno = EBADF;
         ret = -1;
     }
-    else /* TCP */
+    else if (s->connection_data->fd == fd)
     {
-        uint8_t sr;
-        /* TODO: check if already in use EADDRINUSE */
-        (void)backlog; /* ignoring the hint because we can't do anything about it. */
-        w5100_command(s->isocket, W5100_CMD_LISTEN);
-        do {
-            sr = w5100_read_sock_reg(W5100_Sn_SR, s->isocket);
-        } while ((sr != W5100_SOCK_LISTEN) && (sr != W5100_SOCK_ESTABLISHED));
-        s->state = W5100_SOCK_STATE_LISTENING;
+        s->connection_data->isopen = 0;
+        file_free(s->connection_data->fd);
+        s->connection_data = NULL;
+        if (s->state == W5100_SOCK_STATE_ACCEPTED)
+        {
+            /* listen again, if the listening socket is still open */
+            sock_close_start(s, 1);
+        }
+        else if (s->state == W5100_SOCK_STATE_DISCONNECTED)
+        {
+            sock_close_start(s, 1);
+        }
+        sock_close_linger(s);
         ret = 0;
     }
+    else
+    {
+        errno = EBADF;
+        ret = -1;
+    }
     return ret;
 }
 
-int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
+void w5100_socket_service(void)
 {
-    int ret;
-    struct w5100_socket *s;
+    sockets_service();
+}
 
-    s = get_socket_from_fd(sockfd);
-    if (s == NULL)
-    {
-        ret = -1;
-    }
-    else if (s->state != W5100_SOCK_STATE_LISTENING)
+static
+void sock_notify(const struct w5100_socket *s)
+{
+    if (s->fd_data != NULL)
     {
-        errno = EINVAL;
-        ret = 1;
+        file_notify(s->fd_data->fd);
     }
-    else if (s->type != SOCK_STREAM) /* UDP or RAW */
+    if (s->connection_data != NULL)
     {
-        errno = EOPNOTSUPP;
-        ret = -1;
+        file_notify(s->connection_data->fd);
     }
-    else /* TCP */
-    {
-        uint8_t sr;
-        int newsockfd;
-        int nonblock;
+}
 
-        nonblock = s->fd_data->status_flags & O_NONBLOCK;
+/* Events of a socket change what poll says for its descriptors, for
+ * the listening descriptor of its pool, and for the virtual sockets
+ * it carries.
+ */
+void w5100_sock_events_notify(int isocket)
+{
+    const struct w5100_socket *s;
 
-        do
+    s = get_socket_from_isocket(isocket);
+    if ((s != NULL) && (s->fd != W5100_SOCKET_FREE))
+    {
+        sock_notify(s);
+        if ((s->listener != NULL) && (s->listener != s))
         {
-            sr = w5100_read_sock_reg(W5100_Sn_SR, s->isocket);
-            if (sr == W5100_SOCK_ESTABLISHED)
+            sock_notify(s->listener);
+        }
+#ifdef W5100_UDP_MUX
+        if (isocket == udp_mux_isocket)
+        {
+            int i;
+
+            for (i = 0; i < W5100_UDP_MUX_N; i++)
             {
-                newsockfd = file_alloc();
-                if (newsockfd == -1)
-                {
-                    errno = ENFILE;
-                    /* go again into listen state */
-                    w5100_command(s->isocket, W5100_CMD_CLOSE);
-                    w5100_command(s->isocket, W5100_CMD_OPEN);
-                    w5100_command(s->isocket, W5100_CMD_LISTEN);
-                }
-                else
+                if (w5100_udp_vsockets[i].fd != W5100_SOCKET_FREE)
                 {
-                    struct sockaddr_in *client;
-
-                    s->state = W5100_SOCK_STATE_ACCEPTED;
-                    s->connection_data = fill_fd_struct(newsockfd, s->isocket);
-                    
-                    if (addr != NULL)
-                    {
-                        if (addrlen != NULL)
-                        {
-                            *addrlen = sizeof(struct sockaddr_in);
-                        }
-                        client = (struct sockaddr_in *)addr;
-                        addr->sa_family = AF_INET;
-                        
-                        w5100_read_sock_regx(W5100_Sn_DIPR, s->isocket, &client->sin_addr.s_addr);
-                        w5100_read_sock_regx(W5100_Sn_DPORT, s->isocket, &client->sin_port);
-                    }
+                    sock_notify(&w5100_udp_vsockets[i]);
                 }
-                ret = newsockfd;
-                break;
-            }
-            else if (nonblock)
-            {
-                errno = EAGAIN;
-                ret = -1;
-                break;
             }
-        } while(1);
+        }
+#endif
     }
-    return ret;
 }
 
 static
-void timeout_init(const struct timespec *timeout, struct timeout_manager *tom)
+void sock_counters_reset(struct w5100_socket *s)
 {
-    tom->has_timeout = (timespec_diff(&TIMESPEC_ZERO, timeout, NULL) != 0);
+    memset(&s->counters, 0, sizeof(s->counters));
+    s->counters.spi_frames_start = w5100_spi_sock_frames(sock_hw(s)->isocket);
+}
 
-    if (tom->has_timeout)
+/* Settings of a new socket; isocket must be set. */
+static
+void sock_fields_init(struct w5100_socket *s, int type)
+{
+    s->domain = AF_INET;
+    s->type = type;
+    s->protocol = 0;
+    s->state = W5100_SOCK_STATE_CREATED;
+    s->dest_address.sin_family = AF_UNSPEC;
+    s->sockname.sin_family = AF_UNSPEC;
+    s->connection_data = NULL;
+    s->recv_timeout = TIMESPEC_ZERO;
+    s->send_timeout = TIMESPEC_ZERO;
+    s->can_broadcast = 0;
+    s->error = 0;
+    s->linger.l_onoff = 0;
+    s->linger.l_linger = 0;
+    s->relisten = 0;
+    s->listener = NULL;
+    s->backlog = 0;
+    s->tx_flags = W5100_TX_FLAGS_INIT;
+    s->keepalive.enabled = 0;
+    s->keepalive.cnt = W5100_KEEPCNT;
+    s->keepalive.idle = W5100_KEEPIDLE_S;
+    s->keepalive.intvl = W5100_KEEPINTVL_S;
+    memset(&s->retry, 0, sizeof(s->retry));
+    s->retry.rtr = W5100_RTR_INIT;
+    s->retry.rcr = W5100_RCR_INIT;
+    sock_counters_reset(s);
+}
+
+/* Time until TIMEOUT, in 100us units, as in the W5100 datasheet:
+ * the time doubles at each retransmission, up to 0xFFFF.
+ * Also the retries that fit in limit.
+ */
+static
+uint32_t retry_total(uint32_t rtr, uint32_t limit, uint8_t *rcr)
+{
+    uint32_t total;
+    uint32_t t;
+    uint8_t n;
+
+    total = rtr;
+    t = rtr;
+    n = 0;
+    while (n < UINT8_MAX)
     {
-        clock_gettime(CLOCK_MONOTONIC, &tom->end);
-        timespec_incr(&tom->end, timeout);
+        t *= 2;
+        if (t > UINT16_MAX)
+        {
+            t = UINT16_MAX;
+        }
+        if (total + t > limit)
+        {
+            break;
+        }
+        total += t;
+        n++;
     }
+    *rcr = n;
+
+    return total;
 }
 
+/* Sets rtr and rcr from the options and the RTT estimate. */
 static
-int timeout_ended(const struct timeout_manager *tom)
+void sock_retry_update(struct w5100_socket *s)
 {
-    int ret;
-    struct timespec cur;
+    struct w5100_retry *r = &s->retry;
+    uint32_t rtr;
 
-    if (tom->has_timeout)
+    if (r->adaptive && (r->srtt != 0))
     {
-        clock_gettime(CLOCK_MONOTONIC, &cur);
-        ret = (timespec_diff(&tom->end, &cur, NULL) < 0);
-        if (ret)
+        uint32_t rto;
+
+        rto = r->srtt + ((4 * r->rttvar > 100) ? 4 * r->rttvar : 100);
+        if (rto < W5100_RTO_MIN_US)
         {
-            errno = EAGAIN;
+            rto = W5100_RTO_MIN_US;
+        }
+        else if (rto > W5100_RTO_MAX_US)
+        {
+            rto = W5100_RTO_MAX_US;
         }
+        rtr = rto / 100;
     }
     else
     {
-        ret = 0;
+        rtr = W5100_RTR_INIT;
     }
+    if (r->user_timeout == 0)
+    {
+        r->rcr = W5100_RCR_INIT;
+    }
+    else
+    {
+        uint32_t limit;
 
-    return ret;
-}
-
-static
-uint16_t get_tx_size(int isocket)
-{
-    (void)isocket;
-    return 0x800; /* 2KiB */
+        limit = (r->user_timeout > (UINT32_MAX / 10)) ? UINT32_MAX : (r->user_timeout * 10);
+        if (rtr > limit)
+        {
+            /* a single try, shorter */
+            rtr = (limit > 0) ? limit : 1;
+        }
+        /* as many retries as fit */
+        (void)retry_total(rtr, limit, &r->rcr);
+    }
+    r->rtr = rtr;
 }
 
 static
-uint16_t get_tx_mask(int isocket)
+void sock_rtt_sample(struct w5100_socket *s)
 {
-    return get_tx_size(isocket) - 1; /* size is always power of 2 */
-}
+    struct w5100_retry *r = &s->retry;
+    struct timespec now;
+    struct timespec elapsed;
+    uint32_t rtt;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timespec_diff(&now, &r->sent, &elapsed);
+    if (elapsed.tv_sec >= (time_t)(W5100_RTO_MAX_US / 1000000))
+    {
+        rtt = W5100_RTO_MAX_US;
+    }
+    else
+    {
+        rtt = (elapsed.tv_sec * 1000000) + (elapsed.tv_nsec / 1000);
+    }
+    if (r->srtt == 0)
+    {
+        r->srtt = rtt;
+        r->rttvar = rtt / 2;
+    }
+    else
+    {
+        uint32_t delta;
 
-static
-uint16_t get_tx_base(int isocket)
-{
-    return W5100_TX_MEM_BASE + get_tx_size(isocket) * isocket;
+        delta = (r->srtt > rtt) ? (r->srtt - rtt) : (rtt - r->srtt);
+        r->rttvar = ((3 * r->rttvar) + delta) / 4;
+        r->srtt = ((7 * r->srtt) + rtt) / 8;
+    }
+    if (r->srtt == 0)
+    {
+        /* measured, even if below 1us */
+        r->srtt = 1;
+    }
+    sock_retry_update(s);
 }
 
 static
-uint16_t get_rx_size(int isocket)
+void sock_retry_apply(const struct w5100_socket *s, uint8_t rcr)
 {
-    (void)isocket;
-    return 0x800; /* 2KiB */
-}
+    uint16_t rtr;
 
-static
-uint16_t get_rx_mask(int isocket)
-{
-    return get_rx_size(isocket) - 1; /* size is always power of 2 */
+    rtr = htons(s->retry.rtr);
+    w5100_write_regx(W5100_RTR, &rtr);
+    w5100_write_reg(W5100_RCR, rcr);
 }
 
 static
-uint16_t get_rx_base(int isocket)
+int socket_create(int type)
 {
-    return W5100_RX_MEM_BASE + get_rx_size(isocket) * isocket;
-}
+    int isocket;
+    int fd = -1;
 
-static
-int manage_disconnect(struct w5100_socket *s)
-{
-    int ret;
-    uint8_t sr;
-    
-    sr = w5100_read_sock_reg(W5100_Sn_SR, s->isocket);
-    if (sr != W5100_SOCK_ESTABLISHED)
+    isocket = socket_alloc();
+    if (isocket != -1)
     {
-        if (sr == W5100_SOCK_CLOSE_WAIT)
-        {
-            errno = ECONNRESET;
-        }
-        else
-        {
-            errno = ETIMEDOUT;
-        }
-        w5100_command(s->isocket, W5100_CMD_DISCON);
-        do
-        {
-            sr = w5100_read_sock_reg(W5100_Sn_SR, s->isocket);
-        } while(sr != W5100_SOCK_CLOSED);
-        if (
-                (s->state == W5100_SOCK_STATE_ACCEPTED)
-                &&
-                (s->fd_data != NULL)
-           )
+        fd = file_alloc();
+        if (fd == -1)
         {
-            /* re-enter listening state */
-            w5100_command(s->isocket, W5100_CMD_OPEN);
-            w5100_command(s->isocket, W5100_CMD_LISTEN);
-            do {
-                sr = w5100_read_sock_reg(W5100_Sn_SR, s->isocket);
-            } while ((sr != W5100_SOCK_LISTEN) && (sr != W5100_SOCK_ESTABLISHED));
-            s->state = W5100_SOCK_STATE_LISTENING;
+            socket_free(isocket);
+            isocket = -1;
+            errno = ENFILE;
         }
         else
         {
-            s->state = W5100_SOCK_STATE_DISCONNECTED;
+            struct w5100_socket *s;
+            uint8_t sock_mode;
+            
+            s = get_socket_from_isocket(isocket);
+            s->isocket = isocket;
+            sock_fields_init(s, type);
+            s->fd = fd;
+            s->fd_data = fill_fd_struct(fd, s);
+            
+            switch(type)
+            {
+                case SOCK_STREAM:
+                    sock_mode = W5100_SOCK_MODE_TCP;
+                    break;
+                case SOCK_DGRAM:
+                    sock_mode = W5100_SOCK_MODE_UDP;
+                    break;
+                case SOCK_RAW:
+                    sock_mode = W5100_SOCK_MODE_IPRAW;
+                    break;
+                default:
+                    /* should never arrive here. */
+                    sock_mode = W5100_SOCK_MODE_TCP;
+                    break;
+            }
+            w5100_write_sock_reg(W5100_Sn_MR, isocket, sock_mode);
+            sock_events_reset(s);
         }
-        ret = -1;
     }
     else
     {
-        ret = 0;
+        errno = ENOMEM;
     }
-    return ret;
-}
-
-ssize_t recv(int sockfd, void *buf, size_t len, int flags)
-{
-    return recvfrom(sockfd, buf, len, flags, NULL, NULL);
-}
-
-static
-uint16_t read_buf_len(int isocket)
-{
-    uint16_t toread;
-
-    w5100_read_sock_regx(W5100_Sn_RX_RSR, isocket, &toread);
-    toread = ntohs(toread);
-
-    return toread;
+    return fd;
 }
 
-static
-void read_buf_sure(int isocket, void *buf, size_t len, uint16_t *pread)
+int socket(int domain, int type, int protocol)
 {
-    uint16_t offset;
-    uint16_t phys;
-    uint16_t toread1;
-    uint16_t toread2;
-    uint8_t *bytes = buf;
+    int ret;
 
-    offset = *pread & get_rx_mask(isocket);
-    phys = get_rx_base(isocket) + offset;
-    if (offset + len > get_rx_size(isocket))
+    if (domain != AF_INET)
     {
-        toread1 = get_rx_size(isocket) - offset;
-        toread2 = len - toread1;
+        errno = EAFNOSUPPORT;
+        ret = -1;
     }
-    else
+    else if ((type != SOCK_STREAM) && (type != SOCK_DGRAM) && (type != SOCK_RAW))
     {
-        toread1 = len;
-        toread2 = 0;
+        errno = EPROTOTYPE;
+        ret = -1;
     }
-    if (toread1 > 0)
+    else if (protocol != 0)
     {
-        w5100_read_mem(phys, &bytes[0], toread1);
+        errno = EPROTONOSUPPORT;
+        ret = -1;
     }
-    if (toread2 > 0)
+    else
     {
-        w5100_read_mem(get_rx_base(isocket), &bytes[toread1], toread2);
+        int fd;
+        
+#ifdef W5100_UDP_MUX
+        if (type == SOCK_DGRAM)
+        {
+            fd = udp_mux_socket_create();
+        }
+        else
+#endif
+        {
+            fd = socket_create(type);
+        }
+        ret = fd;
     }
-    *pread = *pread + len;
-}
-
-static
-uint16_t read_buf_pstart(int isocket)
-{
-    uint16_t pread;
-
-    w5100_read_sock_regx(W5100_Sn_RX_RD, isocket, &pread);
-    pread = ntohs(pread);
-
-    return pread;
-}
-
-static
-void read_buf_recv(int isocket, uint16_t pstop)
-{
-    pstop = htons(pstop);
-    w5100_write_sock_regx(W5100_Sn_RX_RD, isocket, &pstop);
-    w5100_command(isocket, W5100_CMD_RECV);
+    return ret;
 }
 
 static
-uint16_t read_buf(int isocket, void *buf, size_t len)
+void w5100_command(int isocket, uint8_t cmd)
 {
-    uint16_t toread;
-
-    toread = read_buf_len(isocket);
-    if (toread != 0)
-    {
-        uint16_t pread;
-        
-        if (len > toread)
-        {
-            len = toread;
-        }
-        pread = read_buf_pstart(isocket);
-        read_buf_sure(isocket, buf, len, &pread);
-        read_buf_recv(isocket, pread);
-    }
-    else
+    w5100_write_sock_reg(W5100_Sn_CR, isocket, cmd);
+    while (w5100_read_sock_reg(W5100_Sn_CR, isocket))
     {
-        len = 0;
+        continue;
     }
-    return len;
 }
 
 static
-uint16_t write_buf_len(int isocket)
+void bind_udp(struct w5100_socket *s, uint16_t port)
 {
-    uint16_t nfree;
-
-    w5100_read_sock_regx(W5100_Sn_TX_FSR, isocket, &nfree);
-    nfree = ntohs(nfree);
+    if (!sock_is_vudp(s))
+    {
+        uint8_t sr;
 
-    return nfree;
+        w5100_write_sock_regx(W5100_Sn_PORT, s->isocket, &port);
+        sock_events_reset(s);
+        w5100_command(s->isocket, W5100_CMD_OPEN);
+        do {
+            sr = w5100_read_sock_reg(W5100_Sn_SR, s->isocket);
+        } while (sr != W5100_SOCK_UDP);
+    }
+    s->sockname.sin_family = AF_INET;
+    s->sockname.sin_addr.s_addr = INADDR_ANY; /* TODO: local IP */
+    s->sockname.sin_port = port;
+    s->state = W5100_SOCK_STATE_BOUND;
 }
 
 static
-uint16_t write_buf_pstart(int isocket)
+void check_bind_udp(struct w5100_socket *s)
 {
-    uint16_t pwrite;
-
-    w5100_read_sock_regx(W5100_Sn_TX_WR, isocket, &pwrite);
-    pwrite = ntohs(pwrite);
+    if (s->state == W5100_SOCK_STATE_CREATED)
+    {
+        uint16_t port;
 
-    return pwrite;
+        port = get_avail_port();
+        bind_udp(s, port);
+    }
 }
 
+/* Follows a connection started by CONNECT.
+ * Returns 1 while still in progress, 0 when established, -1 on failure,
+ * with the error kept for SO_ERROR.
+ */
 static
-void write_buf_send(int isocket, uint16_t pstop)
+int connect_check(struct w5100_socket *s)
 {
-    pstop = htons(pstop);
-    w5100_write_sock_regx(W5100_Sn_TX_WR, isocket, &pstop);
-    w5100_command(isocket, W5100_CMD_SEND);
-}
+    int ret;
+    uint8_t events;
 
-static
-void write_buf_sure(int isocket, const void *buf, size_t len, uint16_t *pwrite)
-{
-    uint16_t offset;
-    uint16_t phys;
-    uint16_t towrite1;
-    uint16_t towrite2;
-    const uint8_t *bytes = buf;
-    
-    offset = *pwrite & get_tx_mask(isocket);
-    phys = offset + get_tx_base(isocket);
-    if (len + offset > get_tx_size(isocket))
+    events = sock_events_update(s);
+    if (events & (W5100_INT_CON|W5100_INT_DISCON|W5100_INT_TIMEOUT))
     {
-        towrite1 = get_tx_size(isocket) - offset;
-        towrite2 = len - towrite1;
+        uint8_t sr;
+
+        do {
+            sr = w5100_read_sock_reg(W5100_Sn_SR, s->isocket);
+        } while (sr == W5100_SOCK_SYNSENT);
+        /* the peer can send its FIN right after the handshake */
+        if ((sr == W5100_SOCK_ESTABLISHED) || (sr == W5100_SOCK_CLOSE_WAIT))
+        {
+            s->state = W5100_SOCK_STATE_CONNECTED;
+            sock_rtt_sample(s);
+            ret = 0;
+        }
+        else
+        {
+            if (sr != W5100_SOCK_CLOSED)
+            {
+                w5100_command(s->isocket, W5100_CMD_CLOSE);
+            }
+            /* can be connected again */
+            s->state = W5100_SOCK_STATE_CREATED;
+            s->dest_address.sin_family = AF_UNSPEC;
+            s->sockname.sin_family = AF_UNSPEC;
+            if (events & W5100_INT_TIMEOUT)
+            {
+                s->error = ETIMEDOUT;
+            }
+            else
+            {
+                s->error = ECONNREFUSED;
+            }
+            ret = -1;
+        }
     }
     else
     {
-        towrite1 = len;
-        towrite2 = 0;
-    }
-    if (towrite1 > 0)
-    {
-        w5100_write_mem(phys, &bytes[0], towrite1);
-    }
-    if (towrite2 > 0)
-    {
-        w5100_write_mem(get_tx_base(isocket), &bytes[towrite1], towrite2);
+        ret = 1;
     }
-    *pwrite += len;
+    return ret;
 }
 
+/* Moves on connections being opened or closed. */
 static
-uint16_t write_buf(int isocket, const void *buf, size_t len)
+void sock_update(struct w5100_socket *s)
 {
-    uint16_t nfree;
-
-    nfree = write_buf_len(isocket);
-    if (nfree > 0)
+    if (s->state == W5100_SOCK_STATE_CONNECTING)
     {
-        uint16_t pwrite;
-
-        if (len > nfree)
-        {
-            len = nfree;
-        }
-        pwrite = write_buf_pstart(isocket);
-        write_buf_sure(isocket, buf, len, &pwrite);
-        write_buf_send(isocket, pwrite);
+        (void)connect_check(s);
     }
-    else
+    else if (s->state == W5100_SOCK_STATE_CLOSING)
     {
-        len = 0;
+        sock_close_check(s);
     }
-    return len;
 }
 
-ssize_t recvfrom(int sockfd, void *__restrict buf, size_t len, int flags,
-        struct sockaddr *__restrict address, socklen_t *__restrict address_len)
+static
+int connect_tcp(struct w5100_socket *s, const struct sockaddr *addr, socklen_t addrlen)
 {
-    ssize_t ret;
-    struct w5100_socket *s;
-
-    (void)flags; /* TODO */
-
-    s = get_socket_from_fd(sockfd);
-    if (s == NULL)
+    int ret;
+    
+    if ( addr->sa_family != AF_INET )
     {
+        errno = EAFNOSUPPORT;
         ret = -1;
     }
     else if (
-            (s->type == SOCK_STREAM)
-            &&
-            (s->state != W5100_SOCK_STATE_ACCEPTED)
+            (s->state == W5100_SOCK_STATE_CONNECTED)
+            ||
+            (s->state == W5100_SOCK_STATE_ACCEPTED)
+            )
+    {
+        errno = EISCONN;
+        ret = -1;
+    }
+    else if (s->state == W5100_SOCK_STATE_CONNECTING)
+    {
+        errno = EALREADY;
+        ret = -1;
+    }
+    else if (s->state == W5100_SOCK_STATE_LISTENING)
+    {
+        errno = EOPNOTSUPP;
+        ret = -1;
+    }
+    else if (
+            (s->state != W5100_SOCK_STATE_CREATED)
+            &&
+            (s->state != W5100_SOCK_STATE_BOUND)
+            )
+    {
+        errno = EOPNOTSUPP;
+        ret = -1;
+    }
+    else
+    {
+        struct sockaddr_in *server;
+        int isocket;
+
+        (void)addrlen;
+
+        isocket = s->isocket;
+        server = (struct sockaddr_in *)addr;
+        if (s->state == W5100_SOCK_STATE_CREATED)
+        {
+            uint16_t port;
+            uint8_t sr;
+
+            /* implicit bind */
+            port = get_avail_port();
+            w5100_write_sock_regx(W5100_Sn_PORT, isocket, &port);
+            w5100_command(isocket, W5100_CMD_OPEN);
+            do {
+                sr = w5100_read_sock_reg(W5100_Sn_SR, isocket);
+            } while (sr != W5100_SOCK_INIT);
+            s->sockname.sin_family = AF_INET;
+            s->sockname.sin_addr.s_addr = INADDR_ANY; /* TODO: local IP */
+            s->sockname.sin_port = port;
+        }
+
+        w5100_write_sock_regx(W5100_Sn_DIPR, isocket, &server->sin_addr.s_addr);
+        w5100_write_sock_regx(W5100_Sn_DPORT, isocket, &server->sin_port);
+        sock_events_reset(s);
+        sock_retry_apply(s, (s->retry.syncnt != 0) ? s->retry.syncnt : s->retry.rcr);
+        clock_gettime(CLOCK_MONOTONIC, &s->retry.sent);
+        w5100_command(isocket, W5100_CMD_CONNECT);
+        s->state = W5100_SOCK_STATE_CONNECTING;
+        s->dest_address = *server;
+        s->error = 0;
+
+        if (s->fd_data->status_flags & O_NONBLOCK)
+        {
+            /* completion is reported by poll */
+            errno = EINPROGRESS;
+            ret = -1;
+        }
+        else
+        {
+            struct timeout_manager tom;
+
+            timeout_init(&s->send_timeout, &tom);
+            do
+            {
+                ret = connect_check(s);
+                if ((ret == 1) && timeout_wait(&tom))
+                {
+                    /* goes on in background */
+                    errno = EINPROGRESS;
+                    ret = -1;
+                }
+                else if (ret == -1)
+                {
+                    errno = s->error;
+                    s->error = 0;
+                }
+            } while (ret == 1);
+        }
+    }
+    return ret;
+}
+
+static
+int connect_udp(struct w5100_socket *s, const struct sockaddr *addr, socklen_t addrlen)
+{
+    int ret;
+    
+    (void)addrlen;
+
+    if (addr->sa_family == AF_UNSPEC)
+    {
+        s->dest_address.sin_family = AF_UNSPEC; /* reset pre-specified address */
+        check_bind_udp(s);
+        ret = 0;
+    }
+    else if (addr->sa_family == AF_INET)
+    {
+        const struct sockaddr_in *dest_address;
+        
+        dest_address = (struct sockaddr_in *)addr;
+        s->dest_address = *dest_address;
+        check_bind_udp(s);
+        ret = 0;
+    }
+    else
+    {
+        errno = EAFNOSUPPORT;
+        ret = -1;
+    }
+
+    return ret;
+}
+
+int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
+{
+    int ret;
+    struct w5100_socket *s;
+
+    s = get_socket_from_fd(sockfd);
+    if (s == NULL)
+    {
+        ret = -1;
+    }
+    else if (s->type == SOCK_STREAM)
+    {
+        ret = connect_tcp(s, addr, addrlen);
+    }
+    else if (s->type == SOCK_DGRAM)
+    {
+        ret = connect_udp(s, addr, addrlen);
+    }
+    else /* TODO: RAW */
+    {
+        errno = EAFNOSUPPORT;
+        ret = -1;
+    }
+    return ret;
+}
+
+int bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
+{
+    int ret;
+    struct w5100_socket *s;
+
+    s = get_socket_from_fd(sockfd);
+    if (s == NULL)
+    {
+        ret = -1;
+    }
+    else if ( addr->sa_family != AF_INET )
+    {
+        errno = EAFNOSUPPORT;
+        ret = -1;
+    }
+    else if (s->state != W5100_SOCK_STATE_CREATED)
+    {
+        errno = EINVAL;
+        ret = 1;
+    }
+    else if (s->type == SOCK_STREAM)
+    {
+        struct sockaddr_in *server;
+        uint8_t sr;
+        uint8_t sr_end;
+
+        (void)addrlen;
+        
+        server = (struct sockaddr_in *)addr;
+        /* TODO: check if already in use EADDRINUSE */
+        s->sockname = *server;
+        if (s->sockname.sin_port == 0)
+        {
+            s->sockname.sin_port = get_avail_port();
+        }
+        w5100_write_sock_regx(W5100_Sn_PORT, s->isocket, &s->sockname.sin_port);
+        w5100_command(s->isocket, W5100_CMD_OPEN);
+        sr_end = W5100_SOCK_INIT;
+        do {
+            sr = w5100_read_sock_reg(W5100_Sn_SR, s->isocket);
+        } while (sr != sr_end);
+        s->state = W5100_SOCK_STATE_BOUND;
+        ret = 0;
+    }
+    else if (s->type == SOCK_DGRAM)
+    {
+        struct sockaddr_in *server;
+        (void)addrlen;
+
+        server = (struct sockaddr_in *)addr;
+        if (server->sin_port == 0)
+        {
+            check_bind_udp(s);
+        }
+        else
+        {
+            bind_udp(s, server->sin_port);
+        }
+        ret = 0;
+    }
+    else
+    {
+        /* TODO: RAW */
+        errno = EBADF;
+        ret = -1;
+    }
+    return ret;
+}
+
+/* Whether fd is the listening descriptor of its socket. */
+static
+int sock_is_listener_fd(const struct w5100_socket *s, int fd)
+{
+    return (s->listener == s) && (s->fd_data != NULL) && (s->fd_data->fd == fd);
+}
+
+/* Number of sockets of the pool that are listening, or about to. */
+static
+int pool_listening(const struct w5100_socket *listener)
+{
+    int i;
+    int n = 0;
+
+    for (i = 0; i < W5100_N_SOCKETS; i++)
+    {
+        const struct w5100_socket *m = &w5100_sockets[i];
+
+        if (
+                (m->fd != W5100_SOCKET_FREE)
+                &&
+                (m->listener == listener)
+                &&
+                (
+                    (m->state == W5100_SOCK_STATE_LISTENING)
+                    ||
+                    (
+                        (m->state == W5100_SOCK_STATE_CLOSING)
+                        &&
+                        m->relisten
+                        &&
+                        (m->connection_data == NULL)
+                    )
+                )
+           )
+        {
+            n++;
+        }
+    }
+    return n;
+}
+
+/* Whether a socket should listen again when its connection is over:
+ * only if the listening descriptor is open and the pool is not full
+ * (the socket itself is counted).
+ */
+static
+int pool_wants_relisten(const struct w5100_socket *s)
+{
+    const struct w5100_socket *listener = s->listener;
+
+    return
+        (listener != NULL)
+        &&
+        (listener->fd_data != NULL)
+        &&
+        (pool_listening(listener) <= listener->backlog);
+}
+
+/* Takes another hardware socket listening on the same port. */
+static
+int pool_member_add(struct w5100_socket *listener)
+{
+    int isocket;
+    int ret;
+
+    isocket = socket_alloc();
+    if (isocket == -1)
+    {
+        ret = -1;
+    }
+    else
+    {
+        struct w5100_socket *m;
+        uint8_t sr;
+
+        m = get_socket_from_isocket(isocket);
+        m->isocket = isocket;
+        m->domain = listener->domain;
+        m->type = SOCK_STREAM;
+        m->protocol = listener->protocol;
+        m->sockname = listener->sockname;
+        m->dest_address.sin_family = AF_UNSPEC;
+        m->can_broadcast = 0;
+        m->error = 0;
+        m->recv_timeout = listener->recv_timeout;
+        m->send_timeout = listener->send_timeout;
+        m->linger = listener->linger;
+        m->relisten = 0;
+        m->fd_data = NULL;
+        m->connection_data = NULL;
+        m->tx_flags = listener->tx_flags & (W5100_TX_NODELAY|W5100_TX_CORK);
+        m->listener = listener;
+        m->backlog = 0;
+        m->keepalive = listener->keepalive;
+        m->retry = listener->retry;
+
+        w5100_write_sock_reg(W5100_Sn_MR, isocket, W5100_SOCK_MODE_TCP);
+        w5100_write_sock_regx(W5100_Sn_PORT, isocket, &listener->sockname.sin_port);
+        w5100_command(isocket, W5100_CMD_OPEN);
+        do {
+            sr = w5100_read_sock_reg(W5100_Sn_SR, isocket);
+        } while (sr != W5100_SOCK_INIT);
+        sock_events_reset(m);
+        w5100_command(isocket, W5100_CMD_LISTEN);
+        do {
+            sr = w5100_read_sock_reg(W5100_Sn_SR, isocket);
+        } while ((sr != W5100_SOCK_LISTEN) && (sr != W5100_SOCK_ESTABLISHED));
+        m->state = W5100_SOCK_STATE_LISTENING;
+        ret = 0;
+    }
+    return ret;
+}
+
+/* Brings the pool back to backlog listening sockets, as far as
+ * hardware sockets are free.
+ */
+static
+void pool_refill(struct w5100_socket *listener)
+{
+    int saved_errno;
+
+    saved_errno = errno;
+    while (
+            (pool_listening(listener) < listener->backlog)
+            &&
+            (pool_member_add(listener) == 0)
+          )
+    {
+        continue;
+    }
+    errno = saved_errno;
+}
+
+/* Returns a socket of the pool with a connection ready to accept. */
+static
+struct w5100_socket *pool_established(struct w5100_socket *listener)
+{
+    struct w5100_socket *established = NULL;
+    int i;
+
+    for (i = 0; (i < W5100_N_SOCKETS) && (established == NULL); i++)
+    {
+        struct w5100_socket *m = &w5100_sockets[i];
+
+        if ((m->fd == W5100_SOCKET_FREE) || (m->listener != listener))
+        {
+            continue;
+        }
+        sock_close_check(m);
+        if (m->state == W5100_SOCK_STATE_LISTENING)
+        {
+            uint8_t events;
+            uint8_t sr;
+
+            events = sock_events_update(m);
+            sr = w5100_read_sock_reg(W5100_Sn_SR, m->isocket);
+            if (
+                    (events & W5100_INT_CON)
+                    &&
+                    /* a client that already sent its FIN is accepted
+                     * too, reads then see the end of file */
+                    ((sr == W5100_SOCK_ESTABLISHED) || (sr == W5100_SOCK_CLOSE_WAIT))
+               )
+            {
+                established = m;
+            }
+            else if (sr == W5100_SOCK_CLOSED)
+            {
+                /* the connection was reset before accept:
+                 * the socket listens again, or leaves the pool */
+                sock_close_start(m, 1);
+                sock_close_check(m);
+            }
+        }
+    }
+    return established;
+}
+
+/* The listening descriptor is closed: the other sockets still
+ * listening are closed, accepted connections go on alone.
+ */
+static
+void pool_release(struct w5100_socket *listener)
+{
+    int i;
+
+    for (i = 0; i < W5100_N_SOCKETS; i++)
+    {
+        struct w5100_socket *m = &w5100_sockets[i];
+
+        if ((m == listener) || (m->fd == W5100_SOCKET_FREE) || (m->listener != listener))
+        {
+            continue;
+        }
+        m->listener = NULL;
+        m->relisten = 0;
+        if (m->state == W5100_SOCK_STATE_LISTENING)
+        {
+            uint8_t sr;
+
+            w5100_command(m->isocket, W5100_CMD_CLOSE);
+            do {
+                sr = w5100_read_sock_reg(W5100_Sn_SR, m->isocket);
+            } while (sr != W5100_SOCK_CLOSED);
+            socket_free(m->isocket);
+        }
+    }
+}
+
+int listen(int sockfd, int backlog)
+{
+    int ret;
+    struct w5100_socket *s;
+
+    s = get_socket_from_fd(sockfd);
+    if (s == NULL)
+    {
+        ret = -1;
+    }
+    else if (s->state != W5100_SOCK_STATE_BOUND)
+    {
+        errno = EDESTADDRREQ;
+        ret = 1;
+    }
+    else if (s->type != SOCK_STREAM) /* UPD and RAW */
+    {
+        errno = EOPNOTSUPP;
+        ret = -1;
+    }
+    else /* TCP */
+    {
+        uint8_t sr;
+        /* TODO: check if already in use EADDRINUSE */
+        if (backlog < 1)
+        {
+            backlog = 1;
+        }
+        else if (backlog > W5100_LISTEN_POOL_MAX)
+        {
+            backlog = W5100_LISTEN_POOL_MAX;
+        }
+        s->listener = s;
+        s->backlog = backlog;
+        sock_events_reset(s);
+        w5100_command(s->isocket, W5100_CMD_LISTEN);
+        do {
+            sr = w5100_read_sock_reg(W5100_Sn_SR, s->isocket);
+        } while ((sr != W5100_SOCK_LISTEN) && (sr != W5100_SOCK_ESTABLISHED));
+        s->state = W5100_SOCK_STATE_LISTENING;
+        /* more hardware sockets on the same port make the backlog */
+        pool_refill(s);
+        ret = 0;
+    }
+    return ret;
+}
+
+int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
+{
+    int ret;
+    struct w5100_socket *s;
+
+    s = get_socket_from_fd(sockfd);
+    if (s == NULL)
+    {
+        ret = -1;
+    }
+    else if (!sock_is_listener_fd(s, sockfd))
+    {
+        errno = EINVAL;
+        ret = -1;
+    }
+    else if (s->type != SOCK_STREAM) /* UDP or RAW */
+    {
+        errno = EOPNOTSUPP;
+        ret = -1;
+    }
+    else /* TCP */
+    {
+        int newsockfd;
+        int nonblock;
+        struct timeout_manager tom;
+
+        nonblock = s->fd_data->status_flags & O_NONBLOCK;
+        timeout_init(&TIMESPEC_ZERO, &tom);
+        pool_refill(s);
+
+        do
+        {
+            struct w5100_socket *m;
+
+            sockets_keepalive_service();
+            m = pool_established(s);
+            if (m != NULL)
+            {
+                newsockfd = file_alloc();
+                if (newsockfd == -1)
+                {
+                    errno = ENFILE;
+                    /* go again into listen state */
+                    w5100_command(m->isocket, W5100_CMD_CLOSE);
+                    sock_events_reset(m);
+                    w5100_command(m->isocket, W5100_CMD_OPEN);
+                    w5100_command(m->isocket, W5100_CMD_LISTEN);
+                }
+                else
+                {
+                    struct sockaddr_in *client;
+
+                    m->events &= ~W5100_INT_CON;
+                    m->state = W5100_SOCK_STATE_ACCEPTED;
+                    m->connection_data = fill_fd_struct(newsockfd, m);
+                    sock_counters_reset(m);
+                    sock_keepalive_restart(m);
+                    
+                    if (addr != NULL)
+                    {
+                        if (addrlen != NULL)
+                        {
+                            *addrlen = sizeof(struct sockaddr_in);
+                        }
+                        client = (struct sockaddr_in *)addr;
+                        addr->sa_family = AF_INET;
+                        
+                        w5100_read_sock_regx(W5100_Sn_DIPR, m->isocket, &client->sin_addr.s_addr);
+                        w5100_read_sock_regx(W5100_Sn_DPORT, m->isocket, &client->sin_port);
+                    }
+                    /* another socket listens in place of this one */
+                    pool_refill(s);
+                }
+                ret = newsockfd;
+                break;
+            }
+            else if (nonblock)
+            {
+                errno = EAGAIN;
+                ret = -1;
+                break;
+            }
+            timeout_wait(&tom);
+        } while(1);
+    }
+    return ret;
+}
+
+static
+void timeout_init(const struct timespec *timeout, struct timeout_manager *tom)
+{
+    tom->has_timeout = (timespec_diff(&TIMESPEC_ZERO, timeout, NULL) != 0);
+
+    if (tom->has_timeout)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &tom->end);
+        timespec_incr(&tom->end, timeout);
+    }
+    else
+    {
+        tom->end = TIMESPEC_INFINITY;
+    }
+    tom->seq = wait_event_seq();
+}
+
+/* Sleeps until something may have changed since the last check, which
+ * is a socket interrupt if they are enabled, or any interrupt if the
+ * chip must be polled; then tells whether the timeout ended.
+ */
+static
+int timeout_wait(struct timeout_manager *tom)
+{
+    int ret;
+
+    if (w5100_int_enabled())
+    {
+        ret = (wait_event(tom->seq, &tom->end) == 0);
+    }
+    else
+    {
+        ret = (wait_interrupt(&tom->end) == 0);
+    }
+    if (ret)
+    {
+        errno = EAGAIN;
+    }
+    tom->seq = wait_event_seq();
+
+    return ret;
+}
+
+static
+uint16_t get_tx_size(int isocket)
+{
+    return w5100_tx_split.size[isocket];
+}
+
+static
+uint16_t get_tx_mask(int isocket)
+{
+    return get_tx_size(isocket) - 1; /* size is always power of 2 */
+}
+
+static
+uint16_t get_tx_base(int isocket)
+{
+    return W5100_TX_MEM_BASE + w5100_tx_split.base[isocket];
+}
+
+static
+uint16_t get_rx_size(int isocket)
+{
+    return w5100_rx_split.size[isocket];
+}
+
+static
+uint16_t get_rx_mask(int isocket)
+{
+    return get_rx_size(isocket) - 1; /* size is always power of 2 */
+}
+
+static
+uint16_t get_rx_base(int isocket)
+{
+    return W5100_RX_MEM_BASE + w5100_rx_split.base[isocket];
+}
+
+static
+int manage_disconnect(struct w5100_socket *s)
+{
+    int ret;
+    uint8_t sr;
+    
+    if (sock_events_update(s) & (W5100_INT_DISCON|W5100_INT_TIMEOUT))
+    {
+        sr = w5100_read_sock_reg(W5100_Sn_SR, s->isocket);
+    }
+    else
+    {
+        sr = W5100_SOCK_ESTABLISHED;
+    }
+    if (sr != W5100_SOCK_ESTABLISHED)
+    {
+        if (sr == W5100_SOCK_CLOSE_WAIT)
+        {
+            errno = ECONNRESET;
+        }
+        else
+        {
+            errno = ETIMEDOUT;
+        }
+        /* an accepted connection gives the socket back to the listener */
+        sock_close_start(s, (s->state == W5100_SOCK_STATE_ACCEPTED));
+        sock_close_check(s);
+        ret = -1;
+    }
+    else
+    {
+        ret = 0;
+    }
+    return ret;
+}
+
+ssize_t recv(int sockfd, void *buf, size_t len, int flags)
+{
+    return recvfrom(sockfd, buf, len, flags, NULL, NULL);
+}
+
+static
+uint16_t read_buf_len(int isocket)
+{
+    uint16_t toread;
+
+    w5100_read_sock_regx(W5100_Sn_RX_RSR, isocket, &toread);
+    toread = ntohs(toread);
+
+    return toread;
+}
+
+static
+void read_buf_sure(int isocket, void *buf, size_t len, uint16_t *pread)
+{
+    uint16_t offset;
+    uint16_t phys;
+    uint16_t toread1;
+    uint16_t toread2;
+    uint8_t *bytes = buf;
+
+    offset = *pread & get_rx_mask(isocket);
+    phys = get_rx_base(isocket) + offset;
+    if (offset + len > get_rx_size(isocket))
+    {
+        toread1 = get_rx_size(isocket) - offset;
+        toread2 = len - toread1;
+    }
+    else
+    {
+        toread1 = len;
+        toread2 = 0;
+    }
+    if (toread1 > 0)
+    {
+        w5100_read_mem(phys, &bytes[0], toread1);
+    }
+    if (toread2 > 0)
+    {
+        w5100_read_mem(get_rx_base(isocket), &bytes[toread1], toread2);
+    }
+    *pread = *pread + len;
+}
+
+static
+uint16_t read_buf_pstart(int isocket)
+{
+    uint16_t pread;
+
+    w5100_read_sock_regx(W5100_Sn_RX_RD, isocket, &pread);
+    pread = ntohs(pread);
+
+    return pread;
+}
+
+static
+void read_buf_recv(struct w5100_socket *s, uint16_t pstop)
+{
+    pstop = htons(pstop);
+    w5100_write_sock_regx(W5100_Sn_RX_RD, s->isocket, &pstop);
+    w5100_command(s->isocket, W5100_CMD_RECV);
+    s->counters.recv_commands++;
+    socket_stats.recv_commands++;
+}
+
+/* Received bytes handed to the application. */
+static
+void sock_rx_account(struct w5100_socket *s, size_t len)
+{
+    s->counters.bytes_received += len;
+    socket_stats.recv_bytes += len;
+}
+
+/* Reads Sn_RX_RSR only if something was received
+ * since the buffer was found empty.
+ */
+static
+uint16_t sock_rx_len(struct w5100_socket *s)
+{
+    uint16_t toread;
+
+    if (sock_events_update(s) & W5100_INT_RECV)
+    {
+        toread = read_buf_len(s->isocket);
+        if (toread == 0)
+        {
+            s->events &= ~W5100_INT_RECV;
+        }
+    }
+    else
+    {
+        toread = 0;
+    }
+
+    return toread;
+}
+
+static
+void sock_rx_consumed(struct w5100_socket *s, uint16_t toread, uint16_t nread)
+{
+    if (nread >= toread)
+    {
+        /* new data will raise RECV again */
+        s->events &= ~W5100_INT_RECV;
+    }
+}
+
+static
+uint16_t read_buf(struct w5100_socket *s, void *buf, size_t len)
+{
+    uint16_t toread;
+    int isocket;
+
+    isocket = s->isocket;
+    toread = sock_rx_len(s);
+    if (toread != 0)
+    {
+        uint16_t pread;
+        
+        if (len > toread)
+        {
+            len = toread;
+        }
+        pread = read_buf_pstart(isocket);
+        read_buf_sure(isocket, buf, len, &pread);
+        read_buf_recv(s, pread);
+        sock_rx_account(s, len);
+        sock_rx_consumed(s, toread, len);
+    }
+    else
+    {
+        len = 0;
+    }
+    return len;
+}
+
+static
+uint16_t write_buf_len(int isocket)
+{
+    uint16_t nfree;
+
+    w5100_read_sock_regx(W5100_Sn_TX_FSR, isocket, &nfree);
+    nfree = ntohs(nfree);
+
+    return nfree;
+}
+
+static
+uint16_t write_buf_pstart(int isocket)
+{
+    uint16_t pwrite;
+
+    w5100_read_sock_regx(W5100_Sn_TX_WR, isocket, &pwrite);
+    pwrite = ntohs(pwrite);
+
+    return pwrite;
+}
+
+static
+void write_buf_send(int isocket, uint16_t pstop)
+{
+    pstop = htons(pstop);
+    w5100_write_sock_regx(W5100_Sn_TX_WR, isocket, &pstop);
+    w5100_command(isocket, W5100_CMD_SEND);
+}
+
+static
+void write_buf_sure(int isocket, const void *buf, size_t len, uint16_t *pwrite)
+{
+    uint16_t offset;
+    uint16_t phys;
+    uint16_t towrite1;
+    uint16_t towrite2;
+    const uint8_t *bytes = buf;
+    
+    offset = *pwrite & get_tx_mask(isocket);
+    phys = offset + get_tx_base(isocket);
+    if (len + offset > get_tx_size(isocket))
+    {
+        towrite1 = get_tx_size(isocket) - offset;
+        towrite2 = len - towrite1;
+    }
+    else
+    {
+        towrite1 = len;
+        towrite2 = 0;
+    }
+    if (towrite1 > 0)
+    {
+        w5100_write_mem(phys, &bytes[0], towrite1);
+    }
+    if (towrite2 > 0)
+    {
+        w5100_write_mem(get_tx_base(isocket), &bytes[towrite1], towrite2);
+    }
+    *pwrite += len;
+}
+
+/* Free TX memory only grows when a send completes:
+ * Sn_TX_FSR is read again only after SEND_OK
+ * (or TIMEOUT, for UDP, when ARP fails).
+ */
+static
+uint16_t sock_tx_free(struct w5100_socket *s)
+{
+    uint8_t events;
+    uint8_t events_free;
+
+    events = sock_events_update(s);
+    events_free = W5100_INT_SEND_OK;
+    if (s->type != SOCK_STREAM)
+    {
+        events_free |= W5100_INT_TIMEOUT;
+    }
+    if (events & events_free)
+    {
+        s->events &= ~events_free;
+        /* Sn_TX_FSR does not know about held data */
+        s->tx_free = write_buf_len(s->isocket) - s->tx_held;
+    }
+
+    return s->tx_free;
+}
+
+/* Copies len bytes of an I/O vector into TX memory,
+ * skipping its first skip bytes.
+ */
+static
+void write_buf_iov(int isocket, const struct iovec *iov, int iovcnt, size_t skip, size_t len, uint16_t *pwrite)
+{
+    int i;
+
+    for (i = 0; (i < iovcnt) && (len > 0); i++)
+    {
+        if (skip >= iov[i].iov_len)
+        {
+            skip -= iov[i].iov_len;
+        }
+        else
+        {
+            const uint8_t *bytes = iov[i].iov_base;
+            size_t n;
+
+            n = iov[i].iov_len - skip;
+            if (n > len)
+            {
+                n = len;
+            }
+            write_buf_sure(isocket, &bytes[skip], n, pwrite);
+            len -= n;
+            skip = 0;
+        }
+    }
+}
+
+/* Whether TCP data in TX memory should wait for more. */
+static
+int sock_tx_hold(const struct w5100_socket *s)
+{
+    int hold;
+
+    if ((s->type != SOCK_STREAM) || (s->tx_held == 0))
+    {
+        hold = 0;
+    }
+    else if ((s->tx_held >= W5100_TX_FLUSH_LEN) || (s->tx_free == 0))
+    {
+        hold = 0;
+    }
+    else if (s->tx_flags & (W5100_TX_CORK|W5100_TX_MORE))
+    {
+        hold = 1;
+    }
+    else if (s->tx_flags & W5100_TX_NODELAY)
+    {
+        hold = 0;
+    }
+    else
+    {
+        /* Nagle: small data waits for the previous segment to be acked */
+        hold = ((s->tx_flags & W5100_TX_INFLIGHT) != 0);
+    }
+    return hold;
+}
+
+static
+void sock_tx_flush(struct w5100_socket *s)
+{
+    if (s->tx_held > 0)
+    {
+        sock_retry_apply(s, s->retry.rcr);
+        if (!(s->tx_flags & W5100_TX_INFLIGHT))
+        {
+            clock_gettime(CLOCK_MONOTONIC, &s->retry.sent);
+        }
+        write_buf_send(s->isocket, s->tx_wr);
+        socket_stats.send_commands++;
+        socket_stats.send_bytes += s->tx_held;
+        s->counters.send_commands++;
+        s->counters.bytes_sent += s->tx_held;
+        s->tx_held = 0;
+        s->tx_flags |= W5100_TX_INFLIGHT;
+    }
+}
+
+/* Sends held data when there is no more reason to wait. */
+static
+void sock_tx_service(struct w5100_socket *s)
+{
+    if (s->tx_held > 0)
+    {
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (
+                !sock_tx_hold(s)
+                ||
+                (timespec_diff(&s->tx_flush_time, &now, NULL) < 0)
+           )
+        {
+            sock_tx_flush(s);
+        }
+    }
+}
+
+/* Writes as much as possible of len bytes of the I/O vector,
+ * after the first skip, and sends them with a single SEND command,
+ * unless they are held to be coalesced with the next ones.
+ */
+static
+uint16_t write_buf(struct w5100_socket *s, const struct iovec *iov, int iovcnt, size_t skip, size_t len)
+{
+    uint16_t nfree;
+    int isocket;
+
+    isocket = s->isocket;
+    nfree = sock_tx_free(s);
+    if (nfree > 0)
+    {
+        uint16_t pwrite;
+        uint16_t held;
+
+        if (len > nfree)
+        {
+            len = nfree;
+        }
+        held = s->tx_held;
+        if (held == 0)
+        {
+            pwrite = write_buf_pstart(isocket);
+        }
+        else
+        {
+            pwrite = s->tx_wr;
+        }
+        write_buf_iov(isocket, iov, iovcnt, skip, len, &pwrite);
+        s->tx_wr = pwrite;
+        s->tx_held += len;
+        s->tx_free -= len;
+        if (!sock_tx_hold(s))
+        {
+            sock_tx_flush(s);
+        }
+        else if (held == 0)
+        {
+            static const struct timespec hold_max = {
+                .tv_sec = W5100_TX_HOLD_MS / MSECS_IN_SEC,
+                .tv_nsec = (W5100_TX_HOLD_MS % MSECS_IN_SEC) * (NSECS_IN_SEC / MSECS_IN_SEC),
+            };
+
+            clock_gettime(CLOCK_MONOTONIC, &s->tx_flush_time);
+            timespec_incr(&s->tx_flush_time, &hold_max);
+            wait_deadline_hint(&s->tx_flush_time);
+        }
+    }
+    else
+    {
+        len = 0;
+    }
+    return len;
+}
+
+/* Total length of a vector, -1 if not valid. */
+static
+ssize_t iov_len_get(const struct iovec *iov, int iovcnt)
+{
+    ssize_t len = 0;
+    int i;
+
+    if ((iovcnt < 0) || (iovcnt > IOV_MAX) || ((iov == NULL) && (iovcnt > 0)))
+    {
+        len = -1;
+    }
+    for (i = 0; (i < iovcnt) && (len >= 0); i++)
+    {
+        if (iov[i].iov_len > (size_t)(SSIZE_MAX - len))
+        {
+            len = -1;
+        }
+        else
+        {
+            len += iov[i].iov_len;
+        }
+    }
+    return len;
+}
+
+#ifndef W5100_RECV_CHUNK
+#  define W5100_RECV_CHUNK 32
+#endif
+
+static
+int sock_recv_state_ok(struct w5100_socket *s)
+{
+    int ok;
+
+    if (s->type == SOCK_STREAM)
+    {
+        ok = (s->state == W5100_SOCK_STATE_ACCEPTED)
+            || (s->state == W5100_SOCK_STATE_CONNECTED);
+    }
+    else
+    {
+        ok = (s->state == W5100_SOCK_STATE_BOUND)
+            || (s->state == W5100_SOCK_STATE_CREATED);
+    }
+    return ok;
+}
+
+static
+void recv_view_fill(struct w5100_socket *s, struct w5100_recv_view *view, uint16_t pdata, uint16_t len)
+{
+    uint16_t offset;
+    uint16_t size;
+
+    offset = pdata & get_rx_mask(s->isocket);
+    size = get_rx_size(s->isocket);
+    view->seg[0].addr = get_rx_base(s->isocket) + offset;
+    if (offset + len > size)
+    {
+        view->seg[0].len = size - offset;
+        view->seg[1].addr = get_rx_base(s->isocket);
+        view->seg[1].len = len - view->seg[0].len;
+    }
+    else
+    {
+        view->seg[0].len = len;
+        view->seg[1].addr = get_rx_base(s->isocket);
+        view->seg[1].len = 0;
+    }
+    view->len = len;
+}
+
+/* Describes the datagram starting at view->pread, after its W5100
+ * header, when view->rx_avail is at least the header size.
+ */
+static
+uint16_t recv_view_dgram(struct w5100_socket *s, struct w5100_recv_view *view)
+{
+    uint8_t header[8];
+    uint16_t pdata;
+    uint16_t len;
+
+    pdata = view->pread;
+    read_buf_sure(s->isocket, header, sizeof(header), &pdata);
+    view->peer.sin_family = AF_INET;
+    memcpy(&view->peer.sin_addr.s_addr, &header[0], 4);
+    memcpy(&view->peer.sin_port, &header[4], 2);
+    memcpy(&len, &header[6], 2);
+    len = ntohs(len);
+    view->header_len = sizeof(header);
+    recv_view_fill(s, view, pdata, len);
+
+    return len;
+}
+
+/* Describes what is already received, without waiting.
+ * Returns the length of the view, 0 if nothing is there (or for an
+ * empty datagram, that has header_len set).
+ */
+static
+uint16_t sock_recv_view_hw(struct w5100_socket *s, struct w5100_recv_view *view)
+{
+    uint16_t toread;
+    uint16_t len = 0;
+
+    toread = sock_rx_len(s);
+    view->ram = NULL;
+    view->isocket = s->isocket;
+    view->rx_avail = toread;
+    view->header_len = 0;
+    memset(&view->peer, 0, sizeof(view->peer));
+    if (s->type == SOCK_STREAM)
+    {
+        if (toread != 0)
+        {
+            view->pread = read_buf_pstart(s->isocket);
+            len = toread;
+        }
+    }
+    else if (toread >= 8)
+    {
+        view->pread = read_buf_pstart(s->isocket);
+        len = recv_view_dgram(s, view);
+    }
+    if ((len != 0) && (s->type == SOCK_STREAM))
+    {
+        recv_view_fill(s, view, view->pread, len);
+    }
+    else if (len == 0)
+    {
+        view->len = 0;
+    }
+    return len;
+}
+
+/* Moves a datagram view to the next datagram, if it is already in the
+ * ring: no need to read Sn_RX_RSR and Sn_RX_RD again, and the
+ * datagrams are given back together by releasing the last view.
+ * Returns 1 if there is one, 0 otherwise.
+ */
+static
+int sock_recv_view_next(struct w5100_socket *s, struct w5100_recv_view *view)
+{
+    int ret = 0;
+
+    if (!sock_is_vudp(s) && (s->type != SOCK_STREAM) && (view->header_len != 0))
+    {
+        uint16_t used;
+
+        used = view->header_len + view->len;
+        if (view->rx_avail - used >= 8)
+        {
+            view->pread += used;
+            view->rx_avail -= used;
+            (void)recv_view_dgram(s, view);
+            ret = 1;
+        }
+    }
+    return ret;
+}
+
+static
+uint16_t sock_recv_view(struct w5100_socket *s, struct w5100_recv_view *view)
+{
+    uint16_t len;
+
+#ifdef W5100_UDP_MUX
+    if (sock_is_vudp(s))
+    {
+        len = udp_mux_view(s, view);
+    }
+    else
+#endif
+    {
+        len = sock_recv_view_hw(s, view);
+    }
+    return len;
+}
+
+#ifdef W5100_UDP_MUX
+
+/*
+ * Virtual UDP sockets.
+ *
+ * All the SOCK_DGRAM sockets share one W5100 socket, open in IPRAW mode
+ * for the UDP protocol, so that DHCP, DNS, SNTP and the applications
+ * don't compete for the four hardware sockets, nor wait for OPEN at
+ * every transaction.
+ * The W5100 gives the whole UDP datagram after its own header: the UDP
+ * header is parsed here to find the socket bound to the destination
+ * port, and built here on transmission, without checksum (optional
+ * over IPv4).
+ * The datagram at the head of the RX ring is read directly from W5100
+ * memory by its own socket; the ones found there while another socket
+ * is reading are moved to a small RAM area, so that a socket not being
+ * read does not block the others. When the area is full, or nobody is
+ * bound to the port, the datagram is dropped.
+ * A view of a virtual socket must be released before receiving on
+ * another one.
+ */
+
+/* in udp_mux_park, followed by the payload */
+struct udp_mux_record {
+    uint32_t addr; /* source, network byte order */
+    uint16_t port; /* source, network byte order */
+    uint16_t len;
+    uint8_t ivsock; /* destination */
+};
+
+static
+int udp_mux_open(void)
+{
+    int ret;
+
+    if (udp_mux_isocket != -1)
+    {
+        ret = 0;
+    }
+    else
+    {
+        int isocket;
+
+        isocket = socket_alloc();
+        if (isocket == -1)
+        {
+            ret = -1;
+        }
+        else
+        {
+            struct w5100_socket *m;
+            uint8_t sr;
+
+            m = get_socket_from_isocket(isocket);
+            m->isocket = isocket;
+            sock_fields_init(m, SOCK_RAW);
+            m->fd_data = NULL;
+            m->state = W5100_SOCK_STATE_BOUND;
+            w5100_write_sock_reg(W5100_Sn_MR, isocket, W5100_SOCK_MODE_IPRAW);
+            w5100_write_sock_reg(W5100_Sn_SPROTO, isocket, IP_PROTO_UDP);
+            sock_events_reset(m);
+            w5100_command(isocket, W5100_CMD_OPEN);
+            do {
+                sr = w5100_read_sock_reg(W5100_Sn_SR, isocket);
+            } while (sr != W5100_SOCK_IPRAW);
+            udp_mux_isocket = isocket;
+            udp_mux_park_used = 0;
+            ret = 0;
+        }
+    }
+    return ret;
+}
+
+/* Gives the hardware socket back when no virtual socket is left. */
+static
+void udp_mux_close_unused(void)
+{
+    int i;
+    int used = 0;
+
+    for (i = 0; (i < W5100_UDP_MUX_N) && !used; i++)
+    {
+        used = (w5100_udp_vsockets[i].fd != W5100_SOCKET_FREE);
+    }
+    if (!used && (udp_mux_isocket != -1))
+    {
+        w5100_command(udp_mux_isocket, W5100_CMD_CLOSE);
+        socket_free(udp_mux_isocket);
+        udp_mux_isocket = -1;
+    }
+}
+
+static
+int udp_mux_socket_create(void)
+{
+    int ivsock;
+    int fd = -1;
+
+    for (ivsock = 0; ivsock < W5100_UDP_MUX_N; ivsock++)
+    {
+        if (w5100_udp_vsockets[ivsock].fd == W5100_SOCKET_FREE)
+        {
+            break;
+        }
+    }
+    if (ivsock == W5100_UDP_MUX_N)
+    {
+        errno = ENFILE;
+    }
+    else if (udp_mux_open() != 0)
+    {
+        errno = ENOMEM;
+    }
+    else
+    {
+        fd = file_alloc();
+        if (fd == -1)
+        {
+            udp_mux_close_unused();
+            errno = ENFILE;
+        }
+        else
+        {
+            struct w5100_socket *s;
+
+            s = &w5100_udp_vsockets[ivsock];
+            s->isocket = -1;
+            sock_fields_init(s, SOCK_DGRAM);
+            s->fd = fd;
+            s->fd_data = fill_fd_struct(fd, s);
+        }
+    }
+    return fd;
+}
+
+static
+struct w5100_socket *udp_mux_owner(uint16_t port)
+{
+    struct w5100_socket *owner = NULL;
+    int i;
+
+    for (i = 0; (i < W5100_UDP_MUX_N) && (owner == NULL); i++)
+    {
+        struct w5100_socket *s = &w5100_udp_vsockets[i];
+
+        if (
+                (s->fd != W5100_SOCKET_FREE)
+                &&
+                (s->sockname.sin_family == AF_INET)
+                &&
+                (s->sockname.sin_port == port)
+           )
+        {
+            owner = s;
+        }
+    }
+    return owner;
+}
+
+/* Offset of the first parked datagram of ivsock, or -1. */
+static
+int udp_mux_park_find(int ivsock, struct udp_mux_record *rec)
+{
+    size_t offset = 0;
+    int found = -1;
+
+    while ((offset < udp_mux_park_used) && (found == -1))
+    {
+        memcpy(rec, &udp_mux_park[offset], sizeof(*rec));
+        if (rec->ivsock == ivsock)
+        {
+            found = offset;
+        }
+        else
+        {
+            offset += sizeof(*rec) + rec->len;
+        }
+    }
+    return found;
+}
+
+static
+void udp_mux_park_remove(size_t offset)
+{
+    struct udp_mux_record rec;
+    size_t rec_size;
+
+    memcpy(&rec, &udp_mux_park[offset], sizeof(rec));
+    rec_size = sizeof(rec) + rec.len;
+    memmove(
+            &udp_mux_park[offset],
+            &udp_mux_park[offset + rec_size],
+            udp_mux_park_used - offset - rec_size);
+    udp_mux_park_used -= rec_size;
+}
+
+static
+int udp_mux_close(struct w5100_socket *s)
+{
+    struct udp_mux_record rec;
+    int offset;
+
+    s->fd_data->isopen = 0;
+    file_free(s->fd_data->fd);
+    s->fd_data = NULL;
+    while ((offset = udp_mux_park_find(s - w5100_udp_vsockets, &rec)) != -1)
+    {
+        udp_mux_park_remove(offset);
+    }
+    s->fd = W5100_SOCKET_FREE;
+    s->state = W5100_SOCK_STATE_NONE;
+    s->sockname.sin_family = AF_UNSPEC;
+    udp_mux_close_unused();
+
+    return 0;
+}
+
+/* Describes the next datagram for s, without waiting. The datagrams
+ * for the other sockets that come before it are parked or dropped.
+ */
+static
+uint16_t udp_mux_view(struct w5100_socket *s, struct w5100_recv_view *view)
+{
+    struct w5100_socket *m;
+    struct udp_mux_record rec;
+    int ivsock;
+    int offset;
+
+    m = get_socket_from_isocket(udp_mux_isocket);
+    ivsock = s - w5100_udp_vsockets;
+    memset(view, 0, sizeof(*view));
+    view->isocket = s->isocket;
+
+    offset = udp_mux_park_find(ivsock, &rec);
+    if (offset != -1)
+    {
+        view->ram = &udp_mux_park[offset + sizeof(rec)];
+        view->len = rec.len;
+        view->header_len = sizeof(rec);
+    }
+    while ((offset == -1) && (view->header_len == 0))
+    {
+        uint16_t toread;
+        uint16_t pdata;
+        uint16_t ip_len;
+        uint16_t udp_len = 0;
+        uint8_t header[IPRAW_HEADER_SIZE + UDP_HEADER_SIZE];
+        struct w5100_socket *owner = NULL;
+
+        toread = sock_rx_len(m);
+        if (toread < IPRAW_HEADER_SIZE)
+        {
+            break;
+        }
+        view->pread = read_buf_pstart(m->isocket);
+        pdata = view->pread;
+        read_buf_sure(m->isocket, header, IPRAW_HEADER_SIZE, &pdata);
+        memcpy(&ip_len, &header[4], 2);
+        ip_len = ntohs(ip_len);
+        if (ip_len >= UDP_HEADER_SIZE)
+        {
+            uint16_t dport;
+
+            read_buf_sure(m->isocket, &header[IPRAW_HEADER_SIZE], UDP_HEADER_SIZE, &pdata);
+            memcpy(&udp_len, &header[IPRAW_HEADER_SIZE + 4], 2);
+            udp_len = ntohs(udp_len);
+            memcpy(&dport, &header[IPRAW_HEADER_SIZE + 2], 2);
+            if (udp_len == ip_len)
+            {
+                owner = udp_mux_owner(dport);
+            }
+        }
+        memcpy(&rec.addr, &header[0], 4);
+        memcpy(&rec.port, &header[IPRAW_HEADER_SIZE], 2);
+        rec.len = udp_len - UDP_HEADER_SIZE;
+        if (owner == s)
+        {
+            view->rx_avail = toread;
+            view->header_len = IPRAW_HEADER_SIZE + UDP_HEADER_SIZE;
+            recv_view_fill(m, view, pdata, rec.len);
+        }
+        else
+        {
+            if (
+                    (owner != NULL)
+                    &&
+                    (udp_mux_park_used + sizeof(rec) + rec.len <= sizeof(udp_mux_park))
+               )
+            {
+                rec.ivsock = owner - w5100_udp_vsockets;
+                memcpy(&udp_mux_park[udp_mux_park_used], &rec, sizeof(rec));
+                read_buf_sure(m->isocket, &udp_mux_park[udp_mux_park_used + sizeof(rec)], rec.len, &pdata);
+                udp_mux_park_used += sizeof(rec) + rec.len;
+            }
+            read_buf_recv(m, view->pread + IPRAW_HEADER_SIZE + ip_len);
+            sock_rx_consumed(m, toread, IPRAW_HEADER_SIZE + ip_len);
+        }
+    }
+    if (view->header_len != 0)
+    {
+        view->peer.sin_family = AF_INET;
+        view->peer.sin_addr.s_addr = rec.addr;
+        view->peer.sin_port = rec.port;
+    }
+    return view->len;
+}
+
+static
+void udp_mux_release(struct w5100_socket *s, const struct w5100_recv_view *view)
+{
+    if (view->ram != NULL)
+    {
+        struct udp_mux_record rec;
+        int offset;
+
+        offset = udp_mux_park_find(s - w5100_udp_vsockets, &rec);
+        if (offset != -1)
+        {
+            udp_mux_park_remove(offset);
+        }
+    }
+    else if (view->header_len != 0)
+    {
+        struct w5100_socket *m;
+        uint16_t nread;
+
+        m = get_socket_from_isocket(udp_mux_isocket);
+        nread = view->header_len + view->len;
+        read_buf_recv(m, view->pread + nread);
+        sock_rx_consumed(m, view->rx_avail, nread);
+    }
+    sock_rx_account(s, view->len);
+}
+
+/* Puts the UDP header before the payload of a datagram of s.
+ * Returns the length of mux_iov.
+ */
+static
+int udp_mux_iov(const struct w5100_socket *s, const struct sockaddr_in *peer,
+        const struct iovec *iov, int iovcnt, size_t len,
+        struct iovec *mux_iov, uint8_t *header)
+{
+    uint16_t udp_len;
+
+    udp_len = htons(UDP_HEADER_SIZE + len);
+    memcpy(&header[0], &s->sockname.sin_port, 2);
+    memcpy(&header[2], &peer->sin_port, 2);
+    memcpy(&header[4], &udp_len, 2);
+    header[6] = 0; /* no checksum */
+    header[7] = 0;
+    mux_iov[0].iov_base = header;
+    mux_iov[0].iov_len = UDP_HEADER_SIZE;
+    memcpy(&mux_iov[1], iov, iovcnt * sizeof(*iov));
+
+    return 1 + iovcnt;
+}
+
+#endif /* W5100_UDP_MUX */
+
+/* Waits for received data, up to timeout, and describes it.
+ * Returns the length of the view, or -1 and sets errno.
+ */
+static
+ssize_t sock_recv_view_wait(struct w5100_socket *s, struct w5100_recv_view *view, int nonblock,
+        const struct timespec *timeout)
+{
+    ssize_t ret;
+    struct timeout_manager tom;
+
+    if (!nonblock)
+    {
+        timeout_init(timeout, &tom);
+    }
+    do
+    {
+        sockets_keepalive_service();
+        ret = sock_recv_view(s, view);
+        if ((ret != 0) || (view->header_len != 0))
+        {
+            /* data, or an empty datagram */
+            break;
+        }
+        else if ((s->type == SOCK_STREAM) && (manage_disconnect(s) == -1))
+        {
+            ret = -1;
+            break;
+        }
+        else if (nonblock)
+        {
+            ret = -1;
+            errno = EAGAIN;
+            break;
+        }
+        else if (timeout_wait(&tom))
+        {
+            ret = -1;
+            break;
+        }
+    } while(1);
+
+    return ret;
+}
+
+ssize_t w5100_recv_acquire(int sockfd, struct w5100_recv_view *view)
+{
+    ssize_t ret;
+    struct w5100_socket *s;
+
+    s = get_socket_from_fd(sockfd);
+    if (s == NULL)
+    {
+        ret = -1;
+    }
+    else if (!sock_recv_state_ok(s))
+    {
+        errno = ENOTCONN;
+        ret = -1;
+    }
+    else
+    {
+        ret = sock_recv_view_wait(s, view, s->fd_data->status_flags & O_NONBLOCK, &s->recv_timeout);
+    }
+    return ret;
+}
+
+size_t w5100_recv_read(const struct w5100_recv_view *view, size_t offset, void *buf, size_t len)
+{
+    uint8_t *bytes = buf;
+    size_t nread = 0;
+    int iseg;
+
+    if (offset >= view->len)
+    {
+        len = 0;
+    }
+    else if (len > view->len - offset)
+    {
+        len = view->len - offset;
+    }
+    if (view->ram != NULL)
+    {
+        memcpy(bytes, &view->ram[offset], len);
+        nread = len;
+    }
+    for (iseg = 0; (iseg < 2) && (nread < len); iseg++)
+    {
+        const struct w5100_rx_segment *seg = &view->seg[iseg];
+
+        if (offset < seg->len)
+        {
+            size_t n;
+
+            n = seg->len - offset;
+            if (n > len - nread)
+            {
+                n = len - nread;
+            }
+            w5100_read_mem(seg->addr + offset, &bytes[nread], n);
+            nread += n;
+            offset = 0;
+        }
+        else
+        {
+            offset -= seg->len;
+        }
+    }
+    return nread;
+}
+
+static
+void recv_view_release(struct w5100_socket *s, const struct w5100_recv_view *view, size_t len)
+{
+#ifdef W5100_UDP_MUX
+    if (sock_is_vudp(s))
+    {
+        udp_mux_release(s, view);
+    }
+    else
+#endif
+    {
+        uint16_t nread;
+
+        if (s->type != SOCK_STREAM)
+        {
+            len = view->len;
+        }
+        else if (len > view->len)
+        {
+            len = view->len;
+        }
+        nread = view->header_len + len;
+        if (nread > 0)
+        {
+            read_buf_recv(s, view->pread + nread);
+            sock_rx_consumed(s, view->rx_avail, nread);
+            sock_rx_account(s, len);
+        }
+    }
+}
+
+/* Copies the view into len bytes of the I/O vector,
+ * after its first skip.
+ */
+static
+size_t recv_view_to_iov(const struct w5100_recv_view *view, const struct iovec *iov, int iovcnt, size_t skip, size_t len)
+{
+    size_t offset = 0;
+    int i;
+
+    for (i = 0; (i < iovcnt) && (offset < len); i++)
+    {
+        if (skip >= iov[i].iov_len)
+        {
+            skip -= iov[i].iov_len;
+        }
+        else
+        {
+            uint8_t *bytes = iov[i].iov_base;
+            size_t n;
+            size_t nread;
+
+            n = iov[i].iov_len - skip;
+            if (n > len - offset)
+            {
+                n = len - offset;
+            }
+            nread = w5100_recv_read(view, offset, &bytes[skip], n);
+            offset += nread;
+            skip = 0;
+            if (nread < n)
+            {
+                break;
+            }
+        }
+    }
+    return offset;
+}
+
+int w5100_recv_release(int sockfd, const struct w5100_recv_view *view, size_t len)
+{
+    int ret;
+    struct w5100_socket *s;
+
+    s = get_socket_from_fd(sockfd);
+    if (s == NULL)
+    {
+        ret = -1;
+    }
+    else if (s->isocket != view->isocket)
+    {
+        errno = EINVAL;
+        ret = -1;
+    }
+    else
+    {
+        recv_view_release(s, view, len);
+        ret = 0;
+    }
+    return ret;
+}
+
+ssize_t w5100_recv_stream(int sockfd, size_t len, w5100_recv_cb_t cb, void *arg)
+{
+    ssize_t ret;
+    struct w5100_recv_view view;
+
+    ret = w5100_recv_acquire(sockfd, &view);
+    if (ret >= 0)
+    {
+        uint8_t chunk[W5100_RECV_CHUNK];
+        size_t offset = 0;
+
+        if ((size_t)ret < len)
+        {
+            len = ret;
+        }
+        while (offset < len)
+        {
+            size_t n;
+
+            n = len - offset;
+            if (n > sizeof(chunk))
+            {
+                n = sizeof(chunk);
+            }
+            n = w5100_recv_read(&view, offset, chunk, n);
+            offset += n;
+            if (cb(chunk, n, arg) != 0)
+            {
+                break;
+            }
+        }
+        if (w5100_recv_release(sockfd, &view, offset) == 0)
+        {
+            ret = offset;
+        }
+        else
+        {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+static
+ssize_t send_stream(struct w5100_socket *s, const struct iovec *iov, int iovcnt, size_t len, int flags)
+{
+    ssize_t ret;
+    size_t towrite;
+    struct timeout_manager tom;
+    int nonblock;
+
+    if (flags & MSG_MORE)
+    {
+        s->tx_flags |= W5100_TX_MORE;
+    }
+    else
+    {
+        s->tx_flags &= ~W5100_TX_MORE;
+    }
+
+    nonblock = (s->fd_data->status_flags & O_NONBLOCK) || (flags & MSG_DONTWAIT);
+    towrite = len;
+    if (!nonblock)
+    {
+        timeout_init(&s->send_timeout, &tom);
+    }
+
+    ret = 0;
+    while (towrite > 0)
+    {
+        size_t written;
+
+        written = write_buf(s, iov, iovcnt, len - towrite, towrite);
+        if (written > 0)
+        {
+            towrite -= written;
+            if (nonblock)
+            {
+                break;
+            }
+        }
+        else if (manage_disconnect(s) == -1)
+        {
+            ret = -1;
+            break;
+        }
+        else if (nonblock)
+        {
+            errno = EAGAIN;
+            break;
+        }
+        else if (timeout_wait(&tom))
+        {
+            break;
+        }
+    }
+    if ((ret == 0) || (towrite < len))
+    {
+        ret = len - towrite;
+    }
+    if (len == 0)
+    {
+        /* an empty send without MSG_MORE pushes what was held */
+        sock_tx_service(s);
+    }
+    return ret;
+}
+
+/* The whole datagram is copied in TX memory and sent with one command. */
+static
+ssize_t send_dgram(struct w5100_socket *s, const struct iovec *iov, int iovcnt, size_t len, int flags,
+        const struct sockaddr_in *peer)
+{
+    ssize_t ret;
+    struct w5100_socket *hw;
+    size_t header_len = 0;
+#ifdef W5100_UDP_MUX
+    struct iovec mux_iov[1 + IOV_MAX];
+    uint8_t udp_header[UDP_HEADER_SIZE];
+#endif
+
+    check_bind_udp(s);
+    hw = sock_hw(s);
+#ifdef W5100_UDP_MUX
+    if (sock_is_vudp(s) && (peer != NULL))
+    {
+        iovcnt = udp_mux_iov(s, peer, iov, iovcnt, len, mux_iov, udp_header);
+        iov = mux_iov;
+        header_len = UDP_HEADER_SIZE;
+    }
+#endif
+
+    if (len + header_len > get_tx_size(hw->isocket))
+    {
+        errno = EMSGSIZE;
+        ret = -1;
+    }
+    else if (peer == NULL)
+    {
+        errno = EDESTADDRREQ;
+        ret = -1;
+    }
+    else if ((peer->sin_addr.s_addr == INADDR_BROADCAST) && !s->can_broadcast)
+    {
+        errno = EINVAL;
+        ret = -1;
+    }
+    else
+    {
+        struct timeout_manager tom;
+        int nonblock;
+
+        nonblock = (s->fd_data->status_flags & O_NONBLOCK) || (flags & MSG_DONTWAIT);
+        if (!nonblock)
+        {
+            timeout_init(&s->send_timeout, &tom);
+        }
+        do
+        {
+            if (sock_tx_free(hw) >= len + header_len)
+            {
+                w5100_write_sock_regx(W5100_Sn_DIPR, hw->isocket, &peer->sin_addr.s_addr);
+                w5100_write_sock_regx(W5100_Sn_DPORT, hw->isocket, &peer->sin_port);
+
+                ret = write_buf(hw, iov, iovcnt, 0, len + header_len) - header_len;
+                if (hw != s)
+                {
+                    s->counters.send_commands++;
+                    s->counters.bytes_sent += ret;
+                }
+                break;
+            }
+            else if (nonblock)
+            {
+                errno = EAGAIN;
+                ret = -1;
+                break;
+            }
+            else if (timeout_wait(&tom))
+            {
+                ret = -1;
+                break;
+            }
+        } while(1);
+    }
+    return ret;
+}
+
+ssize_t send(int sockfd, const void *buf, size_t len, int flags)
+{
+    ssize_t ret;
+    struct w5100_socket *s;
+
+    s = get_socket_from_fd(sockfd);
+    if (s == NULL)
+    {
+        ret = -1;
+    }
+    else if (s->type == SOCK_DGRAM)
+    {
+        if (s->dest_address.sin_family == AF_UNSPEC)
+        {
+            errno = EDESTADDRREQ;
+            ret = -1;
+        }
+        else
+        {
+            ret = sendto(sockfd, buf, len, flags, (const struct sockaddr *)&s->dest_address, sizeof(s->dest_address));
+        }
+    }
+    else if (s->type != SOCK_STREAM) /* RAW */
+    {
+        errno = EDESTADDRREQ;
+        ret = -1;
+    }
+    else if (
+            (s->state != W5100_SOCK_STATE_ACCEPTED)
             &&
             (s->state != W5100_SOCK_STATE_CONNECTED)
             )
     {
-        errno = ENOTCONN;
-        ret = 1;
+        errno = ENOTCONN;
+        ret = 1;
+    }
+    else
+    {
+        struct iovec iov;
+
+        iov.iov_base = (void *)buf;
+        iov.iov_len = len;
+        ret = send_stream(s, &iov, 1, len, flags);
+    }
+    return ret;
+}
+
+ssize_t sendto(int sockfd, const void *buf, size_t len, int flags,
+        const struct sockaddr *dest_address, socklen_t dest_len)
+{
+    ssize_t ret;
+    struct w5100_socket *s;
+
+    s = get_socket_from_fd(sockfd);
+    if (s == NULL)
+    {
+        ret = -1;
+    }
+    else if (s->type == SOCK_STREAM)
+    {
+        (void)dest_address; /* ignore */
+        (void)dest_len; /* ignore */
+        ret = send(sockfd, buf, len, flags);
+    }
+    else if (s->type == SOCK_DGRAM)
+    {
+        struct iovec iov;
+
+        iov.iov_base = (void *)buf;
+        iov.iov_len = len;
+        ret = send_dgram(s, &iov, 1, len, flags, (const struct sockaddr_in *)dest_address);
+    }
+    else /* TODO: RAW */
+    {
+        errno = EBADF;
+        ret = -1;
+    }
+    return ret;
+}
+
+static
+ssize_t sock_sendmsg(struct w5100_socket *s, const struct msghdr *msg, int flags)
+{
+    ssize_t ret;
+    ssize_t len;
+
+    len = iov_len_get(msg->msg_iov, msg->msg_iovlen);
+    if (len < 0)
+    {
+        errno = EINVAL;
+        ret = -1;
+    }
+    else if (s->type == SOCK_STREAM)
+    {
+        if (
+                (s->state != W5100_SOCK_STATE_ACCEPTED)
+                &&
+                (s->state != W5100_SOCK_STATE_CONNECTED)
+                )
+        {
+            errno = ENOTCONN;
+            ret = -1;
+        }
+        else
+        {
+            ret = send_stream(s, msg->msg_iov, msg->msg_iovlen, len, flags);
+        }
+    }
+    else if (s->type == SOCK_DGRAM)
+    {
+        const struct sockaddr_in *peer;
+
+        if (msg->msg_name != NULL)
+        {
+            peer = msg->msg_name;
+        }
+        else if (s->dest_address.sin_family != AF_UNSPEC)
+        {
+            peer = &s->dest_address;
+        }
+        else
+        {
+            peer = NULL;
+        }
+        ret = send_dgram(s, msg->msg_iov, msg->msg_iovlen, len, flags, peer);
+    }
+    else /* TODO: RAW */
+    {
+        errno = EBADF;
+        ret = -1;
+    }
+    return ret;
+}
+
+ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags)
+{
+    ssize_t ret;
+    struct w5100_socket *s;
+
+    s = get_socket_from_fd(sockfd);
+    if (s == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        ret = sock_sendmsg(s, msg, flags);
+    }
+    return ret;
+}
+
+/* Sends the messages in order, stopping at the first error.
+ * On a stream, all but the last are sent with MSG_MORE, so that they
+ * go out with as few SEND commands as possible. A datagram always
+ * takes its own SEND command on the W5100.
+ */
+int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+    int ret;
+    struct w5100_socket *s;
+
+    s = get_socket_from_fd(sockfd);
+    if (s == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        unsigned int count;
+
+        for (count = 0; count < vlen; count++)
+        {
+            ssize_t sent;
+            int msg_flags;
+
+            msg_flags = flags;
+            if ((s->type == SOCK_STREAM) && (count + 1 < vlen))
+            {
+                msg_flags |= MSG_MORE;
+            }
+            sent = sock_sendmsg(s, &msgvec[count].msg_hdr, msg_flags);
+            if (sent < 0)
+            {
+                break;
+            }
+            msgvec[count].msg_len = sent;
+        }
+        if ((count > 0) || (vlen == 0))
+        {
+            ret = count;
+        }
+        else
+        {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+/* Copies one received message into msg: a datagram, or the first
+ * bytes of a stream. Returns the bytes copied.
+ */
+static
+size_t recv_view_to_msg(const struct w5100_socket *s, const struct w5100_recv_view *view,
+        struct msghdr *msg, size_t len)
+{
+    size_t nread;
+
+    nread = recv_view_to_iov(view, msg->msg_iov, msg->msg_iovlen, 0, len);
+    msg->msg_flags = 0;
+    msg->msg_controllen = 0;
+    if (s->type == SOCK_STREAM)
+    {
+        if (msg->msg_name != NULL)
+        {
+            msg->msg_namelen = 0;
+        }
+    }
+    else
+    {
+        if (nread < view->len)
+        {
+            msg->msg_flags |= MSG_TRUNC;
+        }
+        if (msg->msg_name != NULL)
+        {
+            if (msg->msg_namelen > (socklen_t)sizeof(view->peer))
+            {
+                msg->msg_namelen = sizeof(view->peer);
+            }
+            memcpy(msg->msg_name, &view->peer, msg->msg_namelen);
+        }
     }
-    else if (
-            (s->type == SOCK_DGRAM)
-            &&
-            (s->state != W5100_SOCK_STATE_BOUND)
-            &&
-            (s->state != W5100_SOCK_STATE_CREATED)
-            )
+    return nread;
+}
+
+/* Receive engine for recv, recvfrom and recvmsg.
+ * msg_name, if any, is filled only for datagrams.
+ */
+static
+ssize_t sock_recvmsg(struct w5100_socket *s, struct msghdr *msg, size_t len, int flags)
+{
+    ssize_t ret;
+
+    msg->msg_flags = 0;
+    msg->msg_controllen = 0;
+    if (!sock_recv_state_ok(s))
     {
         errno = ENOTCONN;
-        ret = 1;
+        ret = -1;
     }
     else if (len == 0)
     {
@@ -1110,8 +3877,10 @@ ssize_t recvfrom(int sockfd, void *__restrict buf, size_t len, int flags,
     {
         struct timeout_manager tom;
         int nonblock;
+        int datagram = 0;
+        size_t total = 0;
 
-        nonblock = s->fd_data->status_flags & O_NONBLOCK;
+        nonblock = (s->fd_data->status_flags & O_NONBLOCK) || (flags & MSG_DONTWAIT);
 
         if (!nonblock)
         {
@@ -1119,325 +3888,628 @@ ssize_t recvfrom(int sockfd, void *__restrict buf, size_t len, int flags,
         }
         do
         {
-            if (s->type == SOCK_STREAM)
+            struct w5100_recv_view view;
+
+            if ((sock_recv_view(s, &view) != 0) || (view.header_len != 0))
             {
-                uint16_t nread;
+                size_t nread;
 
-                nread = read_buf(s->isocket, buf, len);
-                if (nread != 0)
+                if (s->type != SOCK_STREAM)
                 {
-                    (void)address; /* TODO: fill */
-                    (void)address_len; /* TODO: fill */
-                    ret = nread;
+                    datagram = 1;
+                    total = recv_view_to_msg(s, &view, msg, len);
+                    if (!(flags & MSG_PEEK))
+                    {
+                        recv_view_release(s, &view, total);
+                    }
                     break;
                 }
-                else if (manage_disconnect(s) == -1)
+                if (flags & MSG_PEEK)
                 {
-                    /* TODO: return 0 on orderly shutdown */
-                    ret = -1;
-                    break;
+                    /* always from the start, nothing is consumed */
+                    total = 0;
                 }
-            }
-            else if (s->type == SOCK_DGRAM)
-            {
-                uint16_t toread;
-                uint8_t header[8];
-
-                toread = read_buf_len(s->isocket);
-
-                if (toread >= sizeof(header))
+                nread = recv_view_to_iov(&view, msg->msg_iov, msg->msg_iovlen, total, len - total);
+                total += nread;
+                if (!(flags & MSG_PEEK))
+                {
+                    recv_view_release(s, &view, nread);
+                }
+                if (!(flags & MSG_WAITALL) || (total == len))
                 {
-                    uint16_t pread;
-                    uint16_t msg_len;
-
-                    pread = read_buf_pstart(s->isocket);
-                    read_buf_sure(s->isocket, header, sizeof(header), &pread);
-                    if ((address != NULL) && (address_len != NULL))
-                    {
-                        struct sockaddr_in *peer;
-                        /* TODO: check address_len in input and truncate in case */
-                        
-                        peer = (struct sockaddr_in *)address;
-                        memcpy(&peer->sin_addr.s_addr, &header[0], 4);
-                        memcpy(&peer->sin_port, &header[4], 2);
-                        *address_len = sizeof(struct sockaddr_in);
-                    }
-                    memcpy(&msg_len, &header[6], 2);
-                    msg_len = ntohs(msg_len);
-                    read_buf_sure(s->isocket, buf, msg_len, &pread);
-                    read_buf_recv(s->isocket, pread);
-                    ret = msg_len;
                     break;
                 }
             }
+            else if ((s->type == SOCK_STREAM) && (manage_disconnect(s) == -1))
+            {
+                /* TODO: return 0 on orderly shutdown */
+                break;
+            }
             if (nonblock)
             {
-                ret = -1;
                 errno = EAGAIN;
                 break;
             }
-            else if (timeout_ended(&tom))
+            else if (timeout_wait(&tom))
             {
-                ret = -1;
                 break;
             }
         } while(1);
+
+        if ((total > 0) || datagram)
+        {
+            ret = total;
+        }
+        else
+        {
+            ret = -1;
+        }
+        if ((s->type == SOCK_STREAM) && (msg->msg_name != NULL))
+        {
+            msg->msg_namelen = 0;
+        }
     }
     return ret;
 }
 
-ssize_t send(int sockfd, const void *buf, size_t len, int flags)
+ssize_t recvfrom(int sockfd, void *__restrict buf, size_t len, int flags,
+        struct sockaddr *__restrict address, socklen_t *__restrict address_len)
 {
     ssize_t ret;
     struct w5100_socket *s;
 
-    (void)flags; /* TODO */
-
     s = get_socket_from_fd(sockfd);
     if (s == NULL)
     {
         ret = -1;
     }
-    else if (s->type == SOCK_DGRAM)
+    else
     {
-        if (s->dest_address.sin_family == AF_UNSPEC)
+        struct msghdr msg;
+        struct iovec iov;
+
+        iov.iov_base = buf;
+        iov.iov_len = len;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if ((address != NULL) && (address_len != NULL))
         {
-            errno = EDESTADDRREQ;
-            ret = -1;
+            msg.msg_name = address;
+            msg.msg_namelen = *address_len;
         }
-        else
+        ret = sock_recvmsg(s, &msg, len, flags);
+        if ((ret >= 0) && (msg.msg_name != NULL) && (s->type != SOCK_STREAM))
         {
-            ret = sendto(sockfd, buf, len, flags, (const struct sockaddr *)&s->dest_address, sizeof(s->dest_address));
+            *address_len = msg.msg_namelen;
         }
     }
-    else if (s->type != SOCK_STREAM) /* RAW */
+    return ret;
+}
+
+ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags)
+{
+    ssize_t ret;
+    ssize_t len;
+    struct w5100_socket *s;
+
+    s = get_socket_from_fd(sockfd);
+    len = iov_len_get(msg->msg_iov, msg->msg_iovlen);
+    if (s == NULL)
     {
-        errno = EDESTADDRREQ;
         ret = -1;
     }
-    else if (
-            (s->state != W5100_SOCK_STATE_ACCEPTED)
-            &&
-            (s->state != W5100_SOCK_STATE_CONNECTED)
-            )
+    else if (len < 0)
+    {
+        errno = EINVAL;
+        ret = -1;
+    }
+    else
+    {
+        ret = sock_recvmsg(s, msg, len, flags);
+    }
+    return ret;
+}
+
+/* Takes the first message like recvmsg, waiting at most timeout if
+ * given, then the ones already received, without waiting more
+ * (MSG_WAITFORONE is always implied).
+ * Datagrams already in the RX memory are read one after the other and
+ * given back to the W5100 with a single RECV command.
+ */
+int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags, struct timespec *timeout)
+{
+    int ret;
+    struct w5100_socket *s;
+
+    s = get_socket_from_fd(sockfd);
+    if (s == NULL)
+    {
+        ret = -1;
+    }
+    else if (!sock_recv_state_ok(s))
     {
         errno = ENOTCONN;
-        ret = 1;
+        ret = -1;
+    }
+    else if (vlen == 0)
+    {
+        ret = 0;
     }
     else
     {
-        size_t towrite;
-        struct timeout_manager tom;
-        const uint8_t *bytes;
+        struct w5100_recv_view view;
+        unsigned int count = 0;
         int nonblock;
 
-        nonblock = s->fd_data->status_flags & O_NONBLOCK;
-        towrite = len;
-        bytes = buf;
-        if (!nonblock)
+        nonblock = (s->fd_data->status_flags & O_NONBLOCK) || (flags & MSG_DONTWAIT);
+        if (timeout == NULL)
         {
-            timeout_init(&s->send_timeout, &tom);
+            timeout = &s->recv_timeout;
         }
-
-        while (towrite > 0)
+        if (sock_recv_view_wait(s, &view, nonblock, timeout) >= 0)
         {
-            size_t written;
+            struct w5100_recv_view done;
+            size_t done_len = 0;
+            int held = 0; /* done is consumed, but not released yet */
+            int more;
 
-            written = write_buf(s->isocket, bytes, towrite);
-            if (written > 0)
+            do
             {
-                bytes += written;
-                towrite -= written;
-                if (nonblock)
+                struct msghdr *msg;
+                ssize_t len;
+                size_t nread;
+
+                msg = &msgvec[count].msg_hdr;
+                len = iov_len_get(msg->msg_iov, msg->msg_iovlen);
+                if (len < 0)
                 {
+                    errno = EINVAL;
                     break;
                 }
-            }
-            else if (manage_disconnect(s) == -1)
-            {
-                ret = -1;
-                break;
-            }
-            else if (nonblock)
-            {
-                errno = EAGAIN;
-                break;
-            }
-            else if (timeout_ended(&tom))
+                nread = recv_view_to_msg(s, &view, msg, len);
+                msgvec[count].msg_len = nread;
+                count++;
+                more = (count < vlen) && !(flags & MSG_PEEK);
+                if (!(flags & MSG_PEEK))
+                {
+                    done = view;
+                    done_len = nread;
+                    held = 1;
+                    if (more && sock_recv_view_next(s, &view))
+                    {
+                        sock_rx_account(s, done.len);
+                    }
+                    else
+                    {
+                        recv_view_release(s, &done, done_len);
+                        held = 0;
+                        more = more && ((sock_recv_view(s, &view) != 0) || (view.header_len != 0));
+                    }
+                }
+            } while (more);
+            if (held)
             {
-                break;
+                recv_view_release(s, &done, done_len);
             }
         }
-        ret = len - towrite;
+        if (count > 0)
+        {
+            ret = count;
+        }
+        else
+        {
+            ret = -1;
+        }
     }
     return ret;
 }
 
-ssize_t sendto(int sockfd, const void *buf, size_t len, int flags,
-        const struct sockaddr *dest_address, socklen_t dest_len)
+static
+short w5100_sock_poll_rw(struct w5100_socket *s)
 {
-    ssize_t ret;
+    short ret;
+    uint16_t toread;
+    uint16_t towrite;
+
+    ret = 0;
+#ifdef W5100_UDP_MUX
+    if (sock_is_vudp(s))
+    {
+        struct w5100_recv_view view;
+
+        toread = udp_mux_view(s, &view);
+        if (view.header_len != 0)
+        {
+            /* also an empty datagram */
+            ret |= POLLRDNORM|POLLIN;
+        }
+    }
+    else
+#endif
+    {
+        toread = sock_rx_len(s);
+    }
+    towrite = sock_tx_free(sock_hw(s));
+
+    if (toread > 0)
+    {
+        ret |= POLLRDNORM|POLLIN;
+    }
+    if (towrite > 0)
+    {
+        ret |= POLLWRNORM|POLLOUT;
+    }
+
+    return ret;
+}
+
+static
+short w5100_sock_poll(int fd)
+{
+    int ret;
     struct w5100_socket *s;
 
-    s = get_socket_from_fd(sockfd);
+    sockets_service();
+    s = get_socket_from_fd(fd);
     if (s == NULL)
     {
-        ret = -1;
+        ret = POLLNVAL;
     }
-    else if (s->type == SOCK_STREAM)
+    else if (sock_is_listener_fd(s, fd))
     {
-        (void)dest_address; /* ignore */
-        (void)dest_len; /* ignore */
-        ret = send(sockfd, buf, len, flags);
+        if (pool_established(s) != NULL)
+        {
+            ret = POLLRDNORM|POLLIN;
+        }
+        else
+        {
+            ret = 0;
+        }
+    }
+    else if (s->state == W5100_SOCK_STATE_CONNECTING)
+    {
+        /* still connecting after get_socket_from_fd */
+        ret = 0;
+    }
+    else if (
+            (s->state == W5100_SOCK_STATE_CLOSING)
+            ||
+            (s->state == W5100_SOCK_STATE_DISCONNECTED)
+            ||
+            (s->state == W5100_SOCK_STATE_LISTENING)
+            )
+    {
+        /* a connection that is over */
+        ret = POLLHUP;
+    }
+    else if ((s->type == SOCK_STREAM) && (s->error != 0))
+    {
+        /* connect failed */
+        ret = POLLOUT|POLLERR;
+    }
+    else if (
+                (s->type == SOCK_STREAM) &&
+                (
+                    (s->state == W5100_SOCK_STATE_CONNECTED) ||
+                    (s->state == W5100_SOCK_STATE_ACCEPTED)
+                )
+            )
+    {
+        uint8_t sr;
+
+        if (sock_events_update(s) & (W5100_INT_DISCON|W5100_INT_TIMEOUT))
+        {
+            sr = w5100_read_sock_reg(W5100_Sn_SR, s->isocket);
+        }
+        else
+        {
+            sr = W5100_SOCK_ESTABLISHED;
+        }
+
+        if (sr != W5100_SOCK_ESTABLISHED)
+        {
+            ret = POLLHUP;
+        }
+        else
+        {
+            ret = w5100_sock_poll_rw(s);
+        }
+    }
+    else if (
+                (s->type == SOCK_DGRAM) &&
+                (
+                    (s->state == W5100_SOCK_STATE_CONNECTED) ||
+                    (s->state == W5100_SOCK_STATE_BOUND)
+                )
+            )
+    {
+        ret = w5100_sock_poll_rw(s);
+    }
+    else
+    {
+        ret = POLLNVAL;
+    }
+
+    return ret;
+}
+
+static
+int w5100_sock_fstat(int fd, struct stat *buf)
+{
+    (void)fd;
+    buf->st_blksize = 1024;
+
+    return 0;
+}
+
+static
+int set_buf_size(struct w5100_socket *s, struct w5100_mem_split *split, int value)
+{
+    int ret;
+
+    if (sock_is_vudp(s))
+    {
+        /* the memory of the shared socket stays as it is */
+        errno = EOPNOTSUPP;
+        ret = -1;
+    }
+    else if (
+            (s->state != W5100_SOCK_STATE_CREATED)
+            &&
+            !((s->type == SOCK_STREAM) && (s->state == W5100_SOCK_STATE_BOUND))
+       )
+    {
+        /* memory is already in use */
+        errno = EISCONN;
+        ret = -1;
     }
-    else if (s->type == SOCK_DGRAM)
+    else
     {
-        const struct sockaddr_in *peer;
-
-        check_bind_udp(s);
-        peer = (struct sockaddr_in *)dest_address;
+        uint16_t size;
 
-        if (len > get_tx_size(s->isocket))
+        size = W5100_SOCK_MEM_MIN;
+        while ((size < value) && (size < W5100_SOCK_MEM_MAX))
         {
-            errno = EMSGSIZE;
-            ret = -1;
-        }
-        else if (dest_address == NULL)
-        {
-            errno = EDESTADDRREQ;
-            ret = -1;
+            size <<= 1;
         }
-        else if ((peer->sin_addr.s_addr == INADDR_BROADCAST) && !s->can_broadcast)
+        if (mem_split_resize(split, s->isocket, size) != 0)
         {
-            errno = EINVAL;
+            errno = ENOBUFS;
             ret = -1;
         }
         else
         {
-            struct timeout_manager tom;
-            int nonblock;
-
-            nonblock = s->fd_data->status_flags & O_NONBLOCK;
-            if (!nonblock)
-            {
-                timeout_init(&s->send_timeout, &tom);
-            }
-            do
+            mem_split_apply();
+            if (s->state == W5100_SOCK_STATE_BOUND)
             {
-                if (write_buf_len(s->isocket) >= len)
-                {
-                    w5100_write_sock_regx(W5100_Sn_DIPR, s->isocket, &peer->sin_addr.s_addr);
-                    w5100_write_sock_regx(W5100_Sn_DPORT, s->isocket, &peer->sin_port);
+                uint8_t sr;
 
-                    ret = write_buf(s->isocket, buf, len);
-                    break;
-                }
-                else if (nonblock)
-                {
-                    errno = EAGAIN;
-                    ret = 1;
-                    break;
-                }
-                else if (timeout_ended(&tom))
-                {
-                    ret = -1;
-                    break;
-                }
-            } while(1); /* TODO: non blocking */
+                /* open again to use the new memory */
+                w5100_command(s->isocket, W5100_CMD_CLOSE);
+                w5100_command(s->isocket, W5100_CMD_OPEN);
+                do {
+                    sr = w5100_read_sock_reg(W5100_Sn_SR, s->isocket);
+                } while (sr != W5100_SOCK_INIT);
+            }
+            ret = 0;
         }
     }
-    else /* TODO: RAW */
+
+    return ret;
+}
+
+static
+int set_tcp_keepalive(struct w5100_socket *s, int option_name, int value)
+{
+    int ret;
+
+    if ((value < 1) || (value > UINT16_MAX))
     {
-        errno = EBADF;
+        errno = EINVAL;
         ret = -1;
     }
+    else
+    {
+        switch (option_name)
+        {
+            case TCP_KEEPIDLE:
+                s->keepalive.idle = value;
+                break;
+            case TCP_KEEPINTVL:
+                s->keepalive.intvl = value;
+                break;
+            default: /* TCP_KEEPCNT */
+                s->keepalive.cnt = value;
+                break;
+        }
+        ret = 0;
+    }
     return ret;
 }
 
 static
-short w5100_sock_poll_rw(int isocket)
+int set_tcp_retry(struct w5100_socket *s, int option_name, int value)
 {
-    short ret;
-    uint16_t toread;
-    uint16_t towrite;
-
-    toread = read_buf_len(isocket);
-    towrite = write_buf_len(isocket);
+    int ret;
 
-    ret = 0;
-    if (toread > 0)
+    if (value < 0)
     {
-        ret |= POLLRDNORM|POLLIN;
+        errno = EINVAL;
+        ret = -1;
     }
-    if (towrite > 0)
+    else if ((option_name == TCP_SYNCNT) && ((value < 1) || (value > UINT8_MAX)))
     {
-        ret |= POLLWRNORM|POLLOUT;
+        errno = EINVAL;
+        ret = -1;
+    }
+    else
+    {
+        switch (option_name)
+        {
+            case TCP_SYNCNT:
+                s->retry.syncnt = value;
+                break;
+            case TCP_USER_TIMEOUT:
+                s->retry.user_timeout = value;
+                break;
+            default: /* TCP_RTO_ADAPTIVE */
+                s->retry.adaptive = (value != 0);
+                break;
+        }
+        sock_retry_update(s);
+        ret = 0;
     }
-
     return ret;
 }
 
 static
-short w5100_sock_poll(int fd)
+int set_tcp_option(struct w5100_socket *s, int option_name, const void *option_value)
 {
     int ret;
-    struct w5100_socket *s;
+    uint8_t flag;
 
-    s = get_socket_from_fd(fd);
-    if (s == NULL)
+    switch (option_name)
     {
-        ret = POLLNVAL;
+        case TCP_NODELAY:
+            flag = W5100_TX_NODELAY;
+            break;
+        case TCP_CORK:
+            flag = W5100_TX_CORK;
+            break;
+        default:
+            flag = 0;
+            break;
     }
-    else if(s->state == W5100_SOCK_STATE_LISTENING)
+    if (s->type != SOCK_STREAM)
     {
-        uint8_t sr;
-
-        sr = w5100_read_sock_reg(W5100_Sn_SR, s->isocket);
-        if (sr == W5100_SOCK_ESTABLISHED)
-        {
-            ret = POLLRDNORM|POLLIN;
-        }
-        else
-        {
-            ret = 0;
-        }
+        errno = EINVAL;
+        ret = -1;
     }
     else if (
-                (s->type == SOCK_STREAM) &&
-                (
-                    (s->state == W5100_SOCK_STATE_CONNECTED) ||
-                    (s->state == W5100_SOCK_STATE_ACCEPTED)
-                )
+            (option_name == TCP_KEEPIDLE)
+            ||
+            (option_name == TCP_KEEPINTVL)
+            ||
+            (option_name == TCP_KEEPCNT)
             )
     {
-        uint8_t sr;
-
-        sr = w5100_read_sock_reg(W5100_Sn_SR, s->isocket);
-
-        if (sr != W5100_SOCK_ESTABLISHED)
+        ret = set_tcp_keepalive(s, option_name, *(const int *)option_value);
+    }
+    else if (
+            (option_name == TCP_SYNCNT)
+            ||
+            (option_name == TCP_USER_TIMEOUT)
+            ||
+            (option_name == TCP_RTO_ADAPTIVE)
+            )
+    {
+        ret = set_tcp_retry(s, option_name, *(const int *)option_value);
+    }
+    else if (flag == 0)
+    {
+        errno = EINVAL;
+        ret = -1;
+    }
+    else
+    {
+        if (*(const int *)option_value)
         {
-            ret = POLLHUP;
+            s->tx_flags |= flag;
         }
         else
         {
-            ret = w5100_sock_poll_rw(s->isocket);
+            s->tx_flags &= ~flag;
         }
+        /* setting TCP_NODELAY or clearing TCP_CORK pushes held data */
+        sock_tx_service(s);
+        ret = 0;
     }
-    else if (
-                (s->type == SOCK_DGRAM) &&
-                (
-                    (s->state == W5100_SOCK_STATE_CONNECTED) ||
-                    (s->state == W5100_SOCK_STATE_BOUND)
-                )
-            )
+    return ret;
+}
+
+static
+void sock_info_get(struct w5100_socket *s, struct tcp_info *info)
+{
+    struct w5100_socket *hw;
+
+    hw = sock_hw(s);
+    memset(info, 0, sizeof(*info));
+    info->tcpi_state = w5100_read_sock_reg(W5100_Sn_SR, hw->isocket);
+    if (s->type == SOCK_STREAM)
+    {
+        w5100_read_sock_regx(W5100_Sn_MSSR, hw->isocket, &info->tcpi_snd_mss);
+        info->tcpi_snd_mss = ntohs(info->tcpi_snd_mss);
+    }
+    info->tcpi_bytes_sent = s->counters.bytes_sent;
+    info->tcpi_bytes_received = s->counters.bytes_received;
+    info->tcpi_segs_out = s->counters.send_commands;
+    info->tcpi_recv_cmds = s->counters.recv_commands;
+    info->tcpi_timeouts = s->counters.timeouts;
+    info->tcpi_spi_frames = w5100_spi_sock_frames(hw->isocket) - s->counters.spi_frames_start;
+    info->tcpi_rto = hw->retry.rtr * 100UL;
+    info->tcpi_rtt = hw->retry.srtt;
+    info->tcpi_rttvar = hw->retry.rttvar;
+    info->tcpi_retries = hw->retry.rcr;
+}
+
+static
+int get_tcp_option(struct w5100_socket *s, int option_name, void *option_value)
+{
+    int ret;
+
+    if (option_name == TCP_INFO)
+    {
+        sock_info_get(s, option_value);
+        ret = 0;
+    }
+    else if (s->type != SOCK_STREAM)
     {
-        ret = w5100_sock_poll_rw(s->isocket);
+        errno = EINVAL;
+        ret = -1;
     }
     else
     {
-        ret = POLLNVAL;
+        switch (option_name)
+        {
+            case TCP_NODELAY:
+                *(int *)option_value = ((s->tx_flags & W5100_TX_NODELAY) != 0);
+                ret = 0;
+                break;
+            case TCP_CORK:
+                *(int *)option_value = ((s->tx_flags & W5100_TX_CORK) != 0);
+                ret = 0;
+                break;
+            case TCP_KEEPIDLE:
+                *(int *)option_value = s->keepalive.idle;
+                ret = 0;
+                break;
+            case TCP_KEEPINTVL:
+                *(int *)option_value = s->keepalive.intvl;
+                ret = 0;
+                break;
+            case TCP_KEEPCNT:
+                *(int *)option_value = s->keepalive.cnt;
+                ret = 0;
+                break;
+            case TCP_SYNCNT:
+                *(int *)option_value = (s->retry.syncnt != 0) ? s->retry.syncnt : s->retry.rcr;
+                ret = 0;
+                break;
+            case TCP_USER_TIMEOUT:
+                *(int *)option_value = s->retry.user_timeout;
+                ret = 0;
+                break;
+            case TCP_RTO_ADAPTIVE:
+                *(int *)option_value = s->retry.adaptive;
+                ret = 0;
+                break;
+            default:
+                errno = EINVAL;
+                ret = -1;
+                break;
+        }
     }
-
     return ret;
 }
 
@@ -1451,6 +4523,10 @@ int setsockopt(int sockfd, int level, int option_name, const void *option_value,
     {
         ret = -1;
     }
+    else if (level == IPPROTO_TCP)
+    {
+        ret = set_tcp_option(s, option_name, option_value);
+    }
     else if (level != SOL_SOCKET)
     {
         ret = -1;
@@ -1474,6 +4550,25 @@ int setsockopt(int sockfd, int level, int option_name, const void *option_value,
                 timeval_to_timespec((const struct timeval *)option_value, &s->send_timeout);
                 ret = 0;
                 break;
+            case SO_RCVBUF:
+                ret = set_buf_size(s, &w5100_rx_split, *(const int *)option_value);
+                break;
+            case SO_SNDBUF:
+                ret = set_buf_size(s, &w5100_tx_split, *(const int *)option_value);
+                break;
+            case SO_LINGER:
+                s->linger = *(const struct linger *)option_value;
+                ret = 0;
+                break;
+            case SO_KEEPALIVE:
+                s->keepalive.enabled = ((*(const int *)option_value) != 0);
+                if (s->keepalive.enabled)
+                {
+                    keepalive_used = 1;
+                    sock_keepalive_restart(s);
+                }
+                ret = 0;
+                break;
             default:
                 ret = -1;
                 errno = EINVAL;
@@ -1494,6 +4589,10 @@ int getsockopt(int sockfd, int level, int option_name, void *__restrict option_v
     {
         ret = -1;
     }
+    else if (level == IPPROTO_TCP)
+    {
+        ret = get_tcp_option(s, option_name, option_value);
+    }
     else if (level != SOL_SOCKET)
     {
         ret = -1;
@@ -1512,6 +4611,11 @@ int getsockopt(int sockfd, int level, int option_name, void *__restrict option_v
             case SO_BROADCAST:
                 ret = 0;
                 break;
+            case SO_ERROR:
+                *(int *)option_value = s->error;
+                s->error = 0;
+                ret = 0;
+                break;
             case SO_RCVTIMEO:
                 timespec_to_timeval(&s->recv_timeout, (struct timeval *)option_value);
                 ret = 0;
@@ -1520,10 +4624,26 @@ int getsockopt(int sockfd, int level, int option_name, void *__restrict option_v
                 timespec_to_timeval(&s->send_timeout, (struct timeval *)option_value);
                 ret = 0;
                 break;
+            case SO_RCVBUF:
+                *(int *)option_value = get_rx_size(sock_hw(s)->isocket);
+                ret = 0;
+                break;
+            case SO_SNDBUF:
+                *(int *)option_value = get_tx_size(sock_hw(s)->isocket);
+                ret = 0;
+                break;
             case SO_TYPE:
                 *(int *)option_value = s->type;
                 ret = 0;
                 break;
+            case SO_LINGER:
+                *(struct linger *)option_value = s->linger;
+                ret = 0;
+                break;
+            case SO_KEEPALIVE:
+                *(int *)option_value = s->keepalive.enabled;
+                ret = 0;
+                break;
             default:
                 ret = -1;
                 errno = EINVAL;
@@ -1621,6 +4741,138 @@ int getpeername(
     return ret;
 }
 
+void w5100_socket_stats_get(struct w5100_socket_stats *stats)
+{
+    *stats = socket_stats;
+}
+
+void w5100_socket_stats_reset(void)
+{
+    memset(&socket_stats, 0, sizeof(socket_stats));
+}
+
+/* snprintf at position len of a report that may not fit in buf. */
+static
+int proc_printf(char *buf, size_t size, int len, const char *format, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, format);
+    if ((size_t)len < size)
+    {
+        n = vsnprintf(&buf[len], size - len, format, ap);
+    }
+    else
+    {
+        n = vsnprintf(NULL, 0, format, ap);
+    }
+    va_end(ap);
+
+    return len + n;
+}
+
+static
+int proc_sock_line(char *buf, size_t size, int len, const char *id, const struct w5100_socket *s)
+{
+    static const char *const state_names[] = {
+        [W5100_SOCK_STATE_NONE] = "none",
+        [W5100_SOCK_STATE_CREATED] = "created",
+        [W5100_SOCK_STATE_CONNECTED] = "connected",
+        [W5100_SOCK_STATE_BOUND] = "bound",
+        [W5100_SOCK_STATE_LISTENING] = "listening",
+        [W5100_SOCK_STATE_ACCEPTED] = "accepted",
+        [W5100_SOCK_STATE_DISCONNECTED] = "disconnected",
+        [W5100_SOCK_STATE_CONNECTING] = "connecting",
+        [W5100_SOCK_STATE_CLOSING] = "closing",
+    };
+    const uint8_t *peer;
+    int fd;
+
+    if (s->connection_data != NULL)
+    {
+        fd = s->connection_data->fd;
+    }
+    else if (s->fd_data != NULL)
+    {
+        fd = s->fd_data->fd;
+    }
+    else
+    {
+        fd = -1;
+    }
+    peer = (const uint8_t *)&s->dest_address.sin_addr.s_addr;
+    len = proc_printf(buf, size, len, "%-3s %3d %-4s %-12s %5u ",
+            id,
+            fd,
+            (s->type == SOCK_STREAM) ? "tcp" : ((s->type == SOCK_DGRAM) ? "udp" : "raw"),
+            state_names[s->state],
+            (s->sockname.sin_family == AF_INET) ? ntohs(s->sockname.sin_port) : 0);
+    if (s->dest_address.sin_family == AF_INET)
+    {
+        len = proc_printf(buf, size, len, "%u.%u.%u.%u:%u",
+                peer[0], peer[1], peer[2], peer[3], ntohs(s->dest_address.sin_port));
+    }
+    else
+    {
+        len = proc_printf(buf, size, len, "-");
+    }
+    len = proc_printf(buf, size, len, " %lu %lu %lu %lu %lu %lu\n",
+            (unsigned long)s->counters.bytes_sent,
+            (unsigned long)s->counters.bytes_received,
+            (unsigned long)s->counters.send_commands,
+            (unsigned long)s->counters.recv_commands,
+            (unsigned long)s->counters.timeouts,
+            (unsigned long)(w5100_spi_sock_frames(sock_hw((struct w5100_socket *)s)->isocket) - s->counters.spi_frames_start));
+
+    return len;
+}
+
+int w5100_socket_proc_show(char *buf, size_t size)
+{
+    struct w5100_spi_stats spi;
+    int len;
+    int i;
+
+    w5100_spi_stats_get(&spi);
+    len = proc_printf(buf, size, 0,
+            "send_cmds %lu send_bytes %lu recv_cmds %lu recv_bytes %lu timeouts %lu\n"
+            "spi_frames %lu read_bytes %lu write_bytes %lu shadow_hits %lu\n"
+            "id   fd type state         port peer sent recvd sends recvs timeouts spi_frames\n",
+            (unsigned long)socket_stats.send_commands,
+            (unsigned long)socket_stats.send_bytes,
+            (unsigned long)socket_stats.recv_commands,
+            (unsigned long)socket_stats.recv_bytes,
+            (unsigned long)socket_stats.timeouts,
+            (unsigned long)spi.frames,
+            (unsigned long)spi.read_bytes,
+            (unsigned long)spi.write_bytes,
+            (unsigned long)spi.shadow_hits);
+    for (i = 0; i < W5100_N_SOCKETS; i++)
+    {
+        if (w5100_sockets[i].fd != W5100_SOCKET_FREE)
+        {
+            char id[4];
+
+            snprintf(id, sizeof(id), "%d", i);
+            len = proc_sock_line(buf, size, len, id, &w5100_sockets[i]);
+        }
+    }
+#ifdef W5100_UDP_MUX
+    for (i = 0; i < W5100_UDP_MUX_N; i++)
+    {
+        if (w5100_udp_vsockets[i].fd != W5100_SOCKET_FREE)
+        {
+            char id[4];
+
+            snprintf(id, sizeof(id), "v%d", i);
+            len = proc_sock_line(buf, size, len, id, &w5100_udp_vsockets[i]);
+        }
+    }
+#endif
+    return len;
+}
+
 __attribute__((__constructor__))
 void w5100_socket_init(void)
 {
@@ -1634,12 +4886,21 @@ void w5100_socket_init(void)
         continue;
     }
     
+    w5100_int_init();
     for (i = 0; i < W5100_N_SOCKETS; i++)
     {
         socket_free(i);
     }
-    w5100_write_reg(W5100_RMSR, 0x55); /* 2KiB per socket */
-    w5100_write_reg(W5100_TMSR, 0x55); /* 2KiB per socket */
+#ifdef W5100_UDP_MUX
+    for (i = 0; i < W5100_UDP_MUX_N; i++)
+    {
+        w5100_udp_vsockets[i].fd = W5100_SOCKET_FREE;
+    }
+    udp_mux_isocket = -1;
+#endif
+    mem_split_decode(&w5100_rx_split, W5100_RMSR_INIT);
+    mem_split_decode(&w5100_tx_split, W5100_TMSR_INIT);
+    mem_split_apply();
     w5100_write_regx(W5100_SHAR, w5100_mac_addr);
 
 #ifdef W5100_STATIC_IP
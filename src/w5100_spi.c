@@ -18,6 +18,8 @@
  */
 #include <stdint.h>
 #include "w5100.h"
+#include "spi_bus.h"
+#include "critical.h"
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/spi.h>
 #include <libopencm3/stm32/usart.h>
@@ -26,45 +28,341 @@
 #define OP_WRITE 0xF0
 #define OP_READ 0x0F
 
-static
+static struct w5100_spi_stats spi_stats;
+
+/* Shadow of the registers that only the MCU changes, in RAM.
+ * Reads are served from the shadow, writes go through and are skipped
+ * when the value is already there.
+ * The first SHADOW_SIZE bytes of the common register block and of each
+ * socket register block are covered; the masks tell which of them.
+ * Sn_DIPR and Sn_DPORT are filled by the chip when a LISTEN socket
+ * gets connected, so they are only taken from our own writes, and
+ * forgotten at each LISTEN command.
+ * With W5100_SHADOW_CHECK the chip is still accessed and compared with
+ * the shadow, counting the mismatches in the stats.
+ */
+#define SHADOW_SIZE 0x1C
+#define SHADOW_COMMON_MASK 0x0FC7FFFEUL /* GAR..SIPR, IMR..TMSR */
+#define SHADOW_SOCK_MASK   0x0073F031UL /* MR, PORT, DIPR, DPORT, SPROTO..TTL */
+#define SHADOW_PEER_MASK   0x0003F000UL /* DIPR, DPORT */
+
+struct w5100_shadow {
+    uint32_t valid;
+    uint8_t regs[SHADOW_SIZE];
+};
+
+/* common registers, then sockets */
+static struct w5100_shadow shadow[1 + W5100_N_SOCKETS];
+
+/* frames per socket, by address */
+static uint32_t sock_frames[W5100_N_SOCKETS];
+
+/* Clock:
+ * HSI 8MHz is the default
+ * RCC_CFGR_SW = 0b00 -> HSI chosen as SYSCLK
+ * RCC_CFGR_HPRE = 0b0000 -> no AHB prescaler
+ * SPI1 is on APB2
+ * RCC_CFGR_PRE2 = 0b0000 -> no APB2 prescaler
+ * -> FPCLK = 8MHz
+ * -> BR FPCLK/2 -> SCLK @ 4MHz
+ */
+static struct spi_bus_device w5100_spi_dev = {
+    .cs_port = GPIOB, /* CN5_3 D10 PB6 SPI1_CS */
+    .cs_pin = GPIO6,
+    .br = SPI_CR1_BAUDRATE_FPCLK_DIV_2,
+    .cpol = SPI_CR1_CPOL_CLK_TO_0_WHEN_IDLE,
+    .cpha = SPI_CR1_CPHA_CLK_TRANSITION_1,
+};
+
+static inline
 void w5100_select(void)
 {
-    gpio_clear(GPIOB, GPIO6); /* lower chip select */
+    spi_bus_select(&w5100_spi_dev);
 }
 
-static
+static inline
 void w5100_deselect(void)
 {
-    gpio_set(GPIOB, GPIO6); /* raise chip select */
+    spi_bus_deselect(&w5100_spi_dev);
+}
+
+static inline
+void spi_wait_txe(void)
+{
+    while ((SPI_SR(SPI1) & SPI_SR_TXE) == 0)
+    {
+        /* wait for room in the TX buffer */
+    }
+}
+
+static inline
+uint8_t spi_wait_rx(void)
+{
+    while ((SPI_SR(SPI1) & SPI_SR_RXNE) == 0)
+    {
+        /* wait for the received byte */
+    }
+    return SPI_DR(SPI1);
+}
+
+/*
+ * One W5100 SPI frame: opcode, address MSB, address LSB, data.
+ * The W5100 only accepts one data byte per chip select, so the
+ * frame cannot be extended; instead the four bytes are pipelined
+ * directly on the SPI registers, loading the next byte as soon as
+ * TXE is set, so that the bus never idles inside a frame.
+ * With two bytes in flight, a handler running in between would let
+ * RX overrun and lose the RXNE that the frame waits for: the frame
+ * is a critical section, a few microseconds long.
+ */
+static inline
+uint8_t w5100_frame(uint8_t op, uint16_t addr, uint8_t val)
+{
+    uint8_t rx;
+    int cs_state;
+
+    cs_state = critical_section_begin();
+    w5100_select();
+    SPI_DR(SPI1) = op;
+    spi_wait_txe();
+    SPI_DR(SPI1) = (addr >> 8);
+    (void)spi_wait_rx();
+    spi_wait_txe();
+    SPI_DR(SPI1) = (addr & 0xFF);
+    (void)spi_wait_rx();
+    spi_wait_txe();
+    SPI_DR(SPI1) = val;
+    (void)spi_wait_rx();
+    rx = spi_wait_rx();
+    /* clear any stale OVR: read DR then SR */
+    (void)SPI_DR(SPI1);
+    (void)SPI_SR(SPI1);
+    while ((SPI_SR(SPI1) & SPI_SR_BSY) != 0)
+    {
+        /* wait for the last clock edge before raising CS */
+    }
+    w5100_deselect();
+    critical_section_end(cs_state);
+    spi_stats.frames++;
+
+    return rx;
+}
+
+/* Returns the shadow covering addr, or NULL. */
+static
+struct w5100_shadow *shadow_get(uint16_t addr, unsigned *offset)
+{
+    struct w5100_shadow *sh = NULL;
+
+    if (addr < SHADOW_SIZE)
+    {
+        if (SHADOW_COMMON_MASK & (1UL << addr))
+        {
+            sh = &shadow[0];
+            *offset = addr;
+        }
+    }
+    else if (
+            (addr >= W5100_S0_REGS_OFFSET)
+            &&
+            (addr < (W5100_S0_REGS_OFFSET + (W5100_N_SOCKETS * W5100_SOCKET_REGS_SIZE)))
+            )
+    {
+        unsigned sn_reg;
+
+        sn_reg = addr % W5100_SOCKET_REGS_SIZE;
+        if ((sn_reg < SHADOW_SIZE) && (SHADOW_SOCK_MASK & (1UL << sn_reg)))
+        {
+            sh = &shadow[1 + ((addr - W5100_S0_REGS_OFFSET) / W5100_SOCKET_REGS_SIZE)];
+            *offset = sn_reg;
+        }
+    }
+    return sh;
+}
+
+/* Keeps the shadow coherent with what the chip does by itself. */
+static
+void shadow_track_write(uint16_t addr, uint8_t val)
+{
+    if ((addr == W5100_MR) && (val & W5100_MODE_RST))
+    {
+        w5100_shadow_invalidate();
+    }
+    else if (
+            (addr >= W5100_S0_REGS_OFFSET)
+            &&
+            (addr < (W5100_S0_REGS_OFFSET + (W5100_N_SOCKETS * W5100_SOCKET_REGS_SIZE)))
+            &&
+            ((addr % W5100_SOCKET_REGS_SIZE) == W5100_Sn_CR)
+            &&
+            (val == W5100_CMD_LISTEN)
+            )
+    {
+        shadow[1 + ((addr - W5100_S0_REGS_OFFSET) / W5100_SOCKET_REGS_SIZE)].valid &= ~SHADOW_PEER_MASK;
+    }
+}
+
+/* Bus must be taken. */
+static
+uint8_t w5100_reg_read(uint16_t addr)
+{
+    struct w5100_shadow *sh;
+    unsigned offset;
+    uint32_t bit;
+    uint8_t rx;
+
+    sh = shadow_get(addr, &offset);
+    bit = 1UL << offset;
+    if ((sh != NULL) && (sh->valid & bit))
+    {
+        spi_stats.shadow_hits++;
+#ifdef W5100_SHADOW_CHECK
+        rx = w5100_frame(OP_READ, addr, 0x00);
+        if (rx != sh->regs[offset])
+        {
+            spi_stats.shadow_mismatches++;
+            sh->regs[offset] = rx;
+        }
+#else
+        rx = sh->regs[offset];
+#endif
+    }
+    else
+    {
+        rx = w5100_frame(OP_READ, addr, 0x00);
+        if ((sh != NULL) && !((sh != &shadow[0]) && (bit & SHADOW_PEER_MASK)))
+        {
+            sh->regs[offset] = rx;
+            sh->valid |= bit;
+        }
+    }
+    return rx;
+}
+
+/* Bus must be taken. */
+static
+void w5100_reg_write(uint16_t addr, uint8_t val)
+{
+    struct w5100_shadow *sh;
+    unsigned offset;
+    uint32_t bit;
+
+    sh = shadow_get(addr, &offset);
+    bit = 1UL << offset;
+    if ((sh != NULL) && (sh->valid & bit) && (sh->regs[offset] == val))
+    {
+        spi_stats.shadow_hits++;
+#ifdef W5100_SHADOW_CHECK
+        if (w5100_frame(OP_READ, addr, 0x00) != val)
+        {
+            spi_stats.shadow_mismatches++;
+            (void)w5100_frame(OP_WRITE, addr, val);
+        }
+#endif
+    }
+    else
+    {
+        (void)w5100_frame(OP_WRITE, addr, val);
+        if (sh != NULL)
+        {
+            sh->regs[offset] = val;
+            sh->valid |= bit;
+        }
+        else
+        {
+            shadow_track_write(addr, val);
+        }
+    }
+}
+
+/* Socket owning a register or memory address, -1 if none.
+ * The memory split is taken from the shadow of RMSR and TMSR.
+ */
+static
+int sock_owner_get(uint16_t addr)
+{
+    int owner = -1;
+
+    if (
+            (addr >= W5100_S0_REGS_OFFSET)
+            &&
+            (addr < (W5100_S0_REGS_OFFSET + (W5100_N_SOCKETS * W5100_SOCKET_REGS_SIZE)))
+            )
+    {
+        owner = (addr - W5100_S0_REGS_OFFSET) / W5100_SOCKET_REGS_SIZE;
+    }
+    else if (addr >= W5100_TX_MEM_BASE)
+    {
+        uint16_t offset;
+        uint8_t msr;
+        int isocket;
+
+        if (addr >= W5100_RX_MEM_BASE)
+        {
+            offset = addr - W5100_RX_MEM_BASE;
+            msr = shadow[0].regs[W5100_RMSR];
+        }
+        else
+        {
+            offset = addr - W5100_TX_MEM_BASE;
+            msr = shadow[0].regs[W5100_TMSR];
+        }
+        for (isocket = 0; (isocket < W5100_N_SOCKETS) && (owner == -1); isocket++)
+        {
+            uint16_t size;
+
+            size = 0x0400 << ((msr >> (2 * isocket)) & 0x03);
+            if (offset < size)
+            {
+                owner = isocket;
+            }
+            else
+            {
+                offset -= size;
+            }
+        }
+    }
+    return owner;
 }
 
+/* Counts the frames since frames_start for the owner of addr.
+ * An access never spans two sockets.
+ */
 static
-void w5100_xfer_addr(uint16_t reg)
+void sock_frames_account(uint16_t addr, uint32_t frames_start)
 {
-    (void)spi_xfer(SPI1, reg >> 8);
-    (void)spi_xfer(SPI1, reg & 0xFF);
+    int owner;
+
+    owner = sock_owner_get(addr);
+    if (owner != -1)
+    {
+        sock_frames[owner] += spi_stats.frames - frames_start;
+    }
 }
 
 static
 void w5100_write_byte(uint16_t reg, uint8_t val)
 {
-    w5100_select();
-    (void)spi_xfer(SPI1, OP_WRITE);
-    w5100_xfer_addr(reg);
-    (void)spi_xfer(SPI1, val);
-    w5100_deselect();
+    uint32_t frames_start;
+
+    spi_bus_acquire(&w5100_spi_dev);
+    frames_start = spi_stats.frames;
+    w5100_reg_write(reg, val);
+    sock_frames_account(reg, frames_start);
+    spi_bus_release(&w5100_spi_dev);
 }
 
 static
 uint8_t w5100_read_byte(uint16_t reg)
 {
     uint8_t rx;
+    uint32_t frames_start;
 
-    w5100_select();
-    (void)spi_xfer(SPI1, OP_READ);
-    w5100_xfer_addr(reg);
-    rx = spi_xfer(SPI1, 0x00);
-    w5100_deselect();
+    spi_bus_acquire(&w5100_spi_dev);
+    frames_start = spi_stats.frames;
+    rx = w5100_reg_read(reg);
+    sock_frames_account(reg, frames_start);
+    spi_bus_release(&w5100_spi_dev);
 
     return rx;
 }
@@ -118,80 +416,99 @@ void w5100_write_reg2(uint16_t reg, uint16_t val)
 void w5100_read_mem(uint16_t addr, void *buf, size_t n)
 {
     uint8_t *pbytes = buf;
-    size_t i_byte;
+    uint8_t *pend = pbytes + n;
+    uint16_t addr_start = addr;
+    uint32_t frames_start;
 
-    for (i_byte = 0; i_byte < n; i_byte++)
+    spi_bus_acquire(&w5100_spi_dev);
+    frames_start = spi_stats.frames;
+    while (pbytes != pend)
     {
-        pbytes[i_byte] = w5100_read_byte(addr + i_byte);
+        *pbytes = w5100_reg_read(addr);
+        pbytes++;
+        addr++;
     }
+    sock_frames_account(addr_start, frames_start);
+    spi_bus_release(&w5100_spi_dev);
+    spi_stats.read_bytes += n;
 }
 
 void w5100_write_mem(uint16_t addr, const void *buf, size_t n)
 {
     const uint8_t *pbytes = buf;
-    size_t i_byte;
+    const uint8_t *pend = pbytes + n;
+    uint16_t addr_start = addr;
+    uint32_t frames_start;
 
-    for (i_byte = 0; i_byte < n; i_byte++)
+    spi_bus_acquire(&w5100_spi_dev);
+    frames_start = spi_stats.frames;
+    while (pbytes != pend)
     {
-        w5100_write_byte(addr + i_byte, pbytes[i_byte]);
+        w5100_reg_write(addr, *pbytes);
+        pbytes++;
+        addr++;
     }
+    sock_frames_account(addr_start, frames_start);
+    spi_bus_release(&w5100_spi_dev);
+    spi_stats.write_bytes += n;
 }
 
-static
-void w5100_spi_init(void)
-{
-    rcc_periph_clock_enable(RCC_SPI1);
-    rcc_periph_clock_enable(RCC_GPIOA);
-    rcc_periph_clock_enable(RCC_GPIOB);
-
-    gpio_set(GPIOB, GPIO5);
-#ifdef STM32F1
-    /* CN5_6 D13 PA5 SPI1_SCK */
-    gpio_set_mode(GPIOA, GPIO_MODE_OUTPUT_50_MHZ, GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, GPIO_SPI1_SCK);
-    /* CN5_4 D11 PA7 SPI1_MOSI */
-    gpio_set_mode(GPIOA, GPIO_MODE_OUTPUT_50_MHZ, GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, GPIO_SPI1_MOSI);
-    /* CN5_5 D12 PA6 SPI1_MISO */
-    gpio_set_mode(GPIOA, GPIO_MODE_INPUT, GPIO_CNF_INPUT_FLOAT, GPIO_SPI1_MISO);
-    /* CN5_3 D10 PB6 SPI1_CS */
-    gpio_set_mode(GPIOB, GPIO_MODE_OUTPUT_10_MHZ, GPIO_CNF_OUTPUT_PUSHPULL, GPIO6);
-    gpio_set_mode(GPIOB, GPIO_MODE_OUTPUT_10_MHZ, GPIO_CNF_OUTPUT_PUSHPULL, GPIO5);
-#elif defined(STM32F4)
-    /* CN5_6 D13 PA5 SPI1_SCK */
-    /* CN5_4 D11 PA7 SPI1_MOSI */
-    /* CN5_5 D12 PA6 SPI1_MISO */
-    gpio_set_af(GPIOA, GPIO_AF5, GPIO5|GPIO6|GPIO7);
-    gpio_mode_setup(GPIOA, GPIO_MODE_AF, GPIO_PUPD_NONE, GPIO5|GPIO6|GPIO7);
-    /* CN5_3 D10 PB6 SPI1_CS */
-    /* CN9_5 D4 PB5 SD_CS */
-    gpio_mode_setup(GPIOB, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, GPIO5|GPIO6);
-#endif
-    w5100_deselect();
-    
-    /* Clock:
-     * HSI 8MHz is the default
-     * RCC_CFGR_SW = 0b00 -> HSI chosen as SYSCLK
-     * RCC_CFGR_HPRE = 0b0000 -> no AHB prescaler
-     * SPI1 is on APB2
-     * RCC_CFGR_PRE2 = 0b0000 -> no APB2 prescaler
-     * -> FPCLK = 8MHz
-     * -> BR FPCLK/2 -> SCLK @ 4MHz
-     */
-    spi_init_master(
-            SPI1,
-            SPI_CR1_BAUDRATE_FPCLK_DIV_2,
-            SPI_CR1_CPOL_CLK_TO_0_WHEN_IDLE,
-            SPI_CR1_CPHA_CLK_TRANSITION_1,
-            SPI_CR1_DFF_8BIT,
-            SPI_CR1_MSBFIRST);
-
-    spi_enable_software_slave_management(SPI1);
-    spi_set_nss_high(SPI1); /* Avoid Master mode fault MODF */
-    spi_enable(SPI1);
+void w5100_spi_stats_get(struct w5100_spi_stats *stats)
+{
+    *stats = spi_stats;
 }
 
-void w5100_init(void)
+void w5100_spi_stats_reset(void)
+{
+    spi_stats.frames = 0;
+    spi_stats.read_bytes = 0;
+    spi_stats.write_bytes = 0;
+    spi_stats.shadow_hits = 0;
+    spi_stats.shadow_mismatches = 0;
+}
+
+uint32_t w5100_spi_sock_frames(int isocket)
+{
+    uint32_t frames;
+
+    if ((isocket < 0) || (isocket >= W5100_N_SOCKETS))
+    {
+        frames = 0;
+    }
+    else
+    {
+        frames = sock_frames[isocket];
+    }
+    return frames;
+}
+
+void w5100_shadow_invalidate(void)
 {
-    w5100_spi_init();
+    int i;
 
+    for (i = 0; i < (1 + W5100_N_SOCKETS); i++)
+    {
+        shadow[i].valid = 0;
+    }
+}
+
+int w5100_spi_trylock(void)
+{
+    return spi_bus_try_acquire(&w5100_spi_dev);
+}
+
+void w5100_spi_lock(void)
+{
+    spi_bus_acquire(&w5100_spi_dev);
+}
+
+void w5100_spi_unlock(void)
+{
+    spi_bus_release(&w5100_spi_dev);
+}
+
+void w5100_init(void)
+{
+    spi_bus_init();
 }
 
@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2016 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <libopencm3/cm3/cortex.h>
+#include <libopencm3/cm3/dwt.h>
+#include <libopencm3/stm32/rcc.h>
+#include "wait.h"
+#include "timespec.h"
+#include "critical.h"
+
+/* Closer than this to the deadline, sleeping until the next SysTick
+ * would overshoot it: the wait spins on the clock instead.
+ */
+#ifndef WAIT_SPIN_NS
+#  define WAIT_SPIN_NS 1000000 /* SysTick period */
+#endif
+
+/* Deadline hints kept at the same time; when full, the latest one
+ * gives way to an earlier one.
+ */
+#ifndef WAIT_HINTS_MAX
+#  define WAIT_HINTS_MAX 8
+#endif
+
+enum wait_mode {
+    WAIT_MODE_EVENT,
+    WAIT_MODE_INTERRUPT,
+    WAIT_MODE_TIME,
+};
+
+static volatile
+unsigned int wait_seq;
+
+static
+struct timespec wait_hints[WAIT_HINTS_MAX];
+
+static
+int wait_hints_n;
+
+static
+struct {
+    int started;
+    int has_cycle_counter;
+    uint64_t idle_cycles;
+    struct timespec start;
+} wait_stats;
+
+unsigned int wait_event_seq(void)
+{
+    return wait_seq;
+}
+
+void wait_event_signal(void)
+{
+    /* a lost increment between nested handlers still changes it */
+    wait_seq++;
+}
+
+void wait_deadline_hint(const struct timespec *t)
+{
+    int cs_state;
+    int i_hint;
+    int i_latest;
+    int found;
+
+    cs_state = critical_section_begin();
+    found = 0;
+    i_latest = 0;
+    for (i_hint = 0; i_hint < wait_hints_n; i_hint++)
+    {
+        if (timespec_diff(&wait_hints[i_hint], t, NULL) == 0)
+        {
+            found = 1;
+            break;
+        }
+        if (timespec_diff(&wait_hints[i_hint], &wait_hints[i_latest], NULL) > 0)
+        {
+            i_latest = i_hint;
+        }
+    }
+    if (found)
+    {
+        /* already there */
+    }
+    else if (wait_hints_n < WAIT_HINTS_MAX)
+    {
+        wait_hints[wait_hints_n] = *t;
+        wait_hints_n++;
+    }
+    else if (timespec_diff(&wait_hints[i_latest], t, NULL) > 0)
+    {
+        wait_hints[i_latest] = *t;
+    }
+    critical_section_end(cs_state);
+}
+
+/* Forgets the hints that have passed, and returns 1 if there were any.
+ * Otherwise shortens left to the earliest hint, and returns 0.
+ */
+static
+int wait_hints_check(const struct timespec *now, struct timespec *left)
+{
+    int ret;
+    int cs_state;
+    int i_hint;
+    struct timespec hint_left;
+
+    ret = 0;
+    cs_state = critical_section_begin();
+    i_hint = 0;
+    while (i_hint < wait_hints_n)
+    {
+        if (timespec_diff(&wait_hints[i_hint], now, &hint_left) <= 0)
+        {
+            wait_hints_n--;
+            wait_hints[i_hint] = wait_hints[wait_hints_n];
+            ret = 1;
+        }
+        else
+        {
+            if (timespec_diff(left, &hint_left, NULL) > 0)
+            {
+                *left = hint_left;
+            }
+            i_hint++;
+        }
+    }
+    critical_section_end(cs_state);
+
+    return ret;
+}
+
+void wait_stats_reset(void)
+{
+    wait_stats.has_cycle_counter = dwt_enable_cycle_counter();
+    wait_stats.idle_cycles = 0;
+    clock_gettime(CLOCK_MONOTONIC, &wait_stats.start);
+    wait_stats.started = 1;
+}
+
+unsigned int wait_idle_percent(void)
+{
+    unsigned int ret;
+    struct timespec now;
+    struct timespec elapsed;
+    uint64_t total_cycles;
+
+    if (!wait_stats.started || !wait_stats.has_cycle_counter)
+    {
+        ret = 0;
+    }
+    else
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        timespec_diff(&now, &wait_stats.start, &elapsed);
+        total_cycles = (uint64_t)elapsed.tv_sec * rcc_ahb_frequency;
+        total_cycles += ((uint64_t)elapsed.tv_nsec * (rcc_ahb_frequency / MSECS_IN_SEC)) / (NSECS_IN_SEC / MSECS_IN_SEC);
+        if (total_cycles == 0)
+        {
+            ret = 0;
+        }
+        else
+        {
+            ret = (wait_stats.idle_cycles * 100) / total_cycles;
+        }
+    }
+    return ret;
+}
+
+/* In handlers, the interrupts that would wake WFI might not have the
+ * priority to be served; with masked interrupts no event could change
+ * what the caller is waiting for.
+ */
+int wait_allowed(void)
+{
+    uint32_t ipsr;
+
+    __asm__ volatile ("mrs %0, ipsr" : "=r" (ipsr));
+
+    return (ipsr == 0) && !cm_is_masked_interrupts() && !cm_is_masked_faults();
+}
+
+static
+void wait_sleep(enum wait_mode mode, unsigned int seq)
+{
+    /* With PRIMASK set, a pending interrupt still ends WFI, and it is
+     * served when interrupts are enabled again: an event signalled
+     * after the check below cannot be missed.
+     */
+    cm_disable_interrupts();
+    if ((mode != WAIT_MODE_EVENT) || (wait_seq == seq))
+    {
+        uint32_t start;
+
+        start = dwt_read_cycle_counter();
+        __asm__ volatile ("wfi");
+        wait_stats.idle_cycles += (uint32_t)(dwt_read_cycle_counter() - start);
+    }
+    cm_enable_interrupts();
+}
+
+static
+int wait_loop(enum wait_mode mode, unsigned int seq, clockid_t clock_id, const struct timespec *deadline)
+{
+    int ret;
+
+    if (!wait_stats.started)
+    {
+        wait_stats_reset();
+    }
+    do
+    {
+        struct timespec now;
+        struct timespec left;
+
+        if (clock_gettime(clock_id, &now) != 0)
+        {
+            ret = -1;
+            break;
+        }
+        if ((mode == WAIT_MODE_EVENT) && (wait_seq != seq))
+        {
+            ret = 1;
+            break;
+        }
+        if (timespec_diff(deadline, &now, &left) <= 0)
+        {
+            ret = 0;
+            break;
+        }
+        if ((mode != WAIT_MODE_TIME) && wait_hints_check(&now, &left))
+        {
+            ret = 1;
+            break;
+        }
+        if (
+                ((left.tv_sec > 0) || (left.tv_nsec >= WAIT_SPIN_NS))
+                &&
+                wait_allowed()
+           )
+        {
+            wait_sleep(mode, seq);
+        }
+        /* else spin on the clock */
+        if (mode == WAIT_MODE_INTERRUPT)
+        {
+            /* polled conditions are checked again */
+            ret = 1;
+            break;
+        }
+    } while (1);
+
+    return ret;
+}
+
+int wait_event(unsigned int seq, const struct timespec *deadline)
+{
+    int ret;
+
+    ret = wait_loop(WAIT_MODE_EVENT, seq, CLOCK_MONOTONIC, deadline);
+    if (ret == -1)
+    {
+        /* no clock, no deadline: let the caller check again */
+        ret = 1;
+    }
+    return ret;
+}
+
+int wait_interrupt(const struct timespec *deadline)
+{
+    int ret;
+
+    ret = wait_loop(WAIT_MODE_INTERRUPT, 0, CLOCK_MONOTONIC, deadline);
+    if (ret == -1)
+    {
+        ret = 1;
+    }
+    return ret;
+}
+
+int wait_until(clockid_t clock_id, const struct timespec *deadline)
+{
+    int ret;
+
+    ret = wait_loop(WAIT_MODE_TIME, 0, clock_id, deadline);
+    if (ret != -1)
+    {
+        ret = 0;
+    }
+    return ret;
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2016 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include "wait.h"
+
+static
+int tick_pipe[2];
+
+/* Runs in the timer interrupt: the pipe hands the ticks to main. */
+static
+void tick(union sigval value)
+{
+    static unsigned int n;
+
+    (void)value;
+    n++;
+    write(tick_pipe[1], &n, sizeof(n));
+}
+
+static
+int socketpair_test(void)
+{
+    int sv[2];
+    char buf[16];
+    ssize_t n;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+    {
+        perror("socketpair");
+        return 1;
+    }
+    write(sv[0], "ping", 4);
+    n = read(sv[1], buf, sizeof(buf));
+    printf("socketpair: %.*s\n", (int)n, buf);
+    write(sv[1], "pong", 4);
+    n = read(sv[0], buf, sizeof(buf));
+    printf("socketpair: %.*s\n", (int)n, buf);
+    close(sv[1]);
+    n = read(sv[0], buf, sizeof(buf));
+    printf("socketpair: read after close %d\n", (int)n);
+    close(sv[0]);
+
+    return 0;
+}
+
+int main(void)
+{
+    struct sigevent ev;
+    timer_t timerid;
+    struct itimerspec timspec;
+
+    if (socketpair_test() != 0)
+    {
+        return 1;
+    }
+
+    if (pipe(tick_pipe) != 0)
+    {
+        perror("pipe");
+        return 1;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.sigev_notify = SIGEV_THREAD;
+    ev.sigev_notify_function = tick;
+    ev.sigev_value.sival_int = 0;
+    if (timer_create(CLOCK_MONOTONIC, &ev, &timerid) != 0)
+    {
+        perror("timer_create");
+        return 1;
+    }
+    timspec.it_interval.tv_sec = 0;
+    timspec.it_interval.tv_nsec = 250*1000*1000;
+    timspec.it_value = timspec.it_interval;
+    if (timer_settime(timerid, 0, &timspec, NULL) != 0)
+    {
+        perror("timer_settime");
+        return 1;
+    }
+
+    while(1)
+    {
+        struct pollfd p;
+        unsigned int n;
+
+        p.fd = tick_pipe[0];
+        p.events = POLLIN;
+        if (poll(&p, 1, 1000) < 0)
+        {
+            perror("poll");
+            return 1;
+        }
+        else if ((p.revents & POLLIN) && (read(tick_pipe[0], &n, sizeof(n)) == sizeof(n)))
+        {
+            printf("tick %u, idle %u%%\n", n, wait_idle_percent());
+        }
+        else
+        {
+            printf("no tick\n");
+        }
+    }
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2016 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "w5100_socket.h"
+
+#define SERVER_PORT 8080
+#define FILE_PATH "index.htm"
+
+static
+void show_info(int client_sock)
+{
+    struct tcp_info info;
+    socklen_t info_len = sizeof(info);
+    char buf[128];
+    int fd;
+    ssize_t n;
+
+    if (getsockopt(client_sock, IPPROTO_TCP, TCP_INFO, &info, &info_len) != 0)
+    {
+        perror("TCP_INFO");
+    }
+    else
+    {
+        printf("TCP_INFO state 0x%02x mss %u sent %lu in %lu segments, %lu SPI frames\n",
+                info.tcpi_state, info.tcpi_snd_mss,
+                (unsigned long)info.tcpi_bytes_sent,
+                (unsigned long)info.tcpi_segs_out,
+                (unsigned long)info.tcpi_spi_frames);
+    }
+    fd = open("/proc/net/w5100", O_RDONLY);
+    if (fd < 0)
+    {
+        perror("/proc/net/w5100");
+        return;
+    }
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+    {
+        fwrite(buf, 1, n, stdout);
+    }
+    close(fd);
+}
+
+static
+void serve(int client_sock)
+{
+    int fd;
+    off_t offset = 0;
+    off_t size;
+    struct w5100_socket_stats stats;
+
+    fd = open(FILE_PATH, O_RDONLY);
+    if (fd < 0)
+    {
+        perror(FILE_PATH);
+        return;
+    }
+    size = lseek(fd, 0, SEEK_END);
+    w5100_socket_stats_reset();
+    while (offset < size)
+    {
+        ssize_t sent;
+
+        sent = sendfile(client_sock, fd, &offset, size - offset);
+        if (sent <= 0)
+        {
+            perror("sendfile");
+            break;
+        }
+    }
+    w5100_socket_stats_get(&stats);
+    printf("sent %ld/%ld bytes with %lu SEND commands\n",
+            (long)offset, (long)size, (unsigned long)stats.send_commands);
+    close(fd);
+}
+
+int main(void)
+{
+    int server_sock;
+    struct sockaddr_in server;
+
+    printf("Press any key to continue...");
+    getchar();
+    printf("\n");
+
+    server_sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_sock < 0)
+    {
+        perror("socket");
+        return 1;
+    }
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = INADDR_ANY;
+    server.sin_port = htons(SERVER_PORT);
+    if (bind(server_sock, (struct sockaddr *)&server, sizeof(server)) != 0)
+    {
+        perror("bind");
+        return 1;
+    }
+    if (listen(server_sock, SOMAXCONN) != 0)
+    {
+        perror("listen");
+        return 1;
+    }
+    while (1)
+    {
+        int client_sock;
+
+        printf("Waiting for a client on port %d to send " FILE_PATH "...\n", SERVER_PORT);
+        client_sock = accept(server_sock, NULL, NULL);
+        if (client_sock < 0)
+        {
+            perror("accept");
+            break;
+        }
+        serve(client_sock);
+        show_info(client_sock);
+        close(client_sock);
+    }
+    close(server_sock);
+
+    return 0;
+}
@@ -7,6 +7,8 @@
 #include <unistd.h>    //close
 #include <sys/socket.h>    //socket
 #include <arpa/inet.h> //inet_addr
+#include <netinet/in.h>
+#include <netinet/tcp.h> //TCP_USER_TIMEOUT
 
 #ifndef SERVER_IP_ADDR
 #  define SERVER_IP_ADDR "192.168.1.173"
@@ -22,6 +24,9 @@ int loop(void)
     int sock;
     struct sockaddr_in server;
     char message[1000] , server_reply[2000];
+    int opt;
+    struct tcp_info info;
+    socklen_t info_len;
     
     printf("Press any key to continue...");
     getchar();
@@ -35,6 +40,15 @@ int loop(void)
         return 1;
     }
     puts("Socket created\n");
+
+    //Give up quickly on a dead server: 2 SYN retries, then retransmit
+    //at the pace of the measured RTT for at most 100ms
+    opt = 2;
+    setsockopt(sock, IPPROTO_TCP, TCP_SYNCNT, &opt, sizeof(opt));
+    opt = 100;
+    setsockopt(sock, IPPROTO_TCP, TCP_USER_TIMEOUT, &opt, sizeof(opt));
+    opt = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_RTO_ADAPTIVE, &opt, sizeof(opt));
      
     server.sin_addr.s_addr = inet_addr(SERVER_IP_ADDR);
     server.sin_family = AF_INET;
@@ -73,6 +87,16 @@ int loop(void)
          
         puts("Server reply :");
         puts(server_reply);
+
+        info_len = sizeof(info);
+        if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &info_len) == 0)
+        {
+            printf("rtt %luus rttvar %luus rto %luus retries %u\n",
+                    (unsigned long)info.tcpi_rtt,
+                    (unsigned long)info.tcpi_rttvar,
+                    (unsigned long)info.tcpi_rto,
+                    info.tcpi_retries);
+        }
     }
      
     close(sock);
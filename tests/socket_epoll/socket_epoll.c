@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2016 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define SERVER_PORT 8888
+#define MAX_EVENTS 4
+
+/* Echo server for several clients at once, that also prints what
+ * arrives from the USART, with one epoll instance.
+ */
+int main(void)
+{
+    int epfd;
+    int server_sock;
+    struct sockaddr_in server;
+    struct epoll_event ev;
+
+    printf("Press any key to continue...");
+    getchar();
+    printf("\n");
+
+    epfd = epoll_create1(0);
+    if (epfd < 0)
+    {
+        perror("epoll_create1");
+        return 1;
+    }
+    server_sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_sock < 0)
+    {
+        perror("socket");
+        return 1;
+    }
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = INADDR_ANY;
+    server.sin_port = htons(SERVER_PORT);
+    if (bind(server_sock, (struct sockaddr *)&server, sizeof(server)) != 0)
+    {
+        perror("bind");
+        return 1;
+    }
+    if (listen(server_sock, SOMAXCONN) != 0)
+    {
+        perror("listen");
+        return 1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = server_sock;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, server_sock, &ev) != 0)
+    {
+        perror("epoll_ctl server");
+        return 1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = STDIN_FILENO;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) != 0)
+    {
+        perror("epoll_ctl stdin");
+        return 1;
+    }
+    printf("Waiting for clients on port %d...\n", SERVER_PORT);
+    while (1)
+    {
+        struct epoll_event events[MAX_EVENTS];
+        int n;
+        int i;
+
+        n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n < 0)
+        {
+            perror("epoll_wait");
+            break;
+        }
+        for (i = 0; i < n; i++)
+        {
+            int fd = events[i].data.fd;
+
+            if (fd == server_sock)
+            {
+                int client_sock;
+
+                client_sock = accept(server_sock, NULL, NULL);
+                if (client_sock < 0)
+                {
+                    perror("accept");
+                    continue;
+                }
+                ev.events = EPOLLIN;
+                ev.data.fd = client_sock;
+                if (epoll_ctl(epfd, EPOLL_CTL_ADD, client_sock, &ev) != 0)
+                {
+                    perror("epoll_ctl client");
+                    close(client_sock);
+                }
+                else
+                {
+                    printf("Client %d connected\n", client_sock);
+                }
+            }
+            else if (fd == STDIN_FILENO)
+            {
+                printf("USART: %c\n", getchar());
+            }
+            else if (events[i].events & (EPOLLHUP|EPOLLERR))
+            {
+                printf("Client %d disconnected\n", fd);
+                epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+                close(fd);
+            }
+            else
+            {
+                char buf[256];
+                ssize_t len;
+
+                len = recv(fd, buf, sizeof(buf), 0);
+                if (len > 0)
+                {
+                    send(fd, buf, len, 0);
+                }
+            }
+        }
+    }
+    close(server_sock);
+    close(epfd);
+
+    return 0;
+}
@@ -7,12 +7,15 @@
 #include <string.h>    //strlen
 #include <sys/socket.h>
 #include <arpa/inet.h> //inet_addr
+#include <netinet/in.h>
+#include <netinet/tcp.h> //TCP_KEEPIDLE
 #include <unistd.h>    //write
 
 static
 int loop(void)
 {
     int socket_desc , client_sock , c , read_size;
+    int keepalive;
     struct sockaddr_in server , client;
     char client_message[2000];
      
@@ -43,6 +46,15 @@ int loop(void)
     }
     puts("bind done");
      
+    //Drop clients that vanish without closing, after 10s idle and a probe:
+    //the accepted sockets inherit the options
+    keepalive = 1;
+    setsockopt(socket_desc, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive));
+    keepalive = 10;
+    setsockopt(socket_desc, IPPROTO_TCP, TCP_KEEPIDLE, &keepalive, sizeof(keepalive));
+    keepalive = 5;
+    setsockopt(socket_desc, IPPROTO_TCP, TCP_KEEPINTVL, &keepalive, sizeof(keepalive));
+
     //Listen
     if (listen(socket_desc , SOMAXCONN) != 0)
     {
@@ -67,6 +79,15 @@ int loop(void)
             return 1;
         }
         puts("Connection accepted");
+        c = sizeof(keepalive);
+        if (getsockopt(client_sock, SOL_SOCKET, SO_KEEPALIVE, &keepalive, (socklen_t*)&c) != 0)
+        {
+            perror("getsockopt failed");
+        }
+        else
+        {
+            printf("SO_KEEPALIVE: %d\n", keepalive);
+        }
          
         //Receive a message from client
         while( (read_size = recv(client_sock , client_message , 2000 , 0)) > 0 )
@@ -18,6 +18,7 @@
  */
 #include <stdio.h>
 #include <time.h>
+#include "wait.h"
 
 int main(void)
 {
@@ -26,7 +27,7 @@ int main(void)
     while(1)
     {
         clock_gettime(CLOCK_MONOTONIC, &t);
-        printf("%lds %ldns\n", (long)t.tv_sec, (long)t.tv_nsec);
+        printf("%lds %ldns idle %u%%\n", (long)t.tv_sec, (long)t.tv_nsec, wait_idle_percent());
 
         t.tv_sec = 1;
         t.tv_nsec = 0;
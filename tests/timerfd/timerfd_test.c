@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2016 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+
+static
+int efd;
+
+/* Runs in the timer interrupt: the eventfd wakes up main. */
+static
+void kick(union sigval value)
+{
+    (void)value;
+    eventfd_write(efd, 1);
+}
+
+/* A periodic timerfd and an eventfd written from an interrupt, in the
+ * same poll as the USART.
+ */
+int main(void)
+{
+    int tfd;
+    struct itimerspec period;
+    struct sigevent ev;
+    timer_t kick_timer;
+    struct itimerspec kick_period;
+    struct pollfd fds[3];
+
+    tfd = timerfd_create(CLOCK_MONOTONIC, 0);
+    if (tfd < 0)
+    {
+        perror("timerfd_create");
+        return 1;
+    }
+    period.it_interval.tv_sec = 0;
+    period.it_interval.tv_nsec = 500*1000*1000;
+    period.it_value = period.it_interval;
+    if (timerfd_settime(tfd, 0, &period, NULL) != 0)
+    {
+        perror("timerfd_settime");
+        return 1;
+    }
+
+    efd = eventfd(0, 0);
+    if (efd < 0)
+    {
+        perror("eventfd");
+        return 1;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.sigev_notify = SIGEV_THREAD;
+    ev.sigev_notify_function = kick;
+    if (timer_create(CLOCK_MONOTONIC, &ev, &kick_timer) != 0)
+    {
+        perror("timer_create");
+        return 1;
+    }
+    kick_period.it_interval.tv_sec = 2;
+    kick_period.it_interval.tv_nsec = 0;
+    kick_period.it_value = kick_period.it_interval;
+    if (timer_settime(kick_timer, 0, &kick_period, NULL) != 0)
+    {
+        perror("timer_settime");
+        return 1;
+    }
+
+    fds[0].fd = tfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = efd;
+    fds[1].events = POLLIN;
+    fds[2].fd = STDIN_FILENO;
+    fds[2].events = POLLIN;
+    while(1)
+    {
+        if (poll(fds, 3, -1) < 0)
+        {
+            perror("poll");
+            return 1;
+        }
+        if (fds[0].revents & POLLIN)
+        {
+            uint64_t expirations;
+
+            if (read(tfd, &expirations, sizeof(expirations)) == sizeof(expirations))
+            {
+                printf("timerfd: %lu expirations\n", (unsigned long)expirations);
+            }
+        }
+        if (fds[1].revents & POLLIN)
+        {
+            eventfd_t count;
+
+            if (eventfd_read(efd, &count) == 0)
+            {
+                printf("eventfd: %lu\n", (unsigned long)count);
+            }
+        }
+        if (fds[2].revents & POLLIN)
+        {
+            printf("key: %c\n", getchar());
+        }
+    }
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2015 Francesco Balducci
+ *
+ * This file is part of nucleo_tests.
+ *
+ *    nucleo_tests is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    nucleo_tests is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with nucleo_tests.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "w5100.h"
+#include "timespec.h"
+
+#define BENCH_ADDR W5100_TX_MEM_BASE
+#define BENCH_SIZE 2048
+#define BENCH_LOOPS 8
+
+static uint8_t buf[BENCH_SIZE];
+
+static
+void print_result(const char *what, const struct timespec *start, const struct timespec *end)
+{
+    struct timespec elapsed;
+    struct w5100_spi_stats stats;
+    unsigned long usecs;
+    unsigned long bytes;
+
+    timespec_diff(end, start, &elapsed);
+    usecs = (elapsed.tv_sec * USECS_IN_SEC) + (elapsed.tv_nsec / (NSECS_IN_SEC / USECS_IN_SEC));
+    w5100_spi_stats_get(&stats);
+    bytes = stats.read_bytes + stats.write_bytes;
+    printf("%s: %lu bytes in %lu us", what, bytes, usecs);
+    if (usecs > 0)
+    {
+        printf(" (%lu B/s)", (unsigned long)(((unsigned long long)bytes * USECS_IN_SEC) / usecs));
+    }
+    printf(", %lu frames, %lu bus bytes\n",
+            (unsigned long)stats.frames,
+            (unsigned long)stats.frames * 4);
+}
+
+int main(void)
+{
+    struct timespec start;
+    struct timespec end;
+    int i;
+
+    printf("Press any key to start...");
+    getchar();
+    printf("\n");
+
+    w5100_init();
+
+    for (i = 0; i < BENCH_SIZE; i++)
+    {
+        buf[i] = i;
+    }
+
+    w5100_spi_stats_reset();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < BENCH_LOOPS; i++)
+    {
+        w5100_write_mem(BENCH_ADDR, buf, sizeof(buf));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    print_result("write", &start, &end);
+
+    memset(buf, 0, sizeof(buf));
+    w5100_spi_stats_reset();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < BENCH_LOOPS; i++)
+    {
+        w5100_read_mem(BENCH_ADDR, buf, sizeof(buf));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    print_result("read", &start, &end);
+
+    for (i = 0; i < BENCH_SIZE; i++)
+    {
+        if (buf[i] != (uint8_t)i)
+        {
+            printf("mismatch at %d: %02X\n", i, (unsigned)buf[i]);
+            return 1;
+        }
+    }
+    printf("data OK\n");
+
+    return 0;
+}
+